@@ -1,4 +1,9 @@
-from netboot.hostutils import Host, HostException, HostStatusEnum, SettingsEnum
+from netboot.hostutils import FanOut, Host, HostException, HostStatusEnum, SettingsEnum
+from netboot.crccache import CRCCache
+from netboot.imagecache import ImageCache
+from netboot.prober import LivenessProber, ProbeStats
+from netboot.scheduler import ScheduledTask, Scheduler
+from netboot.transfers import TransferPolicyEnum, TransferScheduler
 from netboot.cabinet import Cabinet, CabinetManager, CabinetStateEnum, CabinetRegionEnum, CabinetPowerStateEnum
 from netboot.directory import DirectoryManager
 from netboot.patch import PatchManager
@@ -7,9 +12,18 @@ from netboot.settings import SettingsManager
 
 __all__ = [
     "SettingsEnum",
+    "FanOut",
     "Host",
     "HostException",
     "HostStatusEnum",
+    "CRCCache",
+    "ImageCache",
+    "LivenessProber",
+    "ProbeStats",
+    "ScheduledTask",
+    "Scheduler",
+    "TransferPolicyEnum",
+    "TransferScheduler",
     "Cabinet",
     "CabinetManager",
     "CabinetStateEnum",
@@ -5,13 +5,17 @@ import threading
 import time
 import yaml
 from cachetools import TTLCache
+from contextlib import contextmanager
 from enum import Enum
-from typing import Dict, List, Optional, Sequence, Tuple, Union, cast
+from typing import Any, Dict, Iterator, List, Optional, Sequence, Tuple, Union, cast
 
 from naomi import NaomiSettingsPatcher
 from netdimm import NetDimmInfo, NetDimmException, NetDimmVersionEnum, NetDimmTargetEnum, CRCStatusEnum
-from netboot.hostutils import Host, HostStatusEnum, SettingsEnum
+from netboot.hostutils import FanOut, Host, HostStatusEnum, SettingsEnum
 from netboot.log import log
+from netboot.prober import LivenessProber
+from netboot.scheduler import ScheduledTask, Scheduler
+from netboot.transfers import TransferScheduler
 from smartoutlet import OutletInterface, ALL_OUTLET_CLASSES
 
 
@@ -23,6 +27,7 @@ class CabinetStateEnum(Enum):
     STATE_TURNED_OFF = "turned_off"
     STATE_STARTUP = "startup"
     STATE_WAIT_FOR_CABINET_POWER_ON = "wait_power_on"
+    STATE_WAIT_FOR_SEND_SLOT = "wait_send_slot"
     STATE_SEND_CURRENT_GAME = "send_game"
     STATE_CHECK_CURRENT_GAME = "check_game"
     STATE_WAIT_FOR_CABINET_POWER_OFF = "wait_power_off"
@@ -66,7 +71,12 @@ class Cabinet:
         enabled: bool = True,
         controllable: bool = True,
         power_cycle: bool = False,
+        pinned: bool = False,
         quiet: bool = False,
+        transfers: Optional[TransferScheduler] = None,
+        fanout: Optional[FanOut] = None,
+        prober: Optional[LivenessProber] = None,
+        scheduler: Optional[Scheduler] = None,
     ) -> None:
         self.description: str = description
         self.region: CabinetRegionEnum = region
@@ -75,8 +85,13 @@ class Cabinet:
         self.srams: Dict[str, Optional[str]] = {rom: srams[rom] for rom in srams}
         self.quiet = quiet
         self.power_cycle = power_cycle
+        # Pinned cabinets go to the front of the line when games need sending.
+        self.pinned = pinned
+        self.transfers: TransferScheduler = transfers or TransferScheduler.default()
+        # Cabinets that want the same game at the same time get sent it together.
+        self.fanout: FanOut = fanout or FanOut.default()
         self.__enabled = enabled
-        self.__host: Host = Host(ip, target=target, version=version, send_timeout=send_timeout, time_hack=time_hack, quiet=self.quiet)
+        self.__host: Host = Host(ip, target=target, version=version, send_timeout=send_timeout, time_hack=time_hack, quiet=self.quiet, fanout=self.fanout, prober=prober, scheduler=scheduler)
         self.__lock: threading.Lock = threading.Lock()
         self.__current_filename: Optional[str] = filename
         self.__new_filename: Optional[str] = filename
@@ -132,6 +147,13 @@ class Cabinet:
             except (FileNotFoundError, PermissionError):
                 return
 
+    def __image_size(self, filename: str) -> int:
+        # Patches and settings don't change the size much, so the ROM is close enough.
+        try:
+            return os.path.getsize(filename)
+        except OSError:
+            return 0
+
     def __repr__(self) -> str:
         with self.__lock:
             return f"Cabinet(ip={repr(self.ip)}, enabled={repr(self.__enabled)}, time_hack={repr(self.time_hack)}, send_timeout={repr(self.send_timeout)}, description={repr(self.description)}, filename={repr(self.filename)}, patches={repr(self.patches)}, settings={repr(self.settings)}, srams={repr(self.srams)}, target={repr(self.target)}, version={repr(self.version)})"
@@ -140,6 +162,11 @@ class Cabinet:
     def ip(self) -> str:
         return self.__host.ip
 
+    def close(self) -> None:
+        # Stop everything the host does in the background, for cabinets that are going away.
+        self.fanout.want(self.ip, None)
+        self.__host.close()
+
     @property
     def target(self) -> NetDimmTargetEnum:
         return self.__host.target
@@ -255,12 +282,30 @@ class Cabinet:
         if not self.quiet:
             log(string, newline=newline)
 
+    @contextmanager
+    def __releasing_slot(self) -> Iterator[None]:
+        # Anything other than sending or waiting to send once a tick is done means we don't
+        # need our place in line any more, so let the next cabinet have it. Note that this
+        # should only be used by something that has a lock.
+        try:
+            yield
+        finally:
+            state = self.__state[0]
+            if state not in {CabinetStateEnum.STATE_WAIT_FOR_SEND_SLOT, CabinetStateEnum.STATE_SEND_CURRENT_GAME}:
+                self.transfers.release(self.ip)
+
+            # Let sends of our game know to wait for us if we're about to want it too.
+            wanting = state == CabinetStateEnum.STATE_WAIT_FOR_SEND_SLOT or (
+                state == CabinetStateEnum.STATE_WAIT_FOR_CABINET_POWER_ON and self.__enabled and self.__host.responding
+            )
+            self.fanout.want(self.ip, self.__new_filename if wanting else None)
+
     def tick(self) -> None:
         """
         Tick the state machine forward.
         """
 
-        with self.__lock:
+        with self.__lock, self.__releasing_slot():
             self.__host.tick()
             current_state = self.__state[0]
 
@@ -293,8 +338,13 @@ class Cabinet:
 
             # Wait for cabinet to power on state, transition to sending game
             # if the cabinet is active, transition to self if cabinet is not.
-            if current_state == CabinetStateEnum.STATE_WAIT_FOR_CABINET_POWER_ON:
-                if self.__host.alive:
+            # Also wait for our turn to send if too many other cabinets are sending.
+            if current_state in {CabinetStateEnum.STATE_WAIT_FOR_CABINET_POWER_ON, CabinetStateEnum.STATE_WAIT_FOR_SEND_SLOT}:
+                if not self.__host.alive:
+                    if current_state == CabinetStateEnum.STATE_WAIT_FOR_SEND_SLOT:
+                        self.__print(f"Cabinet {self.ip} turned off, waiting for power on.")
+                        self.__state = (CabinetStateEnum.STATE_WAIT_FOR_CABINET_POWER_ON, 0)
+                else:
                     if self.__new_filename is None:
                         # Skip sending game, there's nothing to send
                         self.__print(f"Cabinet {self.ip} has no associated game, waiting for power off.")
@@ -329,9 +379,24 @@ class Cabinet:
                                     self.__state = (CabinetStateEnum.STATE_CHECK_CURRENT_GAME, 0)
                                     return
 
+                        # Get in line, or keep our place, behind everybody else sending games. If
+                        # the same game is about to go out to other cabinets, join in on that
+                        # instead, since it only takes up the one place in line between us.
+                        patches = self.patches.get(self.__new_filename, [])
+                        if self.fanout.joinable(self.__new_filename, patches, settings, self.target, self.version):
+                            self.transfers.release(self.ip)
+                            position = 0
+                        else:
+                            position = self.transfers.request(self.ip, self.__image_size(self.__new_filename), self.pinned)
+                        if position > 0:
+                            if current_state != CabinetStateEnum.STATE_WAIT_FOR_SEND_SLOT:
+                                self.__print(f"Cabinet {self.ip} waiting to send game {self.__new_filename}, number {position} in line.")
+                            self.__state = (CabinetStateEnum.STATE_WAIT_FOR_SEND_SLOT, position)
+                            return
+
                         self.__print(f"Cabinet {self.ip} sending game {self.__new_filename}.")
                         self.__current_filename = self.__new_filename
-                        self.__host.send(self.__new_filename, self.patches.get(self.__new_filename, []), settings)
+                        self.__host.send(self.__new_filename, patches, settings, rate=self.transfers.rate(self.ip))
                         self.__state = (CabinetStateEnum.STATE_SEND_CURRENT_GAME, 0)
                 return
 
@@ -460,12 +525,18 @@ empty = EmptyObject()
 
 
 class CabinetManager:
-    def __init__(self, cabinets: Sequence[Cabinet]) -> None:
+    # How often each cabinet's state machine is ticked forward. Each cabinet is its own
+    # task on the scheduler, so ticks for different cabinets run side by side on its
+    # workers and one cabinet stuck talking to its net dimm doesn't hold up the others.
+    TICK_SECONDS: float = 1.0
+
+    def __init__(self, cabinets: Sequence[Cabinet], scheduler: Optional[Scheduler] = None) -> None:
         self.__cabinets: Dict[str, Cabinet] = {cab.ip: cab for cab in cabinets}
         self.__lock: threading.Lock = threading.Lock()
-        self.__thread: threading.Thread = threading.Thread(target=self.__poll_thread)
-        self.__thread.setDaemon(True)
-        self.__thread.start()
+        self.scheduler: Scheduler = scheduler or Scheduler.default()
+        self.__tasks: Dict[str, ScheduledTask] = {
+            cab.ip: self.scheduler.every(self.TICK_SECONDS, cab.tick, name=f"{cab.ip} tick", group=cab.ip) for cab in cabinets
+        }
 
     def __repr__(self) -> str:
         return f"CabinetManager([{', '.join(repr(cab) for cab in self.cabinets)}])"
@@ -519,6 +590,7 @@ class CabinetManager:
                 enabled=(True if 'disabled' not in cab else (not cab['disabled'])),
                 controllable=(True if 'controllable' not in cab else bool(cab['controllable'])),
                 power_cycle=(False if 'power_cycle' not in cab else bool(cab['power_cycle'])),
+                pinned=(False if 'pinned' not in cab else bool(cab['pinned'])),
                 time_hack=(False if 'time_hack' not in cab else bool(cab['time_hack'])),
                 send_timeout=(None if 'send_timeout' not in cab else int(cab['send_timeout'])),
             )
@@ -565,19 +637,17 @@ class CabinetManager:
                 data[cab.ip]['send_timeout'] = cab.send_timeout
             if cab.outlet is not None:
                 data[cab.ip]['outlet'] = cab.outlet
+            if cab.pinned:
+                data[cab.ip]['pinned'] = True
 
         with open(yaml_file, "w") as fp:
             yaml.dump(data, fp)
 
-    def __poll_thread(self) -> None:
-        while True:
-            with self.__lock:
-                cabinets: List[Cabinet] = [cab for _, cab in self.__cabinets.items()]
-
-            for cabinet in cabinets:
-                cabinet.tick()
-
-            time.sleep(1)
+    @property
+    def tick_stats(self) -> Dict[str, Dict[str, Any]]:
+        # How long each cabinet's ticks are taking and whether they're keeping up.
+        with self.__lock:
+            return {ip: task.stats for ip, task in self.__tasks.items()}
 
     @property
     def cabinets(self) -> List[Cabinet]:
@@ -595,12 +665,16 @@ class CabinetManager:
             if cab.ip in self.__cabinets:
                 raise CabinetException(f"There is already a cabinet with the IP {cab.ip}")
             self.__cabinets[cab.ip] = cab
+            self.__tasks[cab.ip] = self.scheduler.every(self.TICK_SECONDS, cab.tick, name=f"{cab.ip} tick", group=cab.ip)
 
     def remove_cabinet(self, ip: str) -> None:
         with self.__lock:
             if ip not in self.__cabinets:
                 raise CabinetException(f"There is no cabinet with the IP {ip}")
-            del self.__cabinets[ip]
+            cab = self.__cabinets.pop(ip)
+            self.__tasks.pop(ip).cancel()
+            cab.transfers.release(ip)
+            cab.close()
 
     def update_cabinet(
         self,
@@ -619,6 +693,7 @@ class CabinetManager:
         time_hack: Optional[bool] = None,
         controllable: Optional[bool] = None,
         power_cycle: Optional[bool] = None,
+        pinned: Optional[bool] = None,
         enabled: Optional[bool] = None,
     ) -> None:
         with self.__lock:
@@ -652,6 +727,8 @@ class CabinetManager:
                 existing_cab.controllable = controllable
             if power_cycle is not None:
                 existing_cab.power_cycle = power_cycle
+            if pinned is not None:
+                existing_cab.pinned = pinned
             if not isinstance(send_timeout, EmptyObject):
                 existing_cab.send_timeout = send_timeout
 
@@ -0,0 +1,23 @@
+import os
+import stat
+
+
+def private_directory(path: str) -> bool:
+    """
+    Make sure that a directory we keep cached images or CRCs in exists and that nobody
+    else can write to it, since whoever can would be able to hand us images or CRCs of
+    their choosing. New directories are only accessible by us. Returns False if the
+    directory can't be created, isn't a real directory, belongs to somebody else or is
+    writable by anybody else, in which case it shouldn't be used.
+    """
+    try:
+        os.makedirs(path, mode=0o700, exist_ok=True)
+        info = os.lstat(path)
+    except OSError:
+        return False
+
+    if not stat.S_ISDIR(info.st_mode):
+        return False
+    if hasattr(os, "getuid") and info.st_uid != os.getuid():
+        return False
+    return (info.st_mode & (stat.S_IWGRP | stat.S_IWOTH)) == 0
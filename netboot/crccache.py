@@ -0,0 +1,334 @@
+import hashlib
+import json
+import os
+import os.path
+import tempfile
+import threading
+import zlib
+from typing import Any, Callable, Dict, List, Optional, Sequence, Set, Tuple
+
+from arcadeutils import FileBytes
+from netboot.cachedir import private_directory
+from netdimm import NetDimmTargetEnum, OverlayImage
+
+
+# Matrices over GF(2) that advance a CRC32 past a run of zero bytes, used to glue
+# together CRCs of adjacent pieces of data without rereading them. This is the same
+# algorithm as zlib's crc32_combine(), which python's zlib module doesn't expose.
+def _gf2_times(mat: List[int], vec: int) -> int:
+    result = 0
+    index = 0
+    while vec:
+        if vec & 1:
+            result ^= mat[index]
+        vec >>= 1
+        index += 1
+    return result
+
+
+def _gf2_square(mat: List[int]) -> List[int]:
+    return [_gf2_times(mat, mat[n]) for n in range(32)]
+
+
+_combine_operators: Dict[int, List[int]] = {}
+_combine_lock: threading.Lock = threading.Lock()
+
+
+def _combine_operator(length: int) -> List[int]:
+    with _combine_lock:
+        if length in _combine_operators:
+            return _combine_operators[length]
+
+    # Start with the operator for a single zero bit, then square our way up through
+    # 2 and 4 bits to a single zero byte, multiplying in every power of two that's
+    # set in the length.
+    odd = [0xEDB88320] + [1 << n for n in range(31)]
+    even = _gf2_square(odd)
+    odd = _gf2_square(even)
+    result = [1 << n for n in range(32)]
+    remaining = length
+    while remaining:
+        even = _gf2_square(odd)
+        if remaining & 1:
+            result = [_gf2_times(even, row) for row in result]
+        remaining >>= 1
+        if not remaining:
+            break
+        odd = _gf2_square(even)
+        if remaining & 1:
+            result = [_gf2_times(odd, row) for row in result]
+        remaining >>= 1
+
+    with _combine_lock:
+        _combine_operators[length] = result
+    return result
+
+
+def crc32_combine(crc1: int, crc2: int, length2: int) -> int:
+    """
+    Given the zlib.crc32() of two pieces of data and the length of the second piece,
+    returns the zlib.crc32() of both pieces concatenated together.
+    """
+    if length2 <= 0:
+        return crc1
+    return _gf2_times(_combine_operator(length2), crc1) ^ crc2
+
+
+def _crc32(data: FileBytes, start: int, end: int) -> int:
+    # CRC part of an image, reading straight out of the mapped file for overlays.
+    if isinstance(data, OverlayImage):
+        crc = 0
+        for piece in data.views(start, end):
+            crc = zlib.crc32(piece, crc)
+        return crc
+    return zlib.crc32(data[start:end])
+
+
+def _patch_ranges(patches: Sequence[str]) -> Optional[List[Tuple[int, int]]]:
+    # Figure out every byte range that a set of binary patches can touch, so that we
+    # know which blocks of an image need to be looked at again. Returns None if any
+    # patch file isn't something we can understand, in which case we must recompute.
+    ranges: List[Tuple[int, int]] = []
+    for patch in patches:
+        with open(patch, "r") as pp:
+            for line in pp:
+                line = line.strip()
+                if not line or line.startswith("#"):
+                    continue
+                if ":" not in line or "->" not in line:
+                    return None
+                offset, change = line.split(":", 1)
+                _, new = change.split("->", 1)
+                try:
+                    start = int(offset.strip(), 16)
+                except ValueError:
+                    return None
+                length = len(new.split())
+                if length <= 0:
+                    return None
+                ranges.append((start, start + length))
+    return ranges
+
+
+class CRCCache:
+    """
+    A persistent cache of what the net dimm CRC of a ROM will be once patches and
+    settings are applied. Entries are keyed by the ROM's identity on disk (its path,
+    size, modification time and inode) as well as the contents of every patch and
+    settings file, so editing or replacing any of them invalidates the cached CRC.
+
+    On top of whole-image results, the cache stores a CRC for every block of the
+    unpatched ROM. When a new combination of binary patches is requested for a ROM
+    we've seen before, only the blocks those patches touch are read and the rest are
+    combined from the cache instead of CRCing the whole image again.
+
+    Without a path the cache only lasts as long as the process does. With one, it is
+    saved there as long as the directory holding it is private to us, since anybody
+    else who could write to it could make us believe the wrong CRC.
+    """
+
+    BLOCK_SIZE: int = 1024 * 1024
+    CACHE_VERSION: int = 1
+    MAX_IMAGES: int = 256
+    MAX_CONFIGURATIONS: int = 32
+
+    def __init__(self, path: Optional[str] = None) -> None:
+        self.path: Optional[str] = path
+        self.__lock: threading.Lock = threading.Lock()
+        self.__images: Optional[Dict[str, Dict[str, Any]]] = None
+        self.__counter: int = 0
+        self.hits: int = 0
+        self.incremental: int = 0
+        self.misses: int = 0
+
+    __default: Optional["CRCCache"] = None
+    __default_lock: threading.Lock = threading.Lock()
+
+    @staticmethod
+    def default() -> "CRCCache":
+        # A single cache shared by every host in this process.
+        with CRCCache.__default_lock:
+            if CRCCache.__default is None:
+                CRCCache.__default = CRCCache()
+            return CRCCache.__default
+
+    def configure(self, path: Optional[str] = None) -> None:
+        # Change where the cache is saved, picking up whatever was saved there before.
+        with self.__lock:
+            if path is not None and path != self.path:
+                self.path = path or None
+                self.__images = None
+
+    def __private(self) -> Optional[str]:
+        # Where to save the cache, as long as nobody else can tamper with it there.
+        if self.path is None or not private_directory(os.path.dirname(os.path.abspath(self.path))):
+            return None
+        return self.path
+
+    def __load(self) -> Dict[str, Dict[str, Any]]:
+        if self.__images is None:
+            self.__images = {}
+            path = self.__private()
+            if path is None:
+                return self.__images
+            try:
+                with open(path, "r") as fp:
+                    contents = json.load(fp)
+                if isinstance(contents, dict) and contents.get("version") == self.CACHE_VERSION:
+                    self.__images = contents.get("images", {})
+                    self.__counter = max([0, *(image.get("used", 0) for image in self.__images.values())])
+            except (OSError, ValueError):
+                # Missing or corrupt cache, start over.
+                pass
+        return self.__images
+
+    def __save(self) -> None:
+        images = self.__load()
+        while len(images) > self.MAX_IMAGES:
+            oldest = min(images.keys(), key=lambda name: images[name].get("used", 0))
+            del images[oldest]
+
+        path = self.__private()
+        if path is None:
+            return
+
+        # Write to a temporary file and then move it into place, so that a crash or a
+        # second server writing at the same time never leaves a half-written cache.
+        try:
+            directory = os.path.dirname(os.path.abspath(path))
+            fd, tmppath = tempfile.mkstemp(prefix=".netboot_crc_cache", dir=directory)
+            with os.fdopen(fd, "w") as fp:
+                json.dump({"version": self.CACHE_VERSION, "images": images}, fp)
+            os.replace(tmppath, path)
+        except OSError:
+            # Not being able to persist the cache only costs us time later.
+            pass
+
+    @staticmethod
+    def __identity(filename: str) -> Dict[str, int]:
+        stat = os.stat(filename)
+        return {"size": stat.st_size, "mtime": stat.st_mtime_ns, "inode": stat.st_ino}
+
+    @staticmethod
+    def __configuration(target: NetDimmTargetEnum, patches: Sequence[str], settings: Dict[Any, bytes]) -> str:
+        sha = hashlib.sha1()
+        sha.update(target.value.encode("utf-8"))
+        for patch in patches:
+            with open(patch, "rb") as bfp:
+                sha.update(b"patch:" + hashlib.sha1(bfp.read()).digest())
+        for typ in sorted(settings.keys(), key=lambda t: str(t.value)):
+            sha.update(f"settings:{typ.value}:".encode("utf-8") + hashlib.sha1(settings[typ]).digest())
+        return sha.hexdigest()
+
+    def __touch(self, image: Dict[str, Any]) -> None:
+        self.__counter += 1
+        image["used"] = self.__counter
+
+    def crc(
+        self,
+        filename: str,
+        target: NetDimmTargetEnum,
+        patches: Sequence[str],
+        settings: Dict[Any, bytes],
+        patcher: Callable[[FileBytes], FileBytes],
+    ) -> int:
+        """
+        Given a ROM, the patches and settings that will be applied to it and a function
+        that applies them, return the net dimm CRC of the resulting image, reusing as
+        much previous work as possible.
+        """
+        name = os.path.realpath(filename)
+        identity = self.__identity(name)
+        configuration = self.__configuration(target, patches, settings)
+
+        with self.__lock:
+            images = self.__load()
+            image = images.get(name)
+            if image is not None and image.get("identity") != identity:
+                # The ROM changed underneath us, so nothing we know about it is any good.
+                del images[name]
+                image = None
+            if image is not None and configuration in image["crcs"]:
+                self.hits += 1
+                self.__touch(image)
+                return int(image["crcs"][configuration])
+            blocks: Optional[List[int]] = list(image["blocks"]) if image is not None and image.get("block_size") == self.BLOCK_SIZE else None
+
+        crc, newblocks = self.__compute(name, identity["size"], patches, settings, patcher, blocks)
+
+        with self.__lock:
+            images = self.__load()
+            image = images.get(name)
+            if image is None or image.get("identity") != identity:
+                image = {"identity": identity, "block_size": self.BLOCK_SIZE, "blocks": [], "crcs": {}}
+                images[name] = image
+            if newblocks is not None:
+                image["block_size"] = self.BLOCK_SIZE
+                image["blocks"] = newblocks
+            image["crcs"][configuration] = crc
+            while len(image["crcs"]) > self.MAX_CONFIGURATIONS:
+                del image["crcs"][next(iter(image["crcs"]))]
+            self.__touch(image)
+            self.__save()
+        return crc
+
+    def __compute(
+        self,
+        filename: str,
+        size: int,
+        patches: Sequence[str],
+        settings: Dict[Any, bytes],
+        patcher: Callable[[FileBytes], FileBytes],
+        blocks: Optional[List[int]],
+    ) -> Tuple[int, Optional[List[int]]]:
+        # Returns the CRC of the patched image, as well as the CRC of every block of the
+        # unpatched image if we learned them and they weren't already known.
+        blocksize = self.BLOCK_SIZE
+        count = (size + blocksize - 1) // blocksize
+
+        # Settings can rewrite and grow an image in ways that we can't predict, so only
+        # images with nothing but binary patches applied can be worked out incrementally.
+        dirty: Optional[Set[int]] = None
+        if not settings:
+            ranges = _patch_ranges(patches)
+            if ranges is not None and all(end <= size for _, end in ranges):
+                dirty = set()
+                for start, end in ranges:
+                    dirty.update(range(start // blocksize, ((end - 1) // blocksize) + 1))
+
+        with open(filename, "rb") as fp, open(filename, "rb") as ofp:
+            data = patcher(OverlayImage(fp))
+            if len(data) != size:
+                # Patches grew or shrank the image, so blocks don't line up anymore.
+                dirty = None
+
+            def original(index: int) -> bytes:
+                # Patches might have been applied in place, so go back to the file itself.
+                ofp.seek(index * blocksize)
+                return ofp.read(min(blocksize, size - (index * blocksize)))
+
+            crc = 0
+            if dirty is not None and blocks is not None and len(blocks) == count:
+                # We know the CRC of every block of the original image, so we only need to
+                # read the blocks that the patches touched.
+                with self.__lock:
+                    self.incremental += 1
+                for index in range(count):
+                    length = min(blocksize, size - (index * blocksize))
+                    blockcrc = _crc32(data, index * blocksize, (index * blocksize) + length) if index in dirty else blocks[index]
+                    crc = crc32_combine(crc, blockcrc, length)
+                return (~crc) & 0xFFFFFFFF, None
+
+            with self.__lock:
+                self.misses += 1
+            newblocks: Optional[List[int]] = [] if dirty is not None else None
+            for offset in range(0, len(data), blocksize):
+                length = min(blocksize, len(data) - offset)
+                blockcrc = _crc32(data, offset, offset + length)
+                crc = crc32_combine(crc, blockcrc, length)
+                if newblocks is not None:
+                    # Blocks the patches didn't touch are the same as the original, and the
+                    # handful that they did touch we grab from the original file.
+                    index = offset // blocksize
+                    newblocks.append(zlib.crc32(original(index)) if index in (dirty or set()) else blockcrc)
+            return (~crc) & 0xFFFFFFFF, newblocks
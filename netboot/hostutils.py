@@ -1,19 +1,23 @@
+import json
+import mmap
 import multiprocessing
 import multiprocessing.synchronize
 import os
-import platform
 import psutil  # type: ignore
 import queue
-import subprocess
-import sys
+import tempfile
 import threading
 import time
 from enum import Enum
-from typing import Any, Dict, Optional, Sequence, Tuple, Union, overload
+from typing import Any, BinaryIO, Callable, Dict, List, Optional, Sequence, Tuple, TypeVar, Union, overload
 
 from arcadeutils import FileBytes, BinaryDiff
+from netboot.crccache import CRCCache
+from netboot.imagecache import ImageCache
 from netboot.log import log
-from netdimm import NetDimm, NetDimmInfo, NetDimmException, NetDimmVersionEnum, NetDimmTargetEnum
+from netboot.prober import LivenessProber
+from netboot.scheduler import ScheduledTask, Scheduler
+from netdimm import NetDimm, NetDimmBroadcast, NetDimmInfo, NetDimmException, NetDimmManifest, NetDimmVersionEnum, NetDimmTargetEnum, OverlayImage
 from naomi import NaomiSettingsPatcher, get_default_trojan as get_default_naomi_trojan
 
 
@@ -57,6 +61,142 @@ def _handle_patches(data: Union[bytes, FileBytes], target: NetDimmTargetEnum, pa
     return data
 
 
+def _send_mapped_file(fp: BinaryIO, send: Callable[[Union[memoryview, FileBytes]], None]) -> None:
+    # Map the file and send views straight out of the page cache instead of copying
+    # every chunk into new bytes.
+    with mmap.mmap(fp.fileno(), 0, access=mmap.ACCESS_READ) as mm:
+        with memoryview(mm) as view:
+            send(view)
+
+
+def _load_manifest(filename: Optional[str]) -> Optional[NetDimmManifest]:
+    # Look up what we last sent to a host, if we know.
+    if filename is None:
+        return None
+    try:
+        with open(filename, "r") as fp:
+            return NetDimmManifest.from_json(json.load(fp))
+    except (OSError, ValueError, KeyError, TypeError, NetDimmException):
+        return None
+
+
+def _save_manifest(filename: Optional[str], manifest: Optional[NetDimmManifest]) -> None:
+    # Remember what we just sent to a host, so the next send can skip what it already has.
+    if filename is None:
+        return
+    try:
+        if manifest is None:
+            if os.path.exists(filename):
+                os.remove(filename)
+            return
+        fd, tmppath = tempfile.mkstemp(prefix=".manifest", dir=os.path.dirname(os.path.abspath(filename)))
+        with os.fdopen(fd, "w") as fp:
+            json.dump(manifest.to_json(), fp)
+        os.replace(tmppath, filename)
+    except OSError:
+        pass
+
+
+class _RatePacer:
+    """
+    Holds back one or more sends that share a rate, in bytes per second or 0.0 for as fast
+    as they can, so that all of them together go no faster than the rate allows. A send
+    that finishes or fails stops taking up any of it, leaving more for the rest.
+    """
+
+    def __init__(self, rate: Any) -> None:
+        self.rate: Any = rate
+        self.__lock: threading.Lock = threading.Lock()
+        # When the rate next lets anything else go out.
+        self.__free: float = 0.0
+
+    def pace(self, amount: int) -> None:
+        # Account for some bytes that just went out and wait until the rate allows more.
+        # Time where nobody sent anything doesn't get saved up for sending faster later.
+        with self.__lock:
+            now = time.time()
+            rate = self.rate.value
+            if rate <= 0.0:
+                self.__free = now
+                return
+            self.__free = max(self.__free, now - (amount / rate)) + (amount / rate)
+            delay = self.__free - now
+        if delay > 0.0:
+            time.sleep(delay)
+
+
+def _capture_progress(
+    parent_pid: int,
+    progress_queue: "multiprocessing.Queue[Tuple[str, Any]]",
+    pacer: Optional[_RatePacer] = None,
+    cancelled: Optional[Any] = None,
+) -> Callable[[int, int], None]:
+    last: int = 0
+
+    def capture_progress(sent: int, total: int) -> None:
+        nonlocal last
+
+        # See if we need to bail out since our parent disappeared. This can be running on
+        # one of several threads sending at once, so fail the send instead of exiting.
+        if not psutil.pid_exists(parent_pid):
+            raise HostException("Parent process went away")
+        # Or if our parent gave up on this particular host.
+        if cancelled is not None and cancelled.value:
+            raise HostException("Send was cancelled")
+        progress_queue.put(("progress", (sent, total)))
+
+        # Progress gets reported before every chunk goes out, so hold off on the next one
+        # until the last one has taken as long as our share of the bandwidth allows.
+        if pacer is not None:
+            pacer.pace(max(sent - last, 0))
+        last = sent
+
+    return capture_progress
+
+
+def _send_image(
+    filename: str,
+    patches: Sequence[str],
+    settings: Dict[SettingsEnum, bytes],
+    target: NetDimmTargetEnum,
+    image_cache: Optional[Tuple[str, int]],
+    progress_queue: "multiprocessing.Queue[Tuple[str, Any]]",
+    send: Callable[[Union[memoryview, FileBytes]], None],
+) -> None:
+    # Grab the image itself
+    with open(filename, "rb") as fp:
+        if not patches and not settings and os.fstat(fp.fileno()).st_size > 0:
+            # Nothing to patch, so send the file as-is.
+            _send_mapped_file(fp, send)
+        else:
+            # See if somebody already prepared this exact image for another send.
+            cache: Optional[ImageCache] = None
+            cached: Optional[str] = None
+            if image_cache is not None:
+                cache = ImageCache(*image_cache)
+                key = cache.key(filename, target, patches, settings, get_default_naomi_trojan() if settings else None)
+                cached = cache.lookup(key)
+                progress_queue.put(("cache", cached is not None))
+
+            if cached is None:
+                # Get an overlay over the mapped file so we don't load too much
+                # data into RAM at once, and patches don't copy the file around.
+                data: FileBytes = OverlayImage(fp)
+
+                # Patch it
+                data = _handle_patches(data, target, patches, settings)
+
+                # Save it for next time, and send it from the cache if that worked.
+                if cache is not None:
+                    cached = cache.store(key, data)
+                if cached is None:
+                    send(data)
+
+            if cached is not None:
+                with open(cached, "rb") as cfp:
+                    _send_mapped_file(cfp, send)
+
+
 def _send_file_to_host(
     host: str,
     filename: str,
@@ -65,35 +205,96 @@ def _send_file_to_host(
     target: NetDimmTargetEnum,
     version: NetDimmVersionEnum,
     timeout: Optional[int],
+    image_cache: Optional[Tuple[str, int]],
+    manifest: Optional[str],
     parent_pid: int,
     progress_queue: "multiprocessing.Queue[Tuple[str, Any]]",
+    rate: Optional[Any] = None,
 ) -> None:
-    def capture_progress(sent: int, total: int) -> None:
-        # See if we need to bail out since our parent disappeared
-        if not psutil.pid_exists(parent_pid):
-            sys.exit(1)
-        progress_queue.put(("progress", (sent, total)))
+    capture_progress = _capture_progress(parent_pid, progress_queue, _RatePacer(rate) if rate is not None else None)
 
+    netdimm: Optional[NetDimm] = None
     try:
         netdimm = NetDimm(host, version=version, timeout=timeout)
 
-        # Grab the image itself
-        with open(filename, "rb") as fp:
-            # Get a memory-based file representation so we don't load
-            # too much data into RAM at once.
-            data = FileBytes(fp)
-
-            # Patch it
-            data = _handle_patches(data, target, patches, settings)
+        # If the host still holds what we sent it last time, only send what changed.
+        previous = _load_manifest(manifest)
 
-            # Send it
-            netdimm.send(data, progress_callback=capture_progress)
+        def send(data: Union[memoryview, FileBytes]) -> None:
+            netdimm.send(data, progress_callback=capture_progress, previous=previous)
 
+        _send_image(filename, patches, settings, target, image_cache, progress_queue, send)
+        _save_manifest(manifest, netdimm.last_manifest)
         progress_queue.put(("success", None))
     except Exception as e:
+        if netdimm is not None and netdimm.last_manifest is not None and not netdimm.last_manifest.complete:
+            # The upload died partway through, so remember how far it got in order
+            # to resume from there on the next attempt instead of starting over.
+            _save_manifest(manifest, netdimm.last_manifest)
         progress_queue.put(("failure", str(e)))
 
 
+def _send_file_to_hosts(
+    hosts: Sequence[Tuple[str, Optional[int], Optional[str], "multiprocessing.Queue[Tuple[str, Any]]", Optional[Any], Any]],
+    filename: str,
+    patches: Sequence[str],
+    settings: Dict[SettingsEnum, bytes],
+    target: NetDimmTargetEnum,
+    version: NetDimmVersionEnum,
+    image_cache: Optional[Tuple[str, int]],
+    window: int,
+    parent_pid: int,
+) -> None:
+    # Like _send_file_to_host, but for several hosts that all want the same image. Each
+    # host is its IP, send timeout, manifest file, progress queue, rate and a flag that
+    # gets set if the parent gives up on it. The image is prepared once, and every block
+    # is read once and handed to every host, so a failure on one host doesn't stop any
+    # of the others.
+    netdimms = [NetDimm(ip, version=version, timeout=timeout) for ip, timeout, _, _, _, _ in hosts]
+    previous = [_load_manifest(manifest) for _, _, manifest, _, _, _ in hosts]
+    # Hosts that were handed the same rate, such as every host that joined in without a
+    # rate of its own, get paced together so that between them they stick to it.
+    pacers: Dict[int, _RatePacer] = {}
+    for _, _, _, _, rate, _ in hosts:
+        if rate is not None and id(rate) not in pacers:
+            pacers[id(rate)] = _RatePacer(rate)
+    captures = {
+        id(netdimm): _capture_progress(parent_pid, progress_queue, pacers.get(id(rate)), cancelled)
+        for netdimm, (_, _, _, progress_queue, rate, cancelled) in zip(netdimms, hosts)
+    }
+    results: List[Optional[Exception]] = [None] * len(hosts)
+
+    def send(data: Union[memoryview, FileBytes]) -> None:
+        nonlocal results
+        broadcast = NetDimmBroadcast(data, window=window)
+        results = broadcast.send(
+            netdimms,
+            progress_callback=lambda netdimm, sent, total: captures[id(netdimm)](sent, total),
+            previous=previous,
+        )
+
+    try:
+        # Cache hits only get counted once, since we only looked the image up once.
+        _send_image(filename, patches, settings, target, image_cache, hosts[0][3], send)
+    except Exception as e:
+        results = [e] * len(hosts)
+
+    for netdimm, result, (_, _, manifest, progress_queue, _, cancelled) in zip(netdimms, results, hosts):
+        if cancelled.value:
+            # Our parent already forgot about this send, don't confuse its next one.
+            continue
+        if result is None:
+            _save_manifest(manifest, netdimm.last_manifest)
+            progress_queue.put(("success", None))
+        else:
+            if netdimm.last_manifest is not None and not netdimm.last_manifest.complete:
+                _save_manifest(manifest, netdimm.last_manifest)
+            progress_queue.put(("failure", str(result)))
+
+
+T = TypeVar("T")
+
+
 class HostException(Exception):
     pass
 
@@ -105,9 +306,280 @@ class HostStatusEnum(Enum):
     STATUS_FAILED = "failed"
 
 
+class FanOutSend:
+    """
+    One host's part of a send that a FanOut is doing for several hosts at once, which
+    the host looks after the same way it would its own send process.
+    """
+
+    def __init__(self, fanout: "FanOut", group: "FanOutGroup", ip: str) -> None:
+        self.ip: str = ip
+        self.group: "FanOutGroup" = group
+        self.cancelled: Any = multiprocessing.Value('b', 0, lock=False)
+        self.finished: bool = False
+        self.__fanout = fanout
+
+    def __repr__(self) -> str:
+        return f"FanOutSend(ip={repr(self.ip)}, group={repr(self.group)})"
+
+    def poll(self) -> None:
+        # Start the send if we're done waiting on other hosts to join in.
+        self.__fanout.poll(self.group)
+
+    def terminate(self) -> None:
+        self.__fanout.cancel(self)
+
+    def join(self) -> None:
+        self.__fanout.finish(self)
+
+
+class FanOutGroup:
+    def __init__(
+        self,
+        key: Tuple[Any, ...],
+        filename: str,
+        patches: Sequence[str],
+        settings: Dict[SettingsEnum, bytes],
+        target: NetDimmTargetEnum,
+        version: NetDimmVersionEnum,
+        image_cache: Optional[Tuple[str, int]],
+        deadline: float,
+    ) -> None:
+        self.key: Tuple[Any, ...] = key
+        self.filename: str = filename
+        self.patches: List[str] = list(patches)
+        self.settings: Dict[SettingsEnum, bytes] = dict(settings)
+        self.target: NetDimmTargetEnum = target
+        self.version: NetDimmVersionEnum = version
+        self.image_cache: Optional[Tuple[str, int]] = image_cache
+        self.deadline: float = deadline
+        # Every host's send, along with what the send process needs to know about it.
+        self.sends: List[FanOutSend] = []
+        self.hosts: List[Tuple[str, Optional[int], Optional[str], "multiprocessing.Queue[Tuple[str, Any]]", Optional[Any], Any]] = []
+        self.proc: Optional[multiprocessing.Process] = None
+
+    def __repr__(self) -> str:
+        return f"FanOutGroup(filename={repr(self.filename)}, hosts={repr([send.ip for send in self.sends])})"
+
+
+class FanOut:
+    """
+    Sends the same image to every host that wants it at about the same time from one
+    process, instead of each host opening, patching and reading the image in a process
+    of its own. When a venue powers on, every cabinet running the same game asks for it
+    within a second or two of each other, so if some other host has said that it wants
+    the same image, a send waits for gather seconds for it to join in before it starts.
+    Every block of the image is then read once and
+    written to every host, so that disk reads for N hosts drop from N times to once.
+    A host that fails or is given up on doesn't affect the others, and a host that falls
+    more than window blocks behind the rest is left to read the image on its own.
+    """
+
+    GATHER_SECONDS: float = 2.0
+
+    def __init__(self, gather: float = GATHER_SECONDS, window: int = NetDimmBroadcast.DEFAULT_WINDOW) -> None:
+        self.gather: float = gather
+        self.window: int = window
+        self.__lock: threading.Lock = threading.Lock()
+        self.__pending: Dict[Tuple[Any, ...], FanOutGroup] = {}
+        self.__running: List[FanOutGroup] = []
+        # The image each host expects to be sent soon, if any.
+        self.__wanted: Dict[str, str] = {}
+        self.groups: int = 0
+        self.sends: int = 0
+        self.largest: int = 0
+
+    __default: Optional["FanOut"] = None
+    __default_lock: threading.Lock = threading.Lock()
+
+    @staticmethod
+    def default() -> "FanOut":
+        # A single fan out shared by every host in this process.
+        with FanOut.__default_lock:
+            if FanOut.__default is None:
+                FanOut.__default = FanOut()
+            return FanOut.__default
+
+    def __repr__(self) -> str:
+        return f"FanOut(gather={repr(self.gather)}, window={repr(self.window)})"
+
+    def configure(self, gather: Optional[float] = None, window: Optional[int] = None) -> None:
+        # Change how long to wait for hosts to join in and how far they can drift apart.
+        with self.__lock:
+            if gather is not None:
+                self.gather = max(gather, 0.0)
+            if window is not None:
+                self.window = max(window, 1)
+
+    def want(self, ip: str, filename: Optional[str]) -> None:
+        # Say which image a host expects to be sent soon, or None for nothing, so that sends
+        # of the same image know it's worth waiting for the host to join in.
+        with self.__lock:
+            if filename is None:
+                self.__wanted.pop(ip, None)
+            else:
+                self.__wanted[ip] = filename
+
+    def joinable(
+        self,
+        filename: str,
+        patches: Sequence[str],
+        settings: Dict[SettingsEnum, bytes],
+        target: NetDimmTargetEnum,
+        version: NetDimmVersionEnum,
+    ) -> bool:
+        # Whether a send of this image is still gathering hosts, so sending it to one more
+        # host costs next to nothing.
+        with self.__lock:
+            group = self.__pending.get(self.__key(filename, patches, settings, target, version))
+            return group is not None and group.proc is None
+
+    @staticmethod
+    def __key(
+        filename: str,
+        patches: Sequence[str],
+        settings: Dict[SettingsEnum, bytes],
+        target: NetDimmTargetEnum,
+        version: NetDimmVersionEnum,
+    ) -> Tuple[Any, ...]:
+        return (
+            filename,
+            tuple(patches),
+            tuple(sorted((typ.value, setting) for typ, setting in settings.items())),
+            target,
+            version,
+        )
+
+    @property
+    def stats(self) -> Dict[str, Any]:
+        with self.__lock:
+            return {
+                "pending": sorted(send.ip for group in self.__pending.values() for send in group.sends),
+                "running": sorted(send.ip for group in self.__running for send in group.sends if not send.finished),
+                "wanted": sorted(self.__wanted.keys()),
+                "groups": self.groups,
+                "sends": self.sends,
+                "largest": self.largest,
+            }
+
+    def send(
+        self,
+        ip: str,
+        filename: str,
+        patches: Sequence[str],
+        settings: Dict[SettingsEnum, bytes],
+        target: NetDimmTargetEnum,
+        version: NetDimmVersionEnum,
+        timeout: Optional[int],
+        image_cache: Optional[Tuple[str, int]],
+        manifest: Optional[str],
+        progress_queue: "multiprocessing.Queue[Tuple[str, Any]]",
+        rate: Optional[Any] = None,
+    ) -> FanOutSend:
+        """
+        Join in on sending an image to a host, starting a new group if nobody else is
+        about to send the same image. Progress and the result show up on the progress
+        queue exactly as they would for a host sending on its own, starting with an
+        initial progress update so the host knows we're on it. Nothing goes out until the
+        group is polled after it is done gathering, which is right away if no other host
+        wants the same image. Hosts joining in without a rate of their own share the rate
+        of the host that started the group, so that all of them together only take up
+        that one host's share.
+        """
+        key = self.__key(filename, patches, settings, target, version)
+        with self.__lock:
+            self.__wanted.pop(ip, None)
+            group = self.__pending.get(key)
+            if group is None:
+                others = any(other != ip and wanted == filename for other, wanted in self.__wanted.items())
+                group = FanOutGroup(key, filename, patches, settings, target, version, image_cache, time.time() + (self.gather if others else 0.0))
+                self.__pending[key] = group
+            elif rate is None and group.hosts:
+                rate = group.hosts[0][4]
+
+            send = FanOutSend(self, group, ip)
+            group.sends.append(send)
+            group.hosts.append((ip, timeout, manifest, progress_queue, rate, send.cancelled))
+            progress_queue.put(("progress", (0, os.path.getsize(filename))))
+            return send
+
+    def poll(self, group: FanOutGroup) -> None:
+        # Start a group's send process once it is done gathering hosts.
+        with self.__lock:
+            if group.proc is not None or self.__pending.get(group.key) is not group or time.time() < group.deadline:
+                return
+
+            del self.__pending[group.key]
+            group.proc = multiprocessing.Process(
+                target=_send_file_to_hosts,
+                args=(
+                    group.hosts,
+                    group.filename,
+                    group.patches,
+                    group.settings,
+                    group.target,
+                    group.version,
+                    group.image_cache,
+                    self.window,
+                    os.getpid(),
+                ),
+            )
+            group.proc.start()
+            self.__running.append(group)
+            self.groups += 1
+            self.sends += len(group.sends)
+            self.largest = max(self.largest, len(group.sends))
+
+    def cancel(self, send: FanOutSend) -> None:
+        # Give up on sending to one host without bothering the rest.
+        with self.__lock:
+            group = send.group
+            if group.proc is None:
+                if send in group.sends:
+                    index = group.sends.index(send)
+                    del group.sends[index]
+                    del group.hosts[index]
+                if not group.sends and self.__pending.get(group.key) is group:
+                    del self.__pending[group.key]
+                send.finished = True
+                return
+
+            send.cancelled.value = 1
+            if all(other.finished or other is send for other in group.sends) and not send.finished:
+                # Nobody else is left who cares, so don't let it run on.
+                group.proc.terminate()
+            proc = self.__finish(send)
+        if proc is not None:
+            proc.join()
+
+    def finish(self, send: FanOutSend) -> None:
+        with self.__lock:
+            proc = self.__finish(send)
+        if proc is not None:
+            proc.join()
+
+    def __finish(self, send: FanOutSend) -> Optional[multiprocessing.Process]:
+        # Returns the group's process if this was the last host in it, which the caller
+        # should join once it lets go of the lock. Note that this should only be called
+        # by something that has a lock.
+        send.finished = True
+        group = send.group
+        if group.proc is not None and group in self.__running and all(other.finished for other in group.sends):
+            self.__running.remove(group)
+            return group.proc
+        return None
+
+
 class Host:
     DEBOUNCE_SECONDS = 3
 
+    # How long our connection to the net dimm can sit unused before the poll thread
+    # closes it, so that other tools get a chance to talk to the net dimm.
+    SESSION_IDLE_SECONDS = 10.0
+
+    # How often the time hack resets the time limit on the net dimm.
+    TIME_HACK_SECONDS = 5.0
+
     def __init__(
         self,
         ip: str,
@@ -116,23 +588,61 @@ class Host:
         send_timeout: Optional[int] = None,
         time_hack: bool = False,
         quiet: bool = False,
+        crc_cache: Optional[CRCCache] = None,
+        image_cache: Optional[ImageCache] = None,
+        info_cache_time: float = 0.0,
+        prober: Optional[LivenessProber] = None,
+        scheduler: Optional[Scheduler] = None,
+        fanout: Optional[FanOut] = None,
     ) -> None:
         self.target: NetDimmTargetEnum = target or NetDimmTargetEnum.TARGET_NAOMI
         self.version: NetDimmVersionEnum = version or NetDimmVersionEnum.VERSION_4_01
         self.ip: str = ip
         self.__alive: bool = False
         self.__poll_reset: bool = False
+        self.__closed: bool = False
+        # Whether we've asked the prober to leave the net dimm alone while we talk to it.
+        self.__paused: bool = False
         self.quiet: bool = quiet
         self.time_hack: bool = time_hack
         self.send_timeout: Optional[int] = send_timeout
+        self.crc_cache: CRCCache = crc_cache or CRCCache.default()
+        self.image_cache: ImageCache = image_cache or ImageCache.default()
+        self.prober: LivenessProber = prober or LivenessProber.default()
+        self.prober.add(ip)
+        # How long info() can hand back what it last read from the net dimm instead of
+        # asking again. Zero means always ask.
+        self.info_cache_time: float = info_cache_time
+        self.__info: Optional[Tuple[float, NetDimmInfo]] = None
+        # A connection to the net dimm that reboot, wipe, info and the time hack all share
+        # instead of connecting every time, along with when it was last used.
+        self.__session: Optional[NetDimm] = None
+        self.__session_used: float = 0.0
+        self.connects: int = 0
+        self.reconnects: int = 0
+        self.operations: int = 0
+        self.__manifestfile: str = os.path.join(tempfile.gettempdir(), f"{ip}.manifest")
         self.__queue: "multiprocessing.Queue[Tuple[str, Any]]" = multiprocessing.Queue()
         self.__lock: multiprocessing.synchronize.Lock = multiprocessing.Lock()
-        self.__proc: Optional[multiprocessing.Process] = None
+        # If given, sends go out along with any other host sending the same image at the
+        # same time instead of in a process of our own.
+        self.fanout: Optional[FanOut] = fanout
+        self.__proc: Optional[Union[multiprocessing.Process, FanOutSend]] = None
         self.__lastprogress: Tuple[int, int] = (-1, -1)
         self.__laststatus: Optional[HostStatusEnum] = None
-        self.__thread: threading.Thread = threading.Thread(target=self.__poll_thread)
-        self.__thread.setDaemon(True)
-        self.__thread.start()
+
+        # Everything we need to do periodically runs on the shared scheduler instead of
+        # a thread of our own. Anything that talks to the net dimm is grouped under our
+        # IP, along with anything else that talks to us such as a cabinet's tick, so that
+        # if the net dimm stops answering we only ever tie up one of the scheduler's
+        # workers. The liveness check only looks at what the prober found, so it stays out
+        # of the group where it can't get stuck behind whatever is waiting on the net dimm.
+        self.scheduler: Scheduler = scheduler or Scheduler.default()
+        self.__tasks: List[ScheduledTask] = [
+            self.scheduler.every(self.prober.interval, self.__check_liveness, name=f"{ip} liveness"),
+            self.scheduler.every(self.TIME_HACK_SECONDS, self.__time_hack, name=f"{ip} time hack", group=ip),
+            self.scheduler.every(self.SESSION_IDLE_SECONDS / 2, self.__expire_session, name=f"{ip} session", group=ip),
+        ]
 
     def __repr__(self) -> str:
         return f"Host(ip={repr(self.ip)}, target={repr(self.target)}, version={repr(self.version)}, send_timeout={repr(self.send_timeout)}, time_hack={repr(self.time_hack)})"
@@ -141,64 +651,140 @@ class Host:
         if not self.quiet:
             log(string, newline=newline)
 
-    def __poll_thread(self) -> None:
-        success_count: int = 0
-        failure_count: int = 0
-        on_windows: bool = platform.system() == "Windows"
-        last_timehack: float = time.time()
+    def __check_liveness(self) -> None:
+        # Dont bother if we're actively sending. This is checked without the lock, since
+        # whoever has it may be waiting on a net dimm that isn't answering.
+        if self.__proc is not None and self.__laststatus is None:
+            return
+
+        # Reset polling counts after explicit power down.
+        if self.__poll_reset:
+            self.__poll_reset = False
+            self.prober.reset(self.ip)
+
+        # The prober keeps track of how many probes in a row we've answered or
+        # missed, so that nothing here has to ping the host itself.
+        success_count, failure_count = self.prober.consecutive(self.ip)
+
+        # Only claim up if it response to a number of pings.
+        if success_count >= self.DEBOUNCE_SECONDS:
+            if not self.__alive:
+                self.__print(f"Host {self.ip} started responding to ping, marking up.")
+            self.__alive = True
+        elif failure_count >= self.DEBOUNCE_SECONDS:
+            if self.__alive:
+                self.__print(f"Host {self.ip} stopped responding to ping, marking down.")
+            self.__alive = False
+
+    def __time_hack(self) -> None:
+        # Perform the time hack if so requested, as long as the host is answering.
+        if not self.time_hack or self.prober.consecutive(self.ip)[0] == 0:
+            return
+
+        with self.__lock:
+            if self.time_hack and self.__proc is None:
+                try:
+                    self.__with_session(lambda netdimm: netdimm.set_time_limit(10))
+                    self.__print(f"Host {self.ip} reset time limit with time hack.")
+                except NetDimmException:
+                    pass
+                # Setting the time limit never gets an answer, so a session kept open by
+                # nothing but the time hack would never find out that the net dimm went
+                # away. Hang up instead so that the prober keeps an eye on it.
+                self.__close_session()
+
+    def __expire_session(self) -> None:
+        # Don't hold on to a connection nobody is using.
+        with self.__lock:
+            if self.__session is not None and (time.time() - self.__session_used) >= self.SESSION_IDLE_SECONDS:
+                self.__close_session()
 
+    def __with_session(self, operation: Callable[[NetDimm], T]) -> T:
+        """
+        Run an operation against our long-lived connection to the net dimm, connecting
+        first if we aren't connected or the connection has gone bad. If the operation fails
+        on a connection we've had for a while, it is retried once on a new connection since
+        the net dimm may have dropped us in the meantime. Note that this should only be
+        called by something that has a lock.
+        """
         while True:
-            # Dont bother if we're actively sending
-            if self.status != HostStatusEnum.STATUS_TRANSFERRING:
-                # Reset polling counts after explicit power down.
-                if self.__poll_reset:
-                    self.__poll_reset = False
-                    success_count = 0
-                    failure_count = 0
-
-                with open(os.devnull, 'w') as DEVNULL:
-                    try:
-                        if on_windows:
-                            call = ["ping", "-n", "1", "-w", "1", self.ip]
-                        else:
-                            call = ["ping", "-c1", "-W1", self.ip]
-                        subprocess.check_call(call, stdout=DEVNULL, stderr=DEVNULL)
-                        alive = True
-                    except subprocess.CalledProcessError:
-                        alive = False
-
-                # Only claim up if it response to a number of pings.
-                if alive:
-                    success_count += 1
-                    failure_count = 0
-                    if success_count >= self.DEBOUNCE_SECONDS:
-                        with self.__lock:
-                            if self.__alive != alive:
-                                self.__print(f"Host {self.ip} started responding to ping, marking up.")
-                            self.__alive = True
-
-                    # Perform the time hack if so requested.
-                    current = time.time()
-                    if (current - last_timehack) >= 5.0:
-                        last_timehack = current
-                        with self.__lock:
-                            if self.time_hack:
-                                netdimm = NetDimm(self.ip, version=self.version, timeout=5)
-                                try:
-                                    netdimm.set_time_limit(10)
-                                    self.__print(f"Host {self.ip} reset time limit with time hack.")
-                                except NetDimmException:
-                                    pass
-                else:
-                    success_count = 0
-                    failure_count += 1
-                    if failure_count >= self.DEBOUNCE_SECONDS:
-                        with self.__lock:
-                            if self.__alive != alive:
-                                self.__print(f"Host {self.ip} stopped responding to ping, marking down.")
-                            self.__alive = False
-
-            time.sleep(2 if success_count >= self.DEBOUNCE_SECONDS else 1)
+            if self.__session is not None and not self.__session.is_connected():
+                # The net dimm hung up on us, most likely because it rebooted.
+                self.__close_session()
+                self.reconnects += 1
+
+            fresh = self.__session is None
+            if self.__session is None:
+                session = NetDimm(self.ip, version=self.version, timeout=5)
+                session.open()
+                self.__session = session
+                self.connects += 1
+                self.__update_probing()
+
+            try:
+                result = operation(self.__session)
+            except NetDimmException:
+                self.__close_session()
+                if fresh:
+                    raise
+                self.reconnects += 1
+                continue
+
+            self.__session_used = time.time()
+            self.operations += 1
+            self.__update_probing()
+            return result
+
+    def __close_session(self) -> None:
+        # Note that this should only be called by something that has a lock.
+        if self.__session is not None:
+            self.__session.close()
+            self.__session = None
+            self.__update_probing()
+
+    def __update_probing(self) -> None:
+        # The net dimm only talks to one connection at a time, so keep the prober from
+        # connecting to it while we have a session open or a send going. The pause is
+        # renewed every time we hear from the net dimm, so if it goes quiet on us the
+        # prober takes over again once the pause runs out. Note that this should only be
+        # called by something that has a lock.
+        busy = self.__session is not None or self.__proc is not None
+        if busy:
+            self.prober.pause(self.ip)
+        elif self.__paused:
+            self.prober.resume(self.ip)
+        self.__paused = busy
+
+    def close(self) -> None:
+        """
+        Stop everything we do periodically, close any connection we're holding open to the
+        net dimm and stop probing it. Call this when the host is going away for good.
+        """
+        with self.__lock:
+            if self.__closed:
+                return
+            self.__closed = True
+            for task in self.__tasks:
+                task.cancel()
+            self.__close_session()
+            if self.__paused:
+                self.prober.resume(self.ip)
+                self.__paused = False
+        self.prober.remove(self.ip)
+
+    @property
+    def probe_stats(self) -> Dict[str, Any]:
+        # How often the host has answered liveness probes and how quickly.
+        return self.prober.stats(self.ip)
+
+    @property
+    def stats(self) -> Dict[str, int]:
+        with self.__lock:
+            return {
+                "connects": self.connects,
+                "reconnects": self.reconnects,
+                "operations": self.operations,
+            }
 
     def reboot(self) -> bool:
         """
@@ -209,12 +795,16 @@ class Host:
             if self.__proc is not None:
                 raise HostException("Cannot reboot host mid-transfer.")
 
-            netdimm = NetDimm(self.ip, version=self.version, timeout=5)
+            self.__info = None
             try:
-                netdimm.reboot()
+                self.__with_session(lambda netdimm: netdimm.reboot())
                 return True
             except NetDimmException:
                 return False
+            finally:
+                # Don't count on the net dimm keeping this connection around across a
+                # restart, it's cheaper to start fresh than to find out the hard way.
+                self.__close_session()
 
     def tick(self) -> None:
         """
@@ -238,6 +828,13 @@ class Host:
                 self.__proc.terminate()
                 self.__proc.join()
                 self.__proc = None
+                self.__update_probing()
+
+    @property
+    def responding(self) -> bool:
+        # Whether the host answered its last probe, even if it hasn't been answering for
+        # long enough to be marked up yet.
+        return self.prober.consecutive(self.ip)[0] > 0
 
     @property
     def status(self) -> HostStatusEnum:
@@ -278,6 +875,10 @@ class Host:
             # Nothing to update here
             return
 
+        if isinstance(self.__proc, FanOutSend):
+            # Get the send going if it's done waiting on other hosts to join in.
+            self.__proc.poll()
+
         while True:
             try:
                 update = self.__queue.get_nowait()
@@ -288,6 +889,12 @@ class Host:
             # Normal progress update
             if update[0] == "progress":
                 self.__lastprogress = (update[1][0], update[1][1])
+                self.__update_probing()
+                continue
+
+            # Whether the send process found its prepared image in the cache
+            if update[0] == "cache":
+                self.image_cache.record(update[1])
                 continue
 
             # Transfer finished, so we should update our final status and wait on the process
@@ -301,37 +908,83 @@ class Host:
 
             self.__proc.join()
             self.__proc = None
+            self.__update_probing()
             return
 
-    def send(self, filename: str, patches: Sequence[str], settings: Dict[SettingsEnum, bytes]) -> None:
+    def send(self, filename: str, patches: Sequence[str], settings: Dict[SettingsEnum, bytes], rate: Optional[Any] = None) -> None:
+        """
+        Start sending an image to the host in a separate process. If given, rate is a shared
+        value from a TransferScheduler holding how fast in bytes per second to send, or
+        0.0 to send as fast as we can, and it can be changed while the send is going. If
+        we have a fan out, the send waits a moment for other hosts wanting the same image
+        to join in, and only gets going once we've been ticked after that.
+        """
         with self.__lock:
             if self.__proc is not None:
                 raise HostException("Host has active transfer already")
+            self.__info = None
             self.__lastprogress = (-1, -1)
             self.__laststatus = None
             self.__print(f"Host {self.ip} started sending image.")
 
-            # Start the send
-            self.__proc = multiprocessing.Process(
-                target=_send_file_to_host,
-                args=(self.ip, filename, patches, settings, self.target, self.version, self.send_timeout, os.getpid(), self.__queue),
-            )
-            self.__proc.start()
+            # The net dimm only talks to one connection at a time, so get out of the way
+            # of the send process.
+            self.__close_session()
+
+            # Prepared images are only cached if somewhere to keep them has been configured.
+            image_cache: Optional[Tuple[str, int]] = None
+            if self.image_cache.directory is not None and self.image_cache.max_size > 0:
+                image_cache = (self.image_cache.directory, self.image_cache.max_size)
+            if self.fanout is not None:
+                self.__proc = self.fanout.send(
+                    self.ip,
+                    filename,
+                    patches,
+                    settings,
+                    self.target,
+                    self.version,
+                    self.send_timeout,
+                    image_cache,
+                    self.__manifestfile,
+                    self.__queue,
+                    rate,
+                )
+            else:
+                # Start the send
+                self.__proc = multiprocessing.Process(
+                    target=_send_file_to_host,
+                    args=(
+                        self.ip,
+                        filename,
+                        patches,
+                        settings,
+                        self.target,
+                        self.version,
+                        self.send_timeout,
+                        image_cache,
+                        self.__manifestfile,
+                        os.getpid(),
+                        self.__queue,
+                        rate,
+                    ),
+                )
+                self.__proc.start()
+            self.__update_probing()
 
             # Don't yield control back until we have got the first response from the process
             while self.__lastprogress == (-1, -1) and self.__proc is not None:
                 self.__update_progress()
 
     def crc(self, filename: str, patches: Sequence[str], settings: Dict[SettingsEnum, bytes]) -> int:
-        # Grab the image itself
-        with open(filename, "rb") as fp:
-            data = FileBytes(fp)
-
-            # Patch it
-            data = _handle_patches(data, self.target, patches, settings)
-
-            # Now, apply the CRC algorithm over it.
-            return NetDimm.crc(data)
+        # CRCing a large patched image takes a long time, so look it up in the cache,
+        # which only reads and patches the image when it has to.
+        return self.crc_cache.crc(
+            filename,
+            self.target,
+            patches,
+            settings,
+            lambda data: _handle_patches(data, self.target, patches, settings),
+        )
 
     def wipe(self) -> None:
         with self.__lock:
@@ -339,9 +992,9 @@ class Host:
                 # Host is actively transferring, can't do anything.
                 return
 
+            self.__info = None
             try:
-                netdimm = NetDimm(self.ip, version=self.version, timeout=5)
-                netdimm.wipe_current_game()
+                self.__with_session(lambda netdimm: netdimm.wipe_current_game())
             except NetDimmException:
                 pass
 
@@ -351,8 +1004,14 @@ class Host:
                 # Host is actively transferring, don't bother requesting info.
                 return None
 
+            now = time.time()
+            if self.__info is not None and (now - self.__info[0]) < self.info_cache_time:
+                return self.__info[1]
+
             try:
-                netdimm = NetDimm(self.ip, version=self.version, timeout=5)
-                return netdimm.info()
+                info = self.__with_session(lambda netdimm: netdimm.info())
             except NetDimmException:
+                self.__info = None
                 return None
+            self.__info = (now, info)
+            return info
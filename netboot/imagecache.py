@@ -0,0 +1,188 @@
+import hashlib
+import os
+import os.path
+import tempfile
+import threading
+from typing import Any, Dict, List, Optional, Sequence, Tuple, Union
+
+from arcadeutils import FileBytes
+from netboot.cachedir import private_directory
+from netdimm import NetDimmTargetEnum, OverlayImage
+
+
+class ImageCache:
+    """
+    An on-disk store of fully prepared images, meaning ROMs with all of their patches
+    and settings already applied, so that sending the same game with the same settings
+    to many cabinets only has to build the image once. Images are addressed by a hash
+    of everything that goes into them: the ROM's identity on disk (its path, size,
+    modification time and inode), the contents of every patch, the EEPROM and SRAM
+    settings and the settings trojan. When the store grows beyond its size budget, the
+    least recently used images are evicted.
+
+    Nothing is cached unless a directory is configured, since the cache can grow to
+    several gigabytes and where that's welcome depends on the machine. The directory
+    is created private to us and is never used if anybody else can write to it, since
+    they could otherwise slip us an image of their choosing.
+
+    Preparing images happens in the send process, so the hit and miss counters here
+    are updated by the owning Host as it hears back from its send processes.
+    """
+
+    DEFAULT_MAX_SIZE: int = 4 * 1024 * 1024 * 1024
+    CHUNK_SIZE: int = 1024 * 1024
+
+    def __init__(self, directory: Optional[str] = None, max_size: Optional[int] = None) -> None:
+        self.directory: Optional[str] = directory
+        self.max_size: int = self.DEFAULT_MAX_SIZE if max_size is None else max_size
+        self.__lock: threading.Lock = threading.Lock()
+        self.hits: int = 0
+        self.misses: int = 0
+
+    __default: Optional["ImageCache"] = None
+    __default_lock: threading.Lock = threading.Lock()
+
+    @staticmethod
+    def default() -> "ImageCache":
+        # A single cache shared by every host in this process.
+        with ImageCache.__default_lock:
+            if ImageCache.__default is None:
+                ImageCache.__default = ImageCache()
+            return ImageCache.__default
+
+    def __repr__(self) -> str:
+        return f"ImageCache(directory={repr(self.directory)}, max_size={repr(self.max_size)})"
+
+    def configure(self, directory: Optional[str] = None, max_size: Optional[int] = None) -> None:
+        # Change where prepared images are kept and how much room they can take up.
+        with self.__lock:
+            if directory is not None:
+                self.directory = directory or None
+            if max_size is not None:
+                self.max_size = max(max_size, 0)
+
+    def record(self, hit: bool) -> None:
+        with self.__lock:
+            if hit:
+                self.hits += 1
+            else:
+                self.misses += 1
+
+    def __entries(self) -> List[Tuple[str, int, float]]:
+        entries: List[Tuple[str, int, float]] = []
+        directory = self.directory
+        if directory is None:
+            return entries
+        try:
+            names = os.listdir(directory)
+        except OSError:
+            return entries
+        for name in names:
+            if not name.endswith(".bin"):
+                continue
+            path = os.path.join(directory, name)
+            try:
+                stat = os.stat(path)
+            except OSError:
+                # Evicted by somebody else while we were looking.
+                continue
+            entries.append((path, stat.st_size, stat.st_mtime))
+        return entries
+
+    @property
+    def stats(self) -> Dict[str, int]:
+        entries = self.__entries()
+        with self.__lock:
+            return {
+                "hits": self.hits,
+                "misses": self.misses,
+                "entries": len(entries),
+                "size": sum(size for _, size, _ in entries),
+                "max_size": self.max_size,
+            }
+
+    @staticmethod
+    def key(filename: str, target: NetDimmTargetEnum, patches: Sequence[str], settings: Dict[Any, bytes], trojan: Optional[bytes]) -> str:
+        stat = os.stat(filename)
+        sha = hashlib.sha256()
+        sha.update(f"{os.path.realpath(filename)}:{stat.st_size}:{stat.st_mtime_ns}:{stat.st_ino}:{target.value}".encode("utf-8"))
+        for patch in patches:
+            with open(patch, "rb") as bfp:
+                sha.update(b"patch:" + hashlib.sha256(bfp.read()).digest())
+        for typ in sorted(settings.keys(), key=lambda t: str(t.value)):
+            sha.update(f"settings:{typ.value}:".encode("utf-8") + hashlib.sha256(settings[typ]).digest())
+        if settings and trojan is not None:
+            # The trojan only ends up in the image when there are settings to attach.
+            sha.update(b"trojan:" + hashlib.sha256(trojan).digest())
+        return sha.hexdigest()
+
+    def lookup(self, key: str) -> Optional[str]:
+        """
+        Given a key, return the path to the prepared image if it is in the cache, or
+        None if it isn't. Looking up an image counts as using it for eviction purposes.
+        """
+        directory = self.directory
+        if directory is None or self.max_size <= 0 or not private_directory(directory):
+            return None
+        path = os.path.join(directory, f"{key}.bin")
+        try:
+            os.utime(path)
+        except OSError:
+            return None
+        return path
+
+    def store(self, key: str, data: Union[bytes, FileBytes]) -> Optional[str]:
+        """
+        Write a prepared image into the cache and return the path to it, evicting older
+        images to make room. Returns None if the image could not be stored, such as
+        when it is empty, bigger than the whole cache or the disk is full.
+        """
+        directory = self.directory
+        if directory is None or len(data) == 0 or len(data) > self.max_size:
+            return None
+        if not private_directory(directory):
+            return None
+
+        path = os.path.join(directory, f"{key}.bin")
+        try:
+            self.__evict(self.max_size - len(data))
+
+            # Write somewhere else and then move it into place, so that a concurrent send
+            # of the same image never sees a partially written file.
+            fd, tmppath = tempfile.mkstemp(prefix=".prepared", dir=directory)
+            try:
+                with os.fdopen(fd, "wb") as bfp:
+                    if isinstance(data, OverlayImage):
+                        # Write straight out of the mapped ROM and the patches on top of it.
+                        for piece in data.views():
+                            bfp.write(piece)
+                    else:
+                        for offset in range(0, len(data), self.CHUNK_SIZE):
+                            bfp.write(data[offset:(offset + self.CHUNK_SIZE)])
+                os.replace(tmppath, path)
+            except BaseException:
+                os.remove(tmppath)
+                raise
+        except OSError:
+            return None
+        return path
+
+    def __evict(self, budget: int) -> None:
+        # Throw away least recently used images until everything fits in the budget.
+        entries = sorted(self.__entries(), key=lambda entry: entry[2])
+        total = sum(size for _, size, _ in entries)
+        for path, size, _ in entries:
+            if total <= budget:
+                break
+            try:
+                os.remove(path)
+            except OSError:
+                pass
+            total -= size
+
+    def clear(self) -> None:
+        for path, _, _ in self.__entries():
+            try:
+                os.remove(path)
+            except OSError:
+                pass
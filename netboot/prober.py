@@ -0,0 +1,326 @@
+import errno
+import selectors
+import socket
+import struct
+import threading
+import time
+from typing import Any, Dict, List, Optional, Sequence, Tuple
+
+
+class ProbeStats:
+    # Upper bounds in milliseconds of each bucket in the round trip histogram. Anything
+    # slower than the last one lands in an extra bucket on the end.
+    RTT_BUCKETS_MS: List[float] = [1.0, 2.0, 5.0, 10.0, 20.0, 50.0, 100.0, 200.0, 500.0, 1000.0]
+
+    def __init__(self) -> None:
+        # How many probes in a row the host has answered or ignored.
+        self.successes: int = 0
+        self.failures: int = 0
+        self.probes: int = 0
+        self.lost: int = 0
+        self.last_rtt: Optional[float] = None
+        self.histogram: List[int] = [0] * (len(self.RTT_BUCKETS_MS) + 1)
+
+    def record(self, rtt: Optional[float]) -> None:
+        self.probes += 1
+        self.last_rtt = rtt
+        if rtt is None:
+            self.lost += 1
+            self.successes = 0
+            self.failures += 1
+            return
+
+        self.successes += 1
+        self.failures = 0
+        for index, bound in enumerate(self.RTT_BUCKETS_MS):
+            if (rtt * 1000.0) <= bound:
+                self.histogram[index] += 1
+                return
+        self.histogram[-1] += 1
+
+    def to_dict(self) -> Dict[str, Any]:
+        labels = [f"<={bound:g}ms" for bound in self.RTT_BUCKETS_MS] + [f">{self.RTT_BUCKETS_MS[-1]:g}ms"]
+        return {
+            "probes": self.probes,
+            "lost": self.lost,
+            "last_rtt_ms": (self.last_rtt * 1000.0) if self.last_rtt is not None else None,
+            "rtt_histogram": dict(zip(labels, self.histogram)),
+        }
+
+
+class LivenessProber:
+    """
+    Checks whether a set of hosts are up, all from one thread, instead of every host
+    spawning its own ping process every second or two. Every round, all hosts are probed
+    at once and whatever answered before the timeout counts as up. Where the OS lets an
+    unprivileged process send ICMP echo requests (Linux with a suitable ping_group_range
+    and macOS) that's what gets used, so that the results match what ping would say.
+    Otherwise hosts get a non-blocking TCP connect to the net dimm port, and either an
+    accepted or a refused connection counts as the host being up. When probing over TCP,
+    hosts can be paused while something else is talking to them, since the net dimm only
+    takes one connection at a time and a probe connecting in the middle of a transfer can
+    upset it. A paused host isn't probed and keeps whatever counts it had until it is
+    resumed or the pause runs out, so that a host which goes away while paused is still
+    noticed. ICMP never touches the net dimm port, so those hosts are never paused.
+    """
+
+    DEFAULT_PORT: int = 10703
+    PROBE_INTERVAL: float = 1.0
+    PROBE_TIMEOUT: float = 1.0
+    PAUSE_LIMIT: float = 10.0
+
+    def __init__(
+        self,
+        port: int = DEFAULT_PORT,
+        interval: float = PROBE_INTERVAL,
+        timeout: float = PROBE_TIMEOUT,
+        method: Optional[str] = None,
+        pause_limit: float = PAUSE_LIMIT,
+    ) -> None:
+        if method is None:
+            method = "icmp" if self.__icmp_available() else "tcp"
+        if method not in {"icmp", "tcp"}:
+            raise Exception(f"Unknown probe method {method}!")
+
+        self.port: int = port
+        self.interval: float = interval
+        self.timeout: float = timeout
+        self.method: str = method
+        # How long a pause lasts unless whoever paused the host renews it.
+        self.pause_limit: float = pause_limit
+        self.rounds: int = 0
+        self.__lock: threading.Lock = threading.Lock()
+        self.__hosts: Dict[str, int] = {}
+        self.__stats: Dict[str, ProbeStats] = {}
+        self.__paused: Dict[str, float] = {}
+        self.__sequence: int = 0
+        self.__thread: Optional[threading.Thread] = None
+
+    __default: Optional["LivenessProber"] = None
+    __default_lock: threading.Lock = threading.Lock()
+
+    @staticmethod
+    def default() -> "LivenessProber":
+        # A single prober shared by every host in this process.
+        with LivenessProber.__default_lock:
+            if LivenessProber.__default is None:
+                LivenessProber.__default = LivenessProber()
+            return LivenessProber.__default
+
+    def __repr__(self) -> str:
+        return f"LivenessProber(port={repr(self.port)}, interval={repr(self.interval)}, timeout={repr(self.timeout)}, method={repr(self.method)}, pause_limit={repr(self.pause_limit)})"
+
+    @staticmethod
+    def __icmp_available() -> bool:
+        try:
+            sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_ICMP)
+        except OSError:
+            return False
+        sock.close()
+        return True
+
+    def add(self, ip: str) -> None:
+        """
+        Start probing a host, starting the probe thread if it isn't running yet. Hosts are
+        counted, so a host added twice needs to be removed twice.
+        """
+        with self.__lock:
+            self.__hosts[ip] = self.__hosts.get(ip, 0) + 1
+            if ip not in self.__stats:
+                self.__stats[ip] = ProbeStats()
+            if self.__thread is None:
+                self.__thread = threading.Thread(target=self.__probe_thread)
+                self.__thread.daemon = True
+                self.__thread.start()
+
+    def remove(self, ip: str) -> None:
+        with self.__lock:
+            if ip not in self.__hosts:
+                return
+            self.__hosts[ip] -= 1
+            if self.__hosts[ip] <= 0:
+                del self.__hosts[ip]
+                del self.__stats[ip]
+
+    def pause(self, ip: str) -> None:
+        """
+        Stop probing a host until it is resumed or the pause limit runs out. Pausing a host
+        that is already paused pushes the limit back out, so whoever is talking to the host
+        can keep the prober away for as long as the host keeps answering them. This does
+        nothing when probing over ICMP, since that never gets in the net dimm's way.
+        """
+        if self.method != "tcp":
+            return
+        with self.__lock:
+            self.__paused[ip] = time.time() + self.pause_limit
+
+    def resume(self, ip: str) -> None:
+        with self.__lock:
+            self.__paused.pop(ip, None)
+
+    @property
+    def paused(self) -> List[str]:
+        with self.__lock:
+            now = time.time()
+            return [ip for ip, until in self.__paused.items() if until > now]
+
+    @property
+    def hosts(self) -> List[str]:
+        with self.__lock:
+            return list(self.__hosts.keys())
+
+    def reset(self, ip: str) -> None:
+        # Forget how many probes in a row a host has answered or ignored.
+        with self.__lock:
+            if ip in self.__stats:
+                self.__stats[ip].successes = 0
+                self.__stats[ip].failures = 0
+
+    def consecutive(self, ip: str) -> Tuple[int, int]:
+        """
+        Return how many probes in a row a host has answered and how many in a row it has
+        ignored. At most one of these is nonzero, and both are zero until the first probe.
+        """
+        with self.__lock:
+            if ip not in self.__stats:
+                return (0, 0)
+            return (self.__stats[ip].successes, self.__stats[ip].failures)
+
+    def stats(self, ip: str) -> Dict[str, Any]:
+        with self.__lock:
+            return (self.__stats.get(ip) or ProbeStats()).to_dict()
+
+    def __probe_thread(self) -> None:
+        while True:
+            start = time.time()
+            with self.__lock:
+                hosts = [ip for ip in self.__hosts if self.__paused.get(ip, 0.0) <= start]
+
+            if hosts:
+                results = self.probe(hosts)
+                with self.__lock:
+                    for ip, rtt in results.items():
+                        if ip in self.__stats:
+                            self.__stats[ip].record(rtt)
+                    self.rounds += 1
+
+            time.sleep(max(self.interval - (time.time() - start), 0.0))
+
+    def probe(self, hosts: Sequence[str]) -> Dict[str, Optional[float]]:
+        """
+        Probe every host once, all at the same time, and return the round trip time in
+        seconds for each host that answered, or None for each one that didn't.
+        """
+        if self.method == "icmp":
+            return self.__probe_icmp(hosts)
+        return self.__probe_tcp(hosts)
+
+    def __probe_tcp(self, hosts: Sequence[str]) -> Dict[str, Optional[float]]:
+        results: Dict[str, Optional[float]] = {ip: None for ip in hosts}
+        # A refused connection still means there's something there to refuse us.
+        answered = {0, errno.ECONNREFUSED}
+        pending = {errno.EINPROGRESS, errno.EWOULDBLOCK, errno.EAGAIN}
+        deadline = time.perf_counter() + self.timeout
+
+        with selectors.DefaultSelector() as selector:
+            try:
+                for ip in set(hosts):
+                    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+                    sock.setblocking(False)
+                    started = time.perf_counter()
+                    try:
+                        error = sock.connect_ex((ip, self.port))
+                    except OSError:
+                        # Couldn't even resolve the host.
+                        error = errno.EHOSTUNREACH
+                    if error in pending:
+                        selector.register(sock, selectors.EVENT_WRITE, (ip, started))
+                        continue
+                    if error in answered:
+                        results[ip] = time.perf_counter() - started
+                    sock.close()
+
+                while selector.get_map():
+                    remaining = deadline - time.perf_counter()
+                    if remaining <= 0.0:
+                        break
+                    for key, _ in selector.select(remaining):
+                        ip, started = key.data
+                        sock = key.fileobj  # type: ignore
+                        if sock.getsockopt(socket.SOL_SOCKET, socket.SO_ERROR) in answered:
+                            results[ip] = time.perf_counter() - started
+                        selector.unregister(sock)
+                        sock.close()
+            finally:
+                for key in list(selector.get_map().values()):
+                    selector.unregister(key.fileobj)
+                    key.fileobj.close()  # type: ignore
+
+        return results
+
+    @staticmethod
+    def __checksum(data: bytes) -> int:
+        if len(data) & 1:
+            data += b"\0"
+        total: int = sum(struct.unpack(f"!{len(data) // 2}H", data))
+        total = (total >> 16) + (total & 0xFFFF)
+        total += total >> 16
+        return ~total & 0xFFFF
+
+    def __probe_icmp(self, hosts: Sequence[str]) -> Dict[str, Optional[float]]:
+        results: Dict[str, Optional[float]] = {ip: None for ip in hosts}
+        self.__sequence = (self.__sequence + 1) & 0xFFFF
+        sequence = self.__sequence
+        deadline = time.perf_counter() + self.timeout
+
+        # The OS fills in the identifier with something unique to this socket and only
+        # hands us replies to requests that went out on it, so we only need to match
+        # replies up by address and sequence number.
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_ICMP)
+        try:
+            sock.setblocking(False)
+            request = struct.pack("!BBHHH", 8, 0, 0, 0, sequence) + b"netboot"
+            request = request[:2] + struct.pack("!H", self.__checksum(request)) + request[4:]
+
+            started: Dict[str, float] = {}
+            addresses: Dict[str, str] = {}
+            for ip in set(hosts):
+                try:
+                    address = socket.gethostbyname(ip)
+                    addresses[ip] = address
+                    started[ip] = time.perf_counter()
+                    sock.sendto(request, (address, 0))
+                except OSError:
+                    # Unresolvable or unroutable, so it's definitely not answering.
+                    started.pop(ip, None)
+
+            with selectors.DefaultSelector() as selector:
+                selector.register(sock, selectors.EVENT_READ)
+                while any(results[ip] is None for ip in started):
+                    remaining = deadline - time.perf_counter()
+                    if remaining <= 0.0 or not selector.select(remaining):
+                        break
+                    while True:
+                        try:
+                            reply, (address, _) = sock.recvfrom(1024)
+                        except (BlockingIOError, InterruptedError):
+                            break
+                        except OSError:
+                            # Things like ICMP errors for other probes, which we ignore.
+                            continue
+
+                        # macOS hands us the IP header as well, Linux does not.
+                        if len(reply) >= 20 and (reply[0] >> 4) == 4:
+                            reply = reply[((reply[0] & 0xF) * 4):]
+                        if len(reply) < 8:
+                            continue
+                        typ, _, _, _, seq = struct.unpack("!BBHHH", reply[0:8])
+                        if typ != 0 or seq != sequence:
+                            continue
+                        for ip, when in started.items():
+                            if results[ip] is None and addresses[ip] == address:
+                                results[ip] = time.perf_counter() - when
+        finally:
+            sock.close()
+
+        return results
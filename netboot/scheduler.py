@@ -0,0 +1,282 @@
+import heapq
+import queue
+import threading
+import time
+from typing import Any, Callable, Dict, List, Optional, Set, Tuple
+
+from netboot.log import log
+
+
+class ScheduledTask:
+    """
+    A callback that a Scheduler runs every interval seconds until it is cancelled, along
+    with how well the scheduler has been keeping up with it.
+    """
+
+    def __init__(
+        self,
+        scheduler: "Scheduler",
+        name: str,
+        interval: float,
+        callback: Callable[[], None],
+        group: Optional[str] = None,
+    ) -> None:
+        self.name: str = name
+        self.interval: float = interval
+        self.callback: Callable[[], None] = callback
+        # Tasks in the same group never run at the same time as each other.
+        self.group: Optional[str] = group
+        self.cancelled: bool = False
+        self.__scheduler = scheduler
+
+        # When this task is next due to run.
+        self.deadline: float = 0.0
+
+        self.runs: int = 0
+        # Runs that never happened because we were too far behind to make them on time.
+        self.overruns: int = 0
+        # Runs that had to wait for another task in the same group to finish first.
+        self.deferrals: int = 0
+        self.errors: int = 0
+        self.max_lateness: float = 0.0
+        self.last_duration: float = 0.0
+        self.max_duration: float = 0.0
+        self.total_duration: float = 0.0
+        # Runs that went on for longer than the scheduler's watchdog allows.
+        self.stalls: int = 0
+
+        # When the run in progress started, if there is one, and whether the watchdog has
+        # already complained about it.
+        self.started: Optional[float] = None
+        self.stalled: bool = False
+
+    def __repr__(self) -> str:
+        return f"ScheduledTask(name={repr(self.name)}, interval={repr(self.interval)})"
+
+    def cancel(self) -> None:
+        self.__scheduler.cancel(self)
+
+    @property
+    def stats(self) -> Dict[str, Any]:
+        return {
+            "runs": self.runs,
+            "overruns": self.overruns,
+            "deferrals": self.deferrals,
+            "errors": self.errors,
+            "stalls": self.stalls,
+            "running": self.started is not None,
+            "max_lateness_ms": self.max_lateness * 1000.0,
+            "last_duration_ms": self.last_duration * 1000.0,
+            "average_duration_ms": (self.total_duration / self.runs * 1000.0) if self.runs else 0.0,
+            "max_duration_ms": self.max_duration * 1000.0,
+        }
+
+
+class Scheduler:
+    """
+    Runs periodic work for every host and cabinet, instead of each of them sleeping in a
+    thread of its own. Tasks sit in a heap ordered by when they're next due, and a single
+    thread hands them to a bounded pool of workers as they come due, so that a task that
+    blocks for a while, such as a cabinet waiting on a net dimm that isn't answering,
+    only ties up one worker instead of holding up everybody else. A task never runs on
+    two workers at once, and neither do two tasks in the same group, so that all of the
+    tasks for a host that has stopped answering can only ever tie up one worker between
+    them instead of piling up behind each other's locks. Tasks run at a fixed rate so
+    that a task that runs late doesn't push every later run back with it. New tasks are
+    spread out across their interval so that fifty cabinets added at once don't all want
+    to run on the same tick. When a run of a task is due before the previous one has even
+    finished, it is skipped and counted as an overrun rather than being run back to back
+    to catch up. A watchdog logs any run that goes on for longer than it should, since
+    there's no safe way to stop it.
+    """
+
+    # Fraction of an interval between the first runs of tasks added one after another.
+    # Being the golden ratio, any number of tasks ends up evenly spread out.
+    SPREAD: float = 0.6180339887498949
+
+    WORKERS: int = 8
+    WATCHDOG_SECONDS: float = 30.0
+
+    def __init__(self, workers: int = WORKERS, watchdog: float = WATCHDOG_SECONDS) -> None:
+        self.workers: int = workers
+        self.watchdog: float = watchdog
+        self.__queue: "queue.Queue[ScheduledTask]" = queue.Queue()
+        self.__workers: List[threading.Thread] = []
+        self.__lock: threading.Condition = threading.Condition()
+        self.__heap: List[Tuple[float, int, ScheduledTask]] = []
+        self.__tasks: List[ScheduledTask] = []
+        self.__running: List[ScheduledTask] = []
+        # Groups with a task running right now, and tasks that came due while they were.
+        self.__busy: Set[str] = set()
+        self.__deferred: Dict[str, List[ScheduledTask]] = {}
+        self.__count: int = 0
+        self.__thread: Optional[threading.Thread] = None
+
+    __default: Optional["Scheduler"] = None
+    __default_lock: threading.Lock = threading.Lock()
+
+    @staticmethod
+    def default() -> "Scheduler":
+        # A single scheduler shared by every host and cabinet in this process.
+        with Scheduler.__default_lock:
+            if Scheduler.__default is None:
+                Scheduler.__default = Scheduler()
+            return Scheduler.__default
+
+    def __repr__(self) -> str:
+        return f"Scheduler(workers={repr(self.workers)}, watchdog={repr(self.watchdog)})"
+
+    def every(
+        self,
+        interval: float,
+        callback: Callable[[], None],
+        name: Optional[str] = None,
+        group: Optional[str] = None,
+    ) -> ScheduledTask:
+        """
+        Run a callback every interval seconds, starting somewhere within the first interval,
+        until the returned task is cancelled. Exceptions thrown by the callback are logged and
+        counted, so that one bad task can't take down the rest. If a group is given, the
+        callback waits for any other task in that group to finish before it runs.
+        """
+        if interval <= 0.0:
+            raise Exception("Scheduled tasks must have a positive interval!")
+
+        with self.__lock:
+            task = ScheduledTask(self, name or repr(callback), interval, callback, group)
+            task.deadline = time.monotonic() + (interval * ((self.__count * self.SPREAD) % 1.0))
+            self.__push(task)
+            self.__tasks.append(task)
+
+            if self.__thread is None:
+                # Workers are daemon threads like the scheduler itself, so that a task stuck
+                # waiting on a net dimm can't keep us from exiting.
+                for _ in range(self.workers):
+                    worker = threading.Thread(target=self.__worker_thread)
+                    worker.daemon = True
+                    worker.start()
+                    self.__workers.append(worker)
+                self.__thread = threading.Thread(target=self.__run_thread)
+                self.__thread.daemon = True
+                self.__thread.start()
+            self.__lock.notify()
+            return task
+
+    def cancel(self, task: ScheduledTask) -> None:
+        with self.__lock:
+            # It gets dropped the next time it comes up in the heap.
+            task.cancelled = True
+            if task in self.__tasks:
+                self.__tasks.remove(task)
+
+    @property
+    def tasks(self) -> List[ScheduledTask]:
+        with self.__lock:
+            return list(self.__tasks)
+
+    @property
+    def stats(self) -> Dict[str, Any]:
+        tasks = self.tasks
+        return {
+            "tasks": len(tasks),
+            "runs": sum(task.runs for task in tasks),
+            "overruns": sum(task.overruns for task in tasks),
+            "deferrals": sum(task.deferrals for task in tasks),
+            "errors": sum(task.errors for task in tasks),
+            "stalls": sum(task.stalls for task in tasks),
+            "running": sum(1 for task in tasks if task.started is not None),
+            "max_lateness_ms": max((task.max_lateness for task in tasks), default=0.0) * 1000.0,
+        }
+
+    def __push(self, task: ScheduledTask) -> None:
+        # Note that this should only be called by something that has a lock. The counter
+        # keeps tasks due at the same time in the order they were scheduled.
+        self.__count += 1
+        heapq.heappush(self.__heap, (task.deadline, self.__count, task))
+
+    def __run_thread(self) -> None:
+        while True:
+            with self.__lock:
+                while True:
+                    while self.__heap and self.__heap[0][2].cancelled:
+                        heapq.heappop(self.__heap)
+                    now = time.monotonic()
+                    if self.__heap and self.__heap[0][0] <= now:
+                        _, _, task = heapq.heappop(self.__heap)
+                        if task.group is None or task.group not in self.__busy:
+                            break
+
+                        # Something else in this group is still running, so this goes
+                        # back in the heap when that finishes.
+                        task.deferrals += 1
+                        self.__deferred.setdefault(task.group, []).append(task)
+                        continue
+
+                    # Sleep until the next task is due or the next running task would
+                    # trip the watchdog, whichever comes first.
+                    wakeups = [self.__heap[0][0]] if self.__heap else []
+                    wakeups.extend(self.__watchdog(now))
+                    self.__lock.wait((min(wakeups) - now) if wakeups else None)
+                if task.group is not None:
+                    self.__busy.add(task.group)
+                task.started = now
+                task.stalled = False
+                self.__running.append(task)
+
+            self.__queue.put(task)
+
+    def __watchdog(self, now: float) -> List[float]:
+        # Complain about anything that's been running too long, and return when the
+        # rest of the running tasks will have been. Note that this should only be called
+        # by something that has a lock.
+        wakeups: List[float] = []
+        for task in self.__running:
+            if task.started is None or task.stalled:
+                continue
+            if (now - task.started) >= self.watchdog:
+                task.stalled = True
+                task.stalls += 1
+                log(f"Scheduled task {task.name} has been running for {now - task.started:.1f} seconds!")
+            else:
+                wakeups.append(task.started + self.watchdog)
+        return wakeups
+
+    def __worker_thread(self) -> None:
+        while True:
+            self.__run(self.__queue.get())
+
+    def __run(self, task: ScheduledTask) -> None:
+        start = time.monotonic()
+        task.max_lateness = max(task.max_lateness, start - task.deadline)
+        try:
+            task.callback()
+        except Exception as e:
+            task.errors += 1
+            log(f"Scheduled task {task.name} failed: {e}")
+
+        with self.__lock:
+            task.runs += 1
+            task.last_duration = time.monotonic() - start
+            task.max_duration = max(task.max_duration, task.last_duration)
+            task.total_duration += task.last_duration
+            task.started = None
+            self.__running.remove(task)
+
+            if task.group is not None:
+                # Anything in the group that came due in the meantime keeps its deadline,
+                # so it runs right away and gets counted as late if it was.
+                self.__busy.discard(task.group)
+                for deferred in self.__deferred.pop(task.group, []):
+                    self.__push(deferred)
+
+            if not task.cancelled:
+                # Stay on the original schedule, skipping any runs that came due while
+                # this one was still going.
+                task.deadline += task.interval
+                now = time.monotonic()
+                if task.deadline <= now:
+                    missed = int((now - task.deadline) // task.interval) + 1
+                    task.overruns += missed
+                    task.deadline += missed * task.interval
+                self.__push(task)
+            self.__lock.notify()
@@ -0,0 +1,195 @@
+import multiprocessing
+import threading
+from enum import Enum
+from typing import Any, Dict, List, Optional
+
+
+class TransferPolicyEnum(Enum):
+    # Which queued transfers go first. Operator-pinned cabinets always go before
+    # everybody else, and within either group ties go to whoever asked first.
+    POLICY_SHORTEST_FIRST = "shortest"
+    POLICY_FIFO = "fifo"
+
+
+class TransferRequest:
+    def __init__(self, ip: str, size: int, pinned: bool, order: int) -> None:
+        self.ip: str = ip
+        self.size: int = size
+        self.pinned: bool = pinned
+        self.order: int = order
+
+        # Set once the transfer is allowed to start. The send process reads the rate it
+        # should stick to out of here, in bytes per second or 0.0 for as fast as it can.
+        self.rate: Optional[Any] = None
+
+    def __repr__(self) -> str:
+        return f"TransferRequest(ip={repr(self.ip)}, size={repr(self.size)}, pinned={repr(self.pinned)})"
+
+
+class TransferScheduler:
+    """
+    Decides which cabinets get to send their game when, so that a whole venue coming back
+    from a power outage doesn't try to send every game at once, thrashing the disk and
+    the network so that everybody finishes late. At most max_concurrent sends happen at
+    once and the rest wait in line, ordered by the policy. Sends that are going share the
+    bandwidth budget evenly, and no single send goes faster than link_bandwidth, both in
+    bytes per second. Any of these left as None isn't limited, which is the default, so
+    that nothing waits unless a limit has been configured. Since sends happen in their
+    own processes, each one gets a shared value holding the rate it should go at, which
+    is updated as other sends come and go. Cabinets that join in on a fan out send of the
+    same game don't take up places of their own, since the whole group reads the game
+    once and shares a single rate, so it counts as one send against max_concurrent.
+    """
+
+    def __init__(
+        self,
+        max_concurrent: Optional[int] = None,
+        bandwidth: Optional[float] = None,
+        link_bandwidth: Optional[float] = None,
+        policy: TransferPolicyEnum = TransferPolicyEnum.POLICY_SHORTEST_FIRST,
+    ) -> None:
+        if max_concurrent is not None and max_concurrent < 1:
+            raise Exception("Must allow at least one transfer at a time!")
+
+        self.max_concurrent: Optional[int] = max_concurrent
+        self.bandwidth: Optional[float] = bandwidth
+        self.link_bandwidth: Optional[float] = link_bandwidth
+        self.policy: TransferPolicyEnum = policy
+        self.__lock: threading.Lock = threading.Lock()
+        self.__waiting: Dict[str, TransferRequest] = {}
+        self.__active: Dict[str, TransferRequest] = {}
+        self.__order: int = 0
+        self.started: int = 0
+        self.max_active: int = 0
+
+    __default: Optional["TransferScheduler"] = None
+    __default_lock: threading.Lock = threading.Lock()
+
+    @staticmethod
+    def default() -> "TransferScheduler":
+        # A single scheduler shared by every cabinet in this process.
+        with TransferScheduler.__default_lock:
+            if TransferScheduler.__default is None:
+                TransferScheduler.__default = TransferScheduler()
+            return TransferScheduler.__default
+
+    def __repr__(self) -> str:
+        return (
+            f"TransferScheduler(max_concurrent={repr(self.max_concurrent)}, bandwidth={repr(self.bandwidth)}, "
+            f"link_bandwidth={repr(self.link_bandwidth)}, policy={repr(self.policy)})"
+        )
+
+    def configure(
+        self,
+        max_concurrent: Optional[int] = None,
+        bandwidth: Optional[float] = None,
+        link_bandwidth: Optional[float] = None,
+        policy: Optional[TransferPolicyEnum] = None,
+    ) -> None:
+        """
+        Change the limits, for instance after loading them from a config file. Anything left
+        as None stays the way it was, and a limit of 0 removes that limit. Sends that are
+        already going keep going, but pick up the new bandwidth limits straight away.
+        """
+        with self.__lock:
+            if max_concurrent is not None:
+                self.max_concurrent = max_concurrent if max_concurrent > 0 else None
+            if bandwidth is not None:
+                self.bandwidth = bandwidth if bandwidth > 0 else None
+            if link_bandwidth is not None:
+                self.link_bandwidth = link_bandwidth if link_bandwidth > 0 else None
+            if policy is not None:
+                self.policy = policy
+            self.__dispatch()
+
+    def request(self, ip: str, size: int, pinned: bool = False) -> int:
+        """
+        Ask to send a game of a given size to a cabinet. Returns 0 if the send can go ahead
+        now, or the cabinet's position in line, starting at 1, if it has to wait. Keep
+        asking until it is allowed to go, and call release() once the send is done or the
+        cabinet no longer needs to send anything.
+        """
+        with self.__lock:
+            if ip in self.__active:
+                return 0
+
+            if ip in self.__waiting:
+                # Whatever we're sending may have changed since we got in line.
+                self.__waiting[ip].size = size
+                self.__waiting[ip].pinned = pinned
+            else:
+                self.__order += 1
+                self.__waiting[ip] = TransferRequest(ip, size, pinned, self.__order)
+
+            self.__dispatch()
+            if ip in self.__active:
+                return 0
+            return [request.ip for request in self.__queue()].index(ip) + 1
+
+    def position(self, ip: str) -> Optional[int]:
+        """
+        Returns 0 if a cabinet's send can go ahead, its position in line starting at 1 if
+        it is waiting, or None if it hasn't asked to send anything.
+        """
+        with self.__lock:
+            if ip in self.__active:
+                return 0
+            if ip in self.__waiting:
+                return [request.ip for request in self.__queue()].index(ip) + 1
+            return None
+
+    def rate(self, ip: str) -> Optional[Any]:
+        # The shared value that a cabinet's send process should read its rate out of.
+        with self.__lock:
+            if ip not in self.__active:
+                return None
+            return self.__active[ip].rate
+
+    def release(self, ip: str) -> None:
+        # Give up a cabinet's place, either in line or sending, letting the next one go.
+        with self.__lock:
+            if ip not in self.__active and ip not in self.__waiting:
+                return
+            self.__active.pop(ip, None)
+            self.__waiting.pop(ip, None)
+            self.__dispatch()
+
+    @property
+    def stats(self) -> Dict[str, Any]:
+        with self.__lock:
+            return {
+                "active": sorted(self.__active.keys()),
+                "waiting": [request.ip for request in self.__queue()],
+                "started": self.started,
+                "max_active": self.max_active,
+                "rates": {ip: (request.rate.value if request.rate is not None else 0.0) for ip, request in self.__active.items()},
+            }
+
+    def __queue(self) -> List[TransferRequest]:
+        # Everybody waiting, in the order they'll get to go. Note that this should only be
+        # called by something that has a lock.
+        if self.policy == TransferPolicyEnum.POLICY_SHORTEST_FIRST:
+            return sorted(self.__waiting.values(), key=lambda request: (not request.pinned, request.size, request.order))
+        return sorted(self.__waiting.values(), key=lambda request: (not request.pinned, request.order))
+
+    def __dispatch(self) -> None:
+        # Let as many people as we have room for go, and then split the bandwidth among
+        # everybody that's going. Note that this should only be called by something that
+        # has a lock.
+        queue = self.__queue()
+        while queue and (self.max_concurrent is None or len(self.__active) < self.max_concurrent):
+            request = queue.pop(0)
+            del self.__waiting[request.ip]
+            request.rate = multiprocessing.Value('d', 0.0, lock=False)
+            self.__active[request.ip] = request
+            self.started += 1
+        self.max_active = max(self.max_active, len(self.__active))
+
+        limits = []
+        if self.bandwidth:
+            limits.append(self.bandwidth / max(len(self.__active), 1))
+        if self.link_bandwidth:
+            limits.append(self.link_bandwidth)
+        for request in self.__active.values():
+            if request.rate is not None:
+                request.rate.value = min(limits) if limits else 0.0
@@ -9,7 +9,7 @@ from flask import Flask, Response, request, render_template, make_response, json
 from werkzeug.routing import PathConverter
 from netdimm import NetDimm, NetDimmVersionEnum, NetDimmTargetEnum
 from naomi import NaomiRomRegionEnum
-from netboot import Cabinet, CabinetRegionEnum, CabinetPowerStateEnum, CabinetManager, DirectoryManager, PatchManager, SRAMManager, SettingsManager
+from netboot import Cabinet, CabinetRegionEnum, CabinetPowerStateEnum, CabinetManager, DirectoryManager, CRCCache, FanOut, ImageCache, PatchManager, Scheduler, SRAMManager, SettingsManager, TransferPolicyEnum, TransferScheduler
 from smartoutlet import ALL_OUTLET_CLASSES
 
 
@@ -80,6 +80,7 @@ def cabinet_to_dict(cab: Cabinet, dirmanager: DirectoryManager) -> Dict[str, Any
         'time_hack': cab.time_hack,
         'power_cycle': cab.power_cycle,
         'send_timeout': cab.send_timeout,
+        'pinned': cab.pinned,
     }
 
 
@@ -406,6 +407,26 @@ def cabinets() -> Dict[str, Any]:
     }
 
 
+@app.route('/cache')
+@jsonify
+def imagecache() -> Dict[str, Any]:
+    return {
+        'images': ImageCache.default().stats,
+    }
+
+
+@app.route('/scheduler')
+@jsonify
+def scheduler() -> Dict[str, Any]:
+    scheduler = Scheduler.default()
+    return {
+        'scheduler': scheduler.stats,
+        'tasks': {task.name: task.stats for task in scheduler.tasks},
+        'transfers': TransferScheduler.default().stats,
+        'fanout': FanOut.default().stats,
+    }
+
+
 @app.route('/cabinets/<ip>')
 @jsonify
 def cabinet(ip: str) -> Dict[str, Any]:
@@ -465,6 +486,7 @@ def updatecabinet(ip: str) -> Dict[str, Any]:
         enabled=request.json['enabled'],
         time_hack=request.json['time_hack'],
         send_timeout=request.json['send_timeout'] or None,
+        pinned=request.json.get('pinned'),
     )
     serialize_app(app)
     return cabinet_to_dict(cabman.cabinet(ip), dirman)
@@ -870,6 +892,38 @@ def spawn_app(config_file: str, debug: bool = False) -> Flask:
     else:
         checksums = {}
 
+    # Optional limits on sending games to a whole venue's worth of cabinets at once.
+    transfers = data.get('transfers') or {}
+    if not isinstance(transfers, dict):
+        raise AppException(f"Invalid YAML file format for {config_file}, expected dictionary for transfers setting!")
+    TransferScheduler.default().configure(
+        max_concurrent=int(transfers['max_concurrent']) if transfers.get('max_concurrent') else None,
+        bandwidth=float(transfers['bandwidth']) if transfers.get('bandwidth') else None,
+        link_bandwidth=float(transfers['link_bandwidth']) if transfers.get('link_bandwidth') else None,
+        policy=TransferPolicyEnum(str(transfers['policy'])) if 'policy' in transfers else None,
+    )
+
+    # Optional tuning for sending the same game to several cabinets at once.
+    fanout = data.get('fanout') or {}
+    if not isinstance(fanout, dict):
+        raise AppException(f"Invalid YAML file format for {config_file}, expected dictionary for fanout setting!")
+    FanOut.default().configure(
+        gather=float(fanout['gather']) if 'gather' in fanout else None,
+        window=int(fanout['window']) if 'window' in fanout else None,
+    )
+
+    # Optional on-disk caches of prepared images and their CRCs. Nothing gets written to
+    # disk unless a directory to keep the caches in is configured.
+    cache = data.get('cache') or {}
+    if not isinstance(cache, dict):
+        raise AppException(f"Invalid YAML file format for {config_file}, expected dictionary for cache setting!")
+    cache_dir = os.path.abspath(os.path.join(config_dir, str(cache['directory']))) if cache.get('directory') else None
+    ImageCache.default().configure(
+        directory=cache_dir,
+        max_size=int(cache['image_size']) if 'image_size' in cache else None,
+    )
+    CRCCache.default().configure(path=os.path.join(cache_dir, "crc_cache.json") if cache_dir else None)
+
     app.config['CabinetManager'] = CabinetManager.from_yaml(cabinet_file)
     app.config['DirectoryManager'] = DirectoryManager(directories, checksums)
     app.config['PatchManager'] = PatchManager(patches)
@@ -890,6 +944,23 @@ def serialize_app(app: Flask) -> None:
         'settings_directory': app.config['SettingsManager'].naomi_directory,
         'filenames': app.config['DirectoryManager'].checksums,
     }
+    transfers = TransferScheduler.default()
+    config['transfers'] = {
+        'max_concurrent': transfers.max_concurrent,
+        'bandwidth': transfers.bandwidth,
+        'link_bandwidth': transfers.link_bandwidth,
+        'policy': transfers.policy.value,
+    }
+    fanout = FanOut.default()
+    config['fanout'] = {
+        'gather': fanout.gather,
+        'window': fanout.window,
+    }
+    images = ImageCache.default()
+    config['cache'] = {
+        'directory': images.directory,
+        'image_size': images.max_size,
+    }
     with open(app.config['config_file'], "w") as fp:
         yaml.dump(config, fp)
 
@@ -44,6 +44,7 @@ Vue.component('state', {
             <span v-if="status == 'wait_power_off'">running game</span>
             <span v-if="status == 'power_cycle'">rebooting cabinet</span>
             <span v-if="status == 'check_game'">verifying game crc</span>
+            <span v-if="status == 'wait_send_slot'">waiting to send game (number {{ progress }} in line)</span>
             <span v-if="status == 'send_game'">sending game ({{ progress }}% complete)</span>
         </span>
     `,
@@ -401,7 +402,8 @@ Vue.component('cabinetconfig', {
                     timeout. If you are running on a platform that takes awhile to boot, setting a custom
                     send timeout to something longer like 30 seconds can allow stubborn systems to work fine.
                     If you disable management of this cabinet then no games will be sent to it nor will it
-                    be checked to see if it is up.
+                    be checked to see if it is up. If several cabinets are waiting to be sent games, pinned
+                    cabinets go to the front of the line.
                 </div>
                 <dl>
                     <dt>IP Address</dt><dd>{{ cabinet.ip }}</dd>
@@ -437,6 +439,10 @@ Vue.component('cabinetconfig', {
                         <span>seconds</span>
                         <span class="errorindicator" v-if="invalid_timeout">invalid timeout</span>
                     </dd>
+                    <dt>Send Priority</dt><dd>
+                        <input id="pinned" type="checkbox" v-model="cabinet.pinned" />
+                        <label for="pinned">pin this cabinet to the front of the line</label>
+                    </dd>
                     <dt>Management Enabled</dt><dd>
                         <input id="enabled" type="checkbox" v-model="cabinet.enabled" />
                         <label for="enabled">allow management of this cabinet</label>
@@ -466,7 +472,7 @@ Vue.component('cabinetconfig', {
                     <dd v-if="info.available">{{ info.memavail }} MB</dd>
                 </dl>
                 <div class="query">
-                    <button v-on:click="query" :disabled="info.status == 'turned_off' || info.status == 'power_cycle' || info.status == 'send_game' || info.status == 'startup' || info.status == 'wait_power_on'">Query Firmware Information</button>
+                    <button v-on:click="query" :disabled="info.status == 'turned_off' || info.status == 'power_cycle' || info.status == 'send_game' || info.status == 'wait_send_slot' || info.status == 'startup' || info.status == 'wait_power_on'">Query Firmware Information</button>
                     <span class="queryindicator" v-if="querying"><img src="/static/loading-16.gif" width=16 height=16 /> querying...</span>
                 </div>
             </div>
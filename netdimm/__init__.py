@@ -6,10 +6,20 @@ from netdimm.netdimm import (
     PeekPokeTypeEnum,
     NetDimmInfo,
     NetDimmPacket,
+    NetDimmTransferStats,
+    NetDimmManifest,
     NetDimm,
+    NetDimmBroadcast,
+    NetDimmBroadcastReader,
 )
+from netdimm.overlay import OverlayImage
 from netdimm.message import (
     Message,
+    MessageChannel,
+    MessagePoller,
+    MessageCodec,
+    MessageSendStats,
+    MessageStream,
     MessageException,
     receive_packet,
     send_packet,
@@ -19,8 +29,14 @@ from netdimm.message import (
     write_scratch2_register,
     receive_message,
     send_message,
+    receive_stream,
+    send_stream,
+    Mailbox,
+    receive_mailbox_packet,
+    send_mailbox_packet,
     MAX_PACKET_LENGTH,
     MAX_MESSAGE_LENGTH,
+    MAX_STREAM_LENGTH,
     MESSAGE_HOST_STDOUT,
     MESSAGE_HOST_STDERR,
 )
@@ -33,8 +49,18 @@ __all__ = [
     "PeekPokeTypeEnum",
     "NetDimmInfo",
     "NetDimmPacket",
+    "NetDimmTransferStats",
+    "NetDimmManifest",
     "NetDimm",
+    "NetDimmBroadcast",
+    "NetDimmBroadcastReader",
+    "OverlayImage",
     "Message",
+    "MessageChannel",
+    "MessagePoller",
+    "MessageCodec",
+    "MessageSendStats",
+    "MessageStream",
     "MessageException",
     "receive_packet",
     "send_packet",
@@ -44,8 +70,14 @@ __all__ = [
     "write_scratch2_register",
     "receive_message",
     "send_message",
+    "receive_stream",
+    "send_stream",
+    "Mailbox",
+    "receive_mailbox_packet",
+    "send_mailbox_packet",
     "MAX_PACKET_LENGTH",
     "MAX_MESSAGE_LENGTH",
+    "MAX_STREAM_LENGTH",
     "MESSAGE_HOST_STDOUT",
     "MESSAGE_HOST_STDERR",
 ]
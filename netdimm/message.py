@@ -1,14 +1,20 @@
 #!/usr/bin/env python3
+import collections
+import math
 import struct
+import threading
 import time
+import weakref
 import zlib
-from typing import Dict, List, Optional
+from typing import Callable, Deque, Dict, Iterable, Iterator, List, Optional, Tuple, Union
 
 from netdimm import NetDimm, PeekPokeTypeEnum
 
 
 MAX_PACKET_LENGTH: int = ((0xFF - 2) * 3)
 MAX_READ_TIMEOUT: float = 2.0
+READ_BACKOFF_START: float = 0.001
+READ_BACKOFF_MAX: float = 0.05
 MAX_EMPTY_READS: int = 10
 MAX_FAILED_WRITES: int = 10
 DATA_REGISTER: int = 0xC0DE10
@@ -17,13 +23,20 @@ RECV_STATUS_REGISTER: int = 0xC0DE30
 CONFIG_REGISTER: int = 0xC0DE40
 SCRATCH1_REGISTER: int = 0xC0DE50
 SCRATCH2_REGISTER: int = 0xC0DE60
+MAILBOX_REGISTER: int = 0xC0DE70
 
 SEND_STATUS_REGISTER_SEED: int = 3
 RECV_STATUS_REGISTER_SEED: int = 7
 CONFIG_REGISTER_SEED: int = 19
+MAILBOX_REGISTER_SEED: int = 23
 
 CONFIG_MESSAGE_EXISTS: int = 0x00000001
 CONFIG_MESSAGE_HAS_ZLIB: int = 0x00000002
+CONFIG_MESSAGE_HAS_MAILBOX: int = 0x00000004
+CONFIG_MESSAGE_HAS_STREAMS: int = 0x00000008
+
+MAILBOX_HEADER_LENGTH: int = 0x20
+MAX_MAILBOX_PACKET_LENGTH: int = 0x8000
 
 
 def checksum_valid(data: int, seed: int) -> bool:
@@ -56,22 +69,25 @@ def write_scratch2_register(netdimm: NetDimm, value: int) -> None:
         netdimm.poke(SCRATCH2_REGISTER, PeekPokeTypeEnum.TYPE_LONG, value)
 
 
-def read_send_status_register(netdimm: NetDimm) -> Optional[int]:
+def _read_checked_register(netdimm: NetDimm, register: int, seed: int) -> Optional[int]:
     with netdimm.connection():
-        valid = False
-        status: int = 0
         start = time.time()
+        delay = READ_BACKOFF_START
 
-        while not valid:
-            status = 0
-            while status == 0 or status == 0xFFFFFFFF and (time.time() - start <= MAX_READ_TIMEOUT):
-                status = netdimm.peek(SEND_STATUS_REGISTER, PeekPokeTypeEnum.TYPE_LONG)
-
-            valid = checksum_valid(status, SEND_STATUS_REGISTER_SEED)
-            if not valid and (time.time() - start > MAX_READ_TIMEOUT):
+        while True:
+            value = netdimm.peek(register, PeekPokeTypeEnum.TYPE_LONG)
+            if value not in {0, 0xFFFFFFFF} and checksum_valid(value, seed):
+                return value
+            if time.time() - start > MAX_READ_TIMEOUT:
                 return None
 
-        return status
+            # The target is busy or mid-update, so back off rather than hammering it.
+            time.sleep(delay)
+            delay = min(delay * 2, READ_BACKOFF_MAX)
+
+
+def read_send_status_register(netdimm: NetDimm) -> Optional[int]:
+    return _read_checked_register(netdimm, SEND_STATUS_REGISTER, SEND_STATUS_REGISTER_SEED)
 
 
 def write_send_status_register(netdimm: NetDimm, value: int) -> None:
@@ -80,44 +96,168 @@ def write_send_status_register(netdimm: NetDimm, value: int) -> None:
 
 
 def read_recv_status_register(netdimm: NetDimm) -> Optional[int]:
+    return _read_checked_register(netdimm, RECV_STATUS_REGISTER, RECV_STATUS_REGISTER_SEED)
+
+
+def write_recv_status_register(netdimm: NetDimm, value: int) -> None:
     with netdimm.connection():
-        valid = False
-        status: int = 0
-        start = time.time()
+        netdimm.poke(RECV_STATUS_REGISTER, PeekPokeTypeEnum.TYPE_LONG, checksum_stamp(value, RECV_STATUS_REGISTER_SEED))
 
-        while not valid:
-            status = 0
-            while status == 0 or status == 0xFFFFFFFF and (time.time() - start <= MAX_READ_TIMEOUT):
-                status = netdimm.peek(RECV_STATUS_REGISTER, PeekPokeTypeEnum.TYPE_LONG)
 
-            valid = checksum_valid(status, RECV_STATUS_REGISTER_SEED)
-            if not valid and (time.time() - start > MAX_READ_TIMEOUT):
-                return None
+def read_config_register(netdimm: NetDimm) -> Optional[int]:
+    return _read_checked_register(netdimm, CONFIG_REGISTER, CONFIG_REGISTER_SEED)
+
+
+def read_mailbox_register(netdimm: NetDimm) -> Optional[int]:
+    return _read_checked_register(netdimm, MAILBOX_REGISTER, MAILBOX_REGISTER_SEED)
+
+
+class Mailbox:
+    # A pair of ring buffers in net dimm memory that the target reserves for talking to
+    # us, read and written with the same block transfers that are used to send games
+    # instead of three bytes at a time through the data register. The header holds four
+    # free-running byte counters, each of which is only ever written by one side:
+    #
+    # 0x00 - How many bytes we have written to the ring headed to the target.
+    # 0x04 - How many of those bytes the target has consumed.
+    # 0x08 - How many bytes the target has written to the ring headed to us.
+    # 0x0C - How many of those bytes we have consumed.
+    #
+    # The ring headed to the target follows the header and the ring headed to us follows
+    # that one. Each packet in a ring is a 16-bit length followed by that much data, and
+    # both can wrap around from the end of the ring back to the start.
+    def __init__(self, address: int, size: int) -> None:
+        self.address = address
+        self.size = size
+
+    @staticmethod
+    def from_register(value: int) -> Optional["Mailbox"]:
+        # The bottom 12 bits are the address in 1MB units, the top 12 bits are the size
+        # of each ring in 4KB units.
+        size = ((value >> 12) & 0xFFF) << 12
+        if size == 0:
+            return None
+        return Mailbox((value & 0xFFF) << 20, size)
 
-        return status
+    def to_register(self) -> int:
+        return ((self.address >> 20) & 0xFFF) | (((self.size >> 12) & 0xFFF) << 12)
 
+    @property
+    def max_packet_length(self) -> int:
+        return min(self.size - 2, MAX_MAILBOX_PACKET_LENGTH)
 
-def write_recv_status_register(netdimm: NetDimm, value: int) -> None:
+    @property
+    def to_target(self) -> int:
+        return self.address + MAILBOX_HEADER_LENGTH
+
+    @property
+    def to_host(self) -> int:
+        return self.address + MAILBOX_HEADER_LENGTH + self.size
+
+
+def _ring_read(netdimm: NetDimm, ring: int, size: int, position: int, length: int) -> bytes:
+    offset = position % size
+    first = min(length, size - offset)
+    data = netdimm.receive_chunk(ring + offset, first)
+    if first < length:
+        data += netdimm.receive_chunk(ring, length - first)
+    return data
+
+
+def _ring_write(netdimm: NetDimm, ring: int, size: int, position: int, data: bytes) -> None:
+    offset = position % size
+    first = min(len(data), size - offset)
+    netdimm.send_chunk(ring + offset, data[:first])
+    if first < len(data):
+        netdimm.send_chunk(ring, data[first:])
+
+
+def receive_mailbox_packet(netdimm: NetDimm, mailbox: Mailbox) -> Optional[bytes]:
     with netdimm.connection():
-        netdimm.poke(RECV_STATUS_REGISTER, PeekPokeTypeEnum.TYPE_LONG, checksum_stamp(value, RECV_STATUS_REGISTER_SEED))
+        # First, see if there is anything in the ring headed to us.
+        head, tail = struct.unpack("<II", netdimm.receive_chunk(mailbox.address + 0x8, 8))
+        available = (head - tail) & 0xFFFFFFFF
+        if available < 2 or available > mailbox.size:
+            return None
 
+        # Grab the length and as much of the packet as could possibly be there in one go.
+        data = _ring_read(netdimm, mailbox.to_host, mailbox.size, tail, min(available, mailbox.max_packet_length + 2))
+        length = struct.unpack("<H", data[0:2])[0]
+        if length + 2 > available:
+            raise MessageException("Got corrupt packet from mailbox!")
+        if length + 2 > len(data):
+            data += _ring_read(netdimm, mailbox.to_host, mailbox.size, tail + len(data), length + 2 - len(data))
+
+        # Acknowledge that we consumed the packet, freeing up the space.
+        netdimm.send_chunk(mailbox.address + 0xC, struct.pack("<I", (tail + length + 2) & 0xFFFFFFFF))
+        return data[2:(length + 2)]
+
+
+def send_mailbox_packet(netdimm: NetDimm, mailbox: Mailbox, data: bytes) -> bool:
+    length = len(data)
+    if length > mailbox.max_packet_length:
+        raise Exception("Packet is too long to send!")
 
-def read_config_register(netdimm: NetDimm) -> Optional[int]:
     with netdimm.connection():
-        valid = False
-        config: int = 0
         start = time.time()
+        while True:
+            # Wait for there to be enough room in the ring headed to the target.
+            head, tail = struct.unpack("<II", netdimm.receive_chunk(mailbox.address, 8))
+            used = (head - tail) & 0xFFFFFFFF
+            if used <= mailbox.size and (mailbox.size - used) >= (length + 2):
+                break
+            if time.time() - start > MAX_READ_TIMEOUT:
+                return False
 
-        while not valid:
-            config = 0
-            while config == 0 or config == 0xFFFFFFFF and (time.time() - start <= MAX_READ_TIMEOUT):
-                config = netdimm.peek(CONFIG_REGISTER, PeekPokeTypeEnum.TYPE_LONG)
-
-            valid = checksum_valid(config, CONFIG_REGISTER_SEED)
-            if not valid and (time.time() - start > MAX_READ_TIMEOUT):
-                return None
+        # Write the packet first and then publish it, so the target never sees half of it.
+        _ring_write(netdimm, mailbox.to_target, mailbox.size, head, struct.pack("<H", length) + data)
+        netdimm.send_chunk(mailbox.address, struct.pack("<I", (head + length + 2) & 0xFFFFFFFF))
+        return True
+
+
+class PacketAssembler:
+    # Puts a packet back together out of the words read from the data register. Each word
+    # holds a one-based chunk index in its top byte and up to three bytes of data below
+    # that. Chunks are written straight into place in a bytearray and a second bytearray
+    # flags which ones have arrived, so adding a chunk and checking whether we're done are
+    # constant time. Chunks almost always arrive in order, so the first missing chunk only
+    # ever moves forward and finding where to resume from is amortized constant time too.
+    def __init__(self, length: int) -> None:
+        self.length = length
+        self.data = bytearray(length)
+        self.chunks = (length + 2) // 3
+        self.missing = self.chunks
+        self.__received = bytearray(self.chunks)
+        self.__first_missing = 0
+
+    @property
+    def complete(self) -> bool:
+        return self.missing == 0
+
+    def add(self, chunk: int) -> bool:
+        # Returns False if the word didn't hold any data, meaning the target had nothing
+        # ready for us.
+        marker = (chunk >> 24) & 0xFF
+        if marker == 0x00 or marker == 0xFF:
+            return False
 
-        return config
+        index = marker - 1
+        if index < self.chunks:
+            location = index * 3
+            amount = min(3, self.length - location)
+            self.data[location:(location + amount)] = (chunk & 0xFFFFFF).to_bytes(3, "big")[:amount]
+            if not self.__received[index]:
+                self.__received[index] = 1
+                self.missing -= 1
+        return True
+
+    @property
+    def resume_point(self) -> int:
+        # The byte offset of the first chunk that hasn't arrived yet, or the length of the
+        # packet if everything has.
+        while self.__first_missing < self.chunks and self.__received[self.__first_missing]:
+            self.__first_missing += 1
+        return min(self.__first_missing * 3, self.length)
 
 
 def receive_packet(netdimm: NetDimm) -> Optional[bytes]:
@@ -138,37 +278,28 @@ def receive_packet(netdimm: NetDimm) -> Optional[bytes]:
             write_send_status_register(netdimm, 0)
 
         # Now, grab and assemble the data itself.
-        data: List[Optional[int]] = [None] * length
+        assembler = PacketAssembler(length)
         tries: int = 0
-        while any(d is None for d in data):
-            chunk = netdimm.peek(DATA_REGISTER, PeekPokeTypeEnum.TYPE_LONG)
-            if ((chunk & 0xFF000000) >> 24) in {0x00, 0xFF}:
-                tries += 1
-                if tries > MAX_EMPTY_READS:
-                    # We need to figure out where we left off.
-                    for loc, val in enumerate(data):
-                        if val is None:
-                            # We found a spot to resume from.
-                            write_send_status_register(netdimm, loc & 0xFFF)
-                            tries = 0
-                            break
-                    else:
-                        # We should always find a spot to resume from or there's an issue,
-                        # since in this case we should be done.
-                        raise Exception("Logic error!")
-            else:
-                # Grab the location for this chunk, stick the data in the right spot.
-                location = (((chunk >> 24) & 0xFF) - 1) * 3
-
-                for off, shift in enumerate([16, 8, 0]):
-                    actual = off + location
-                    if actual < length:
-                        data[actual] = (chunk >> shift) & 0xFF
+        while not assembler.complete:
+            # Every read of the data register hands back the next chunk, so ask for all of
+            # the chunks we're still missing at once instead of a round trip for each.
+            for chunk in netdimm.peek_many([DATA_REGISTER] * assembler.missing, PeekPokeTypeEnum.TYPE_LONG):
+                if not assembler.add(chunk):
+                    tries += 1
+                    if tries > MAX_EMPTY_READS:
+                        # We need to figure out where we left off. We should always find a
+                        # spot to resume from or there's an issue, since otherwise we're done.
+                        resume = assembler.resume_point
+                        if resume >= length:
+                            raise Exception("Logic error!")
+                        write_send_status_register(netdimm, resume & 0xFFF)
+                        tries = 0
+
+                        # Anything else in this batch was read before we rewound.
+                        break
 
         # Grab the actual return data.
-        bytedata = bytes([d for d in data if d is not None])
-        if len(bytedata) != length:
-            raise Exception("Logic error!")
+        bytedata = bytes(assembler.data)
 
         # Acknowledge the data transfer completed.
         write_send_status_register(netdimm, length & 0xFFF)
@@ -216,6 +347,7 @@ def send_packet(netdimm: NetDimm, data: bytes) -> bool:
         # if it failed to receive all of the data.
         location = 0
         while True:
+            chunks: List[Tuple[int, int]] = []
             while location < length:
                 # Sum up the next amount of data, up to 3 bytes.
                 chunk: int = ((((location // 3) + 1) << 24) & 0xFF000000)
@@ -227,8 +359,10 @@ def send_packet(netdimm: NetDimm, data: bytes) -> bool:
                     else:
                         break
 
-                # Send it.
-                netdimm.poke(DATA_REGISTER, PeekPokeTypeEnum.TYPE_LONG, chunk)
+                chunks.append((DATA_REGISTER, chunk))
+
+            # Send it all back to back, since pokes don't wait for a response.
+            netdimm.poke_many(chunks, PeekPokeTypeEnum.TYPE_LONG)
 
             # Now, see if the data transfer was successful.
             status = read_recv_status_register(netdimm)
@@ -267,189 +401,758 @@ MAX_MESSAGE_TIMEOUT: float = 3.0
 MESSAGE_HOST_STDOUT: int = 0x7FFE
 MESSAGE_HOST_STDERR: int = 0x7FFF
 
+# Payloads shorter than this never shrink by enough to pay for the length prefix.
+COMPRESSION_MIN_LENGTH: int = 64
+# Payloads shorter than this don't give the best compression level anything to find.
+COMPRESSION_SMALL_LENGTH: int = 1024
+# How much of a payload to sample when guessing whether it will compress at all, and
+# how many bits of entropy per byte that sample can have before we assume it's already
+# compressed or encrypted and not worth trying.
+COMPRESSION_PROBE_LENGTH: int = 1024
+COMPRESSION_MAX_ENTROPY: float = 7.5
+# Link rates in bytes per second. Below the slow rate the link is the bottleneck so we
+# compress as hard as we can, above the fast rate CPU time costs more than bytes do.
+COMPRESSION_SLOW_LINK_RATE: float = 64 * 1024
+COMPRESSION_FAST_LINK_RATE: float = 1024 * 1024
+
+
+class MessageCodec:
+    """
+    A way of compressing message payloads, which is used when the Naomi program sets
+    the codec's capability bit in its config register. Codecs offer a fast, a default
+    and a best compression level, and the sender picks between them based on how fast
+    the link is. Compressed messages are flagged by the top bit of their message ID,
+    so a new codec also needs a way for the receiver to tell it apart from zlib.
+    """
+
+    def __init__(self, name: str, capability: int, levels: Tuple[int, int, int], compress: Callable[[bytes, int], bytes]) -> None:
+        self.name = name
+        self.capability = capability
+        self.fast, self.default, self.best = levels
+        self.compress = compress
+
+    def __repr__(self) -> str:
+        return f"MessageCodec(name={repr(self.name)}, capability={hex(self.capability)})"
+
+
+# Codecs in order of preference, the first one the program supports gets used.
+MESSAGE_CODECS: List[MessageCodec] = [
+    MessageCodec("zlib", CONFIG_MESSAGE_HAS_ZLIB, (1, 6, 9), lambda data, level: zlib.compress(data, level=level)),
+]
+
+
+class MessageSendStats:
+    def __init__(
+        self,
+        length: int,
+        sent_length: int,
+        codec: Optional[str],
+        level: Optional[int],
+        reason: str,
+        compress_time: float,
+        transfer_time: float,
+    ) -> None:
+        self.length = length
+        self.sent_length = sent_length
+        self.codec = codec
+        self.level = level
+        self.reason = reason
+        self.compress_time = compress_time
+        self.transfer_time = transfer_time
+
+    @property
+    def ratio(self) -> float:
+        return (self.sent_length / self.length) if self.length else 1.0
+
+    def __repr__(self) -> str:
+        return (
+            f"MessageSendStats(length={self.length}, sent_length={self.sent_length}, codec={repr(self.codec)}, "
+            f"level={self.level}, reason={repr(self.reason)}, compress_time={self.compress_time}, transfer_time={self.transfer_time})"
+        )
+
+
+def _entropy(data: bytes) -> float:
+    # Bits of entropy per byte of a sample, going by how often each byte value shows up.
+    if not data:
+        return 0.0
+    total = len(data)
+    return math.log2(total) - (sum(count * math.log2(count) for count in collections.Counter(data).values()) / total)
+
+
+def _looks_compressible(data: bytes) -> bool:
+    if len(data) <= COMPRESSION_PROBE_LENGTH:
+        sample = data
+    else:
+        # Look at the start and the middle, since payloads often begin with a header.
+        half = COMPRESSION_PROBE_LENGTH // 2
+        middle = len(data) // 2
+        sample = data[:half] + data[middle:(middle + half)]
+    return _entropy(sample) <= COMPRESSION_MAX_ENTROPY
+
+
+def choose_compression(data: bytes, config: int, link_rate: float, max_data_length: int) -> Tuple[Optional[MessageCodec], Optional[int], str]:
+    """
+    Given a payload, the program's config register, how fast the link is in bytes per
+    second and how much data fits in a packet, decide whether to compress the payload
+    and how hard. Returns the codec and level to use, or None for both when the payload
+    should be sent as-is, along with the reason for the choice.
+    """
+    codec = next((c for c in MESSAGE_CODECS if (config & c.capability) != 0), None)
+    if codec is None:
+        return None, None, "no codec"
+    if len(data) < COMPRESSION_MIN_LENGTH:
+        return None, None, "too small"
+    if link_rate >= COMPRESSION_FAST_LINK_RATE and len(data) <= max_data_length:
+        # It goes in a single packet either way, so there's nothing to win.
+        return None, None, "single packet"
+    if not _looks_compressible(data):
+        return None, None, "incompressible"
+
+    if link_rate < COMPRESSION_SLOW_LINK_RATE:
+        level = codec.default if len(data) < COMPRESSION_SMALL_LENGTH else codec.best
+        return codec, level, "slow link"
+    if link_rate < COMPRESSION_FAST_LINK_RATE:
+        return codec, codec.default, "medium link"
+    return codec, codec.fast, "fast link"
+
+
+# Streams carry payloads bigger than a single message can hold, as a series of ordinary
+# messages with these types. Data messages start with the application's message type,
+# the stream ID, the total length and the offset of the chunk, followed by the chunk.
+# Acknowledgements hold the stream ID and how much of the stream has been consumed, and
+# the sender never gets more than STREAM_WINDOW bytes ahead of the last one.
+MESSAGE_STREAM_DATA: int = 0x7FFC
+MESSAGE_STREAM_ACK: int = 0x7FFD
+STREAM_HEADER_LENGTH: int = 12
+STREAM_CHUNK_LENGTH: int = 0x8000
+STREAM_WINDOW: int = 4 * STREAM_CHUNK_LENGTH
+MAX_STREAM_LENGTH: int = 0xFFFFFFFF
+MAX_STREAM_TIMEOUT: float = 5.0
+
+
+class MessageStream:
+    """
+    A stream being received from a Naomi program, handed out by a channel as soon as its
+    first chunk shows up. Iterating over it yields the stream's data in order as it
+    arrives, and every chunk consumed is acknowledged so the program can send more. The
+    optional progress callback is called after every chunk with the number of bytes
+    consumed so far and the total length. Raises MessageException if the program stops
+    sending for longer than MAX_STREAM_TIMEOUT.
+    """
+
+    def __init__(
+        self,
+        msgid: int,
+        stream_id: int,
+        length: int,
+        pump: Callable[[], bool],
+        ack: Callable[[int, int], None],
+    ) -> None:
+        self.id = msgid
+        self.stream_id = stream_id
+        self.length = length
+        self.position: int = 0
+        self.progress: Optional[Callable[[int, int], None]] = None
+        self.__pump = pump
+        self.__ack = ack
+        self.__chunks: Dict[int, bytes] = {}
+
+    def __repr__(self) -> str:
+        return f"MessageStream(id={hex(self.id)}, stream_id={self.stream_id}, length={self.length}, position={self.position})"
+
+    def add(self, offset: int, chunk: bytes) -> None:
+        if offset >= self.position and chunk:
+            self.__chunks[offset] = chunk
+
+    def __iter__(self) -> Iterator[bytes]:
+        last = time.time()
+        while self.position < self.length:
+            chunk = self.__chunks.pop(self.position, None)
+            if chunk is None:
+                if self.__pump():
+                    last = time.time()
+                elif time.time() - last > MAX_STREAM_TIMEOUT:
+                    raise MessageException("Stream stalled!")
+                else:
+                    time.sleep(0.001)
+                continue
+
+            self.position += len(chunk)
+            self.__ack(self.stream_id, self.position)
+            if self.progress is not None:
+                self.progress(self.position, self.length)
+            yield chunk
+
+    def read(self) -> bytes:
+        return b"".join(self)
+
+
+class MessageChannel:
+    """
+    The message protocol spoken with a single Naomi program through a single net dimm.
+    Every channel owns its own send and receive sequence numbers, the chunks of messages
+    that are still being reassembled and what it learned about the program's protocol
+    capabilities, so one process can talk to as many cabinets as it likes at once by
+    making a channel for each. All methods are thread-safe, and since they drive the
+    net dimm's single connection, calls from different threads take turns.
+    """
+
+    # How long to trust what we read out of the config register before reading it again.
+    # This is refreshed early whenever a transfer fails, in case the program restarted.
+    CONFIG_CACHE_TIME: float = 5.0
+
+    # Link rates in bytes per second to assume for each transport before we've measured
+    # one, and the smallest send worth timing.
+    ASSUMED_REGISTER_RATE: float = 16 * 1024
+    ASSUMED_MAILBOX_RATE: float = 4 * 1024 * 1024
+    LINK_RATE_MIN_LENGTH: int = 256
+
+    def __init__(self, netdimm: NetDimm) -> None:
+        self.netdimm = netdimm
+        self.__lock: threading.RLock = threading.RLock()
+
+        self.__send_sequence: int = 1
+        self.__recv_sequence: int = -1
+        self.__pending_chunks: Dict[int, Dict[int, bytes]] = {}
+        self.__pending_sizes: Dict[int, int] = {}
+        self.__pending_msgids: Dict[int, int] = {}
+        self.__pending_timestamps: Dict[int, float] = {}
+
+        self.__config: Optional[int] = None
+        self.__config_time: float = 0.0
+        self.__mailbox: Optional[Mailbox] = None
+
+        # How fast sends have been going over each transport, keyed by whether the
+        # mailbox was used, which decides how hard we compress.
+        self.__link_rates: Dict[bool, float] = {}
+        self.last_send: Optional[MessageSendStats] = None
+
+        # Streams in both directions, and ordinary messages that showed up while we were
+        # waiting on a stream and haven't been asked for yet.
+        self.__stream_id: int = 1
+        self.__stream_acks: Dict[int, int] = {}
+        self.__incoming_streams: Dict[int, MessageStream] = {}
+        self.__new_streams: Deque[MessageStream] = collections.deque()
+        self.__inbox: Deque[Message] = collections.deque()
+
+    def __repr__(self) -> str:
+        return f"MessageChannel(netdimm={repr(self.netdimm)})"
+
+    def link_rate(self, mailbox: bool) -> float:
+        # Until we've timed a send, assume the mailbox is fast and the data register isn't.
+        with self.__lock:
+            return self.__link_rates.get(mailbox, self.ASSUMED_MAILBOX_RATE if mailbox else self.ASSUMED_REGISTER_RATE)
+
+    def __measure(self, mailbox: bool, length: int, elapsed: float) -> None:
+        if length < self.LINK_RATE_MIN_LENGTH or elapsed <= 0.0:
+            # Short sends are all latency and would make the link look slower than it is.
+            return
+        rate = length / elapsed
+        previous = self.__link_rates.get(mailbox)
+        self.__link_rates[mailbox] = rate if previous is None else (previous + rate) / 2
+
+    def invalidate(self) -> None:
+        # Forget what we know about the program's capabilities, so they get read again.
+        with self.__lock:
+            self.__config = None
+            self.__mailbox = None
+
+    def __capabilities(self) -> Optional[int]:
+        now = time.time()
+        if self.__config is None or (now - self.__config_time) > self.CONFIG_CACHE_TIME:
+            config = read_config_register(self.netdimm)
+            if config is None:
+                self.invalidate()
+                return None
+            self.__config = config
+            self.__config_time = now
+            self.__mailbox = _get_mailbox(self.netdimm, config) if (config & CONFIG_MESSAGE_EXISTS) != 0 else None
+        return self.__config
+
+    def send(self, message: Message, verbose: bool = False) -> None:
+        with self.__lock, self.netdimm.connection():
+            if self.__send_sequence == 0:
+                self.__send_sequence = 1
+
+            config = self.__capabilities()
+            if config is None:
+                raise MessageException("Cannot read packetlib config register!")
+            if (config & CONFIG_MESSAGE_EXISTS) == 0:
+                self.invalidate()
+                raise MessageException("Host is not running message protocol!")
+            mailbox = self.__mailbox
+            max_data_length = (mailbox.max_packet_length - MESSAGE_HEADER_LENGTH) if mailbox is not None else MAX_MESSAGE_DATA_LENGTH
+
+            def send(packetdata: bytes) -> bool:
+                if mailbox is not None:
+                    return send_mailbox_packet(self.netdimm, mailbox, packetdata)
+                return send_packet(self.netdimm, packetdata)
 
-send_sequence: int = 1
-
-
-def send_message(netdimm: NetDimm, message: Message, verbose: bool = False) -> None:
-    global send_sequence
-    if send_sequence == 0:
-        send_sequence = 1
-
-    config = read_config_register(netdimm)
-    if config is None:
-        raise MessageException("Cannot read packetlib config register!")
-    if (config & CONFIG_MESSAGE_EXISTS) == 0:
-        raise MessageException("Host is not running message protocol!")
-    zlib_enabled = (config & CONFIG_MESSAGE_HAS_ZLIB) != 0
-
-    if verbose:
-        print(f"Sending type: {hex(message.id)}, length: {len(message.data)}")
-
-    data = message.data
-    compressed = False
-    if data and zlib_enabled:
-        compresseddata = zlib.compress(data, level=9)
-        if (len(compresseddata) + 4) < len(data):
-            # Worth it to compress.
-            data = struct.pack("<I", len(data)) + compresseddata
-            compressed = True
             if verbose:
-                print(f"Compressed {len(message.data)} down to {len(data)}")
-
-    t = time.time()
-    total_length = len(data)
-    if total_length == 0:
-        packetdata = struct.pack("<HHHH", (message.id & 0x7FFF) | (0x8000 if compressed else 0), send_sequence & 0xFFFF, 0, 0)
-        if not send_packet(netdimm, packetdata):
-            send_sequence = (send_sequence + 1) & 0xFFFF
+                print(f"Sending type: {hex(message.id)}, length: {len(message.data)}")
+
+            data = message.data
+            compressed = False
+            codec, level, reason = choose_compression(data, config, self.link_rate(mailbox is not None), max_data_length)
+            t = time.time()
+            if codec is not None and level is not None:
+                compresseddata = codec.compress(data, level)
+                if (len(compresseddata) + 4) < len(data):
+                    # Worth it to compress.
+                    data = struct.pack("<I", len(data)) + compresseddata
+                    compressed = True
+                else:
+                    reason = "did not shrink"
+            compress_time = time.time() - t
+            stats = MessageSendStats(
+                len(message.data),
+                len(data),
+                codec.name if compressed and codec is not None else None,
+                level if compressed else None,
+                reason,
+                compress_time,
+                0.0,
+            )
             if verbose:
-                print(f"Packet transfer failed in {time.time() - t} seconds")
-            raise MessageException("Cannot send message!")
-    else:
+                if compressed:
+                    print(
+                        f"Compressed {stats.length} down to {stats.sent_length} (ratio {stats.ratio:.2f}) "
+                        f"with {stats.codec} level {stats.level} for {reason} in {compress_time} seconds"
+                    )
+                elif data:
+                    print(f"Not compressing, {reason}")
+
+            t = time.time()
+            total_length = len(data)
+            if total_length == 0:
+                packetdata = struct.pack("<HHHH", (message.id & 0x7FFF) | (0x8000 if compressed else 0), self.__send_sequence & 0xFFFF, 0, 0)
+                if not send(packetdata):
+                    self.__send_sequence = (self.__send_sequence + 1) & 0xFFFF
+                    self.invalidate()
+                    if verbose:
+                        print(f"Packet transfer failed in {time.time() - t} seconds")
+                    raise MessageException("Cannot send message!")
+            else:
+                location = 0
+                for chunk in [data[i:(i + max_data_length)] for i in range(0, total_length, max_data_length)]:
+                    packetdata = struct.pack(
+                        "<HHHH",
+                        (message.id & 0x7FFF) | (0x8000 if compressed else 0),
+                        self.__send_sequence & 0xFFFF,
+                        total_length & 0xFFFF,
+                        location & 0xFFFF,
+                    ) + chunk
+                    location += len(chunk)
+
+                    if not send(packetdata):
+                        self.__send_sequence = (self.__send_sequence + 1) & 0xFFFF
+                        self.invalidate()
+                        if verbose:
+                            print(f"Packet transfer failed in {time.time() - t} seconds")
+                        raise MessageException("Cannot send message!")
+
+            stats.transfer_time = time.time() - t
+            self.__measure(mailbox is not None, total_length, stats.transfer_time)
+            self.last_send = stats
+            if verbose:
+                print(f"Packet transfer took {stats.transfer_time} seconds")
+            self.__send_sequence = (self.__send_sequence + 1) & 0xFFFF
+
+    def __packet_finished(self, sequence: int) -> bool:
+        if sequence not in self.__pending_sizes:
+            return False
+        total_length = self.__pending_sizes[sequence]
+
+        # Walk the chunks in order, since how big they are depends on which transport the
+        # target sent them over.
+        chunks = self.__pending_chunks[sequence]
         location = 0
-        for chunk in [data[i:(i + MAX_MESSAGE_DATA_LENGTH)] for i in range(0, total_length, MAX_MESSAGE_DATA_LENGTH)]:
-            packetdata = struct.pack("<HHHH", (message.id & 0x7FFF) | (0x8000 if compressed else 0), send_sequence & 0xFFFF, total_length & 0xFFFF, location & 0xFFFF) + chunk
-            location += len(chunk)
+        while location < total_length:
+            if not chunks.get(location):
+                # We're missing this location.
+                return False
+            location += len(chunks[location])
+
+        # We have all the bits
+        return True
+
+    def __discard(self, sequence: int) -> None:
+        del self.__pending_chunks[sequence]
+        del self.__pending_msgids[sequence]
+        del self.__pending_sizes[sequence]
+        del self.__pending_timestamps[sequence]
+
+    def receive(self, verbose: bool = False) -> Optional[Message]:
+        with self.__lock, self.netdimm.connection():
+            if self.__inbox:
+                return self.__inbox.popleft()
+            while True:
+                message = self.__receive(verbose)
+                if message is None or not self.__route(message):
+                    return message
+
+    def __route(self, message: Message) -> bool:
+        # Take stream traffic out of the flow of ordinary messages, returning whether the
+        # message was one of ours.
+        if self.__config is None or (self.__config & CONFIG_MESSAGE_HAS_STREAMS) == 0:
+            return False
+        if message.id == MESSAGE_STREAM_ACK and len(message.data) >= 6:
+            stream_id, position = struct.unpack("<HI", message.data[0:6])
+            if stream_id in self.__stream_acks:
+                self.__stream_acks[stream_id] = max(self.__stream_acks[stream_id], position)
+            return True
+        if message.id == MESSAGE_STREAM_DATA and len(message.data) >= STREAM_HEADER_LENGTH:
+            msgid, stream_id, length, offset = struct.unpack("<HHII", message.data[0:STREAM_HEADER_LENGTH])
+            stream = self.__incoming_streams.get(stream_id)
+            if stream is None or stream.length != length or stream.id != msgid:
+                stream = MessageStream(msgid, stream_id, length, self.__pump, self.__ack)
+                self.__incoming_streams[stream_id] = stream
+                self.__new_streams.append(stream)
+            stream.add(offset, message.data[STREAM_HEADER_LENGTH:])
+            return True
+        return False
 
-            if not send_packet(netdimm, packetdata):
-                send_sequence = (send_sequence + 1) & 0xFFFF
-                if verbose:
-                    print(f"Packet transfer failed in {time.time() - t} seconds")
-                raise MessageException("Cannot send message!")
+    def __pump(self) -> bool:
+        # Receive one message on behalf of a stream, keeping anything else for later.
+        with self.__lock, self.netdimm.connection():
+            message = self.__receive(False)
+            if message is None:
+                return False
+            if not self.__route(message):
+                self.__inbox.append(message)
+            return True
+
+    def __ack(self, stream_id: int, position: int) -> None:
+        with self.__lock:
+            stream = self.__incoming_streams.get(stream_id)
+            if stream is not None and position >= stream.length:
+                del self.__incoming_streams[stream_id]
+            self.send(Message(MESSAGE_STREAM_ACK, struct.pack("<HI", stream_id, position)))
+
+    def __check_streams(self) -> None:
+        config = self.__capabilities()
+        if config is None:
+            raise MessageException("Cannot read packetlib config register!")
+        if (config & CONFIG_MESSAGE_HAS_STREAMS) == 0:
+            raise MessageException("Host does not support message streams!")
+
+    def send_stream(
+        self,
+        msgid: int,
+        data: Union[bytes, Iterable[bytes]],
+        length: Optional[int] = None,
+        progress: Optional[Callable[[int, int], None]] = None,
+        verbose: bool = False,
+    ) -> None:
+        """
+        Send a payload of up to 4GB as a stream. The data can either be bytes or, if the
+        length is given, any iterable of bytes such as a generator reading a file. Only
+        STREAM_WINDOW bytes are ever sent ahead of what the program has acknowledged, and
+        the optional progress callback is called with the number of bytes acknowledged so
+        far and the total length every time that moves forward.
+        """
+        if isinstance(data, (bytes, bytearray, memoryview)):
+            length = len(data) if length is None else length
+            pieces: Iterable[bytes] = [bytes(data)]
+        elif length is None:
+            raise MessageException("Stream length must be given when sending an iterable!")
+        else:
+            pieces = data
+        if length > MAX_STREAM_LENGTH:
+            raise MessageException("Stream is too long!")
+
+        with self.__lock, self.netdimm.connection():
+            self.__check_streams()
+            stream_id = self.__stream_id
+            self.__stream_id = (self.__stream_id + 1) & 0xFFFF or 1
+            self.__stream_acks[stream_id] = 0
+            if verbose:
+                print(f"Streaming type: {hex(msgid)}, length: {length}")
+
+            def chunks() -> Iterator[bytes]:
+                # Cut whatever we were given into chunks that fit in a single message.
+                buffered = b""
+                for piece in pieces:
+                    buffered += piece
+                    while len(buffered) >= STREAM_CHUNK_LENGTH:
+                        yield buffered[:STREAM_CHUNK_LENGTH]
+                        buffered = buffered[STREAM_CHUNK_LENGTH:]
+                if buffered:
+                    yield buffered
+
+            try:
+                offset = 0
+                acked = 0
+                last = time.time()
+                source = chunks()
+                while True:
+                    while offset - acked < STREAM_WINDOW and (offset < length or offset == 0 == length):
+                        chunk = next(source, b"")
+                        if offset + len(chunk) > length or (not chunk and offset < length):
+                            raise MessageException("Stream data does not match its length!")
+                        self.send(Message(MESSAGE_STREAM_DATA, struct.pack("<HHII", msgid & 0x7FFF, stream_id, length, offset) + chunk))
+                        offset += len(chunk)
+                        if length == 0:
+                            break
+                    if acked >= length:
+                        break
 
-    if verbose:
-        print(f"Packet transfer took {time.time() - t} seconds")
-    send_sequence = (send_sequence + 1) & 0xFFFF
+                    if not self.__pump():
+                        if time.time() - last > MAX_STREAM_TIMEOUT:
+                            raise MessageException("Stream stalled!")
+                        time.sleep(0.001)
+                    if self.__stream_acks[stream_id] > acked:
+                        acked = self.__stream_acks[stream_id]
+                        last = time.time()
+                        if progress is not None:
+                            progress(acked, length)
+                        if verbose:
+                            print(f"Stream acknowledged {acked} of {length}")
+            finally:
+                del self.__stream_acks[stream_id]
+
+    def receive_stream(self) -> Optional[MessageStream]:
+        """
+        Return the next stream that the program has started sending, or None if there
+        isn't one yet. Ordinary messages that arrive while looking are kept for receive().
+        """
+        with self.__lock, self.netdimm.connection():
+            self.__check_streams()
+            while not self.__new_streams:
+                if not self.__pump():
+                    return None
+            return self.__new_streams.popleft()
+
+    def __receive(self, verbose: bool) -> Optional[Message]:
+        with self.__lock, self.netdimm.connection():
+            config = self.__capabilities()
+            if config is None:
+                return None
+            if (config & CONFIG_MESSAGE_EXISTS) == 0:
+                self.invalidate()
+                raise MessageException("Host is not running message protocol!")
+            zlib_enabled = (config & CONFIG_MESSAGE_HAS_ZLIB) != 0
+            mailbox = self.__mailbox
+
+            # First, see if all packets are available for the current receive sequence.
+            while True:
+                if self.__packet_finished(self.__recv_sequence):
+                    # We have a finished packet that we can receive!
+                    sequence = self.__recv_sequence
+                    msgid = self.__pending_msgids[sequence]
+                    total_length = self.__pending_sizes[sequence]
+                    break
+                elif self.__recv_sequence > 1 and self.__packet_finished(1):
+                    # We wrapped our sequence number around, or the target restarted
+                    # and we want to resync with it here.
+                    self.__recv_sequence = 1
+                    sequence = self.__recv_sequence
+                    msgid = self.__pending_msgids[sequence]
+                    total_length = self.__pending_sizes[sequence]
+                    break
+                elif self.__recv_sequence in self.__pending_timestamps and time.time() - self.__pending_timestamps[self.__recv_sequence] > MAX_MESSAGE_TIMEOUT:
+                    # Act like we just connected, force a resync.
+                    self.__recv_sequence = -1
+
+                # Try to receive a new packet.
+                new_packet = receive_mailbox_packet(self.netdimm, mailbox) if mailbox is not None else receive_packet(self.netdimm)
+                if new_packet is None:
+                    # First, if we don't know the received packet, we should grab the
+                    # lowest sequence we've received instead of exiting.
+                    if self.__recv_sequence < 0:
+                        if self.__pending_chunks:
+                            potential_sequence = min(self.__pending_chunks.keys())
+                            next_potential_sequence = (potential_sequence + 1) & 0xFFFF
+                            if next_potential_sequence == 0:
+                                next_potential_sequence = 1
+
+                            # The potential sequence could have been cut off, so if it is
+                            # not entirely ready, discard it as we have no way in our
+                            # protocol to signal that we need it fully retransmitted.
+                            if (
+                                potential_sequence in self.__pending_chunks and  # noqa: W504
+                                not self.__packet_finished(potential_sequence) and  # noqa: W504
+                                self.__packet_finished(next_potential_sequence)
+                            ):
+                                self.__discard(potential_sequence)
+
+                                # We know the next packet is ready, so just start there.
+                                self.__recv_sequence = next_potential_sequence
+                                continue
+                            elif self.__packet_finished(potential_sequence):
+                                # This packet is actually ready, pop around the loop and
+                                # reassemble it and then receive packets from there onward.
+                                self.__recv_sequence = potential_sequence
+                                continue
+
+                    # No packets available, return that there isn't anything.
+                    return None
+
+                # Make sure it isn't a dud packet.
+                if len(new_packet) < MESSAGE_HEADER_LENGTH:
+                    self.invalidate()
+                    raise MessageException("Got dud packet from target!")
+
+                # See if this packet can be reassembled.
+                msgid, sequence, total_length, location = struct.unpack("<HHHH", new_packet[0:8])
+
+                if sequence not in self.__pending_chunks:
+                    self.__pending_chunks[sequence] = {}
+                    self.__pending_msgids[sequence] = msgid
+                    self.__pending_sizes[sequence] = total_length
+                    self.__pending_timestamps[sequence] = time.time()
+
+                if location not in self.__pending_chunks[sequence]:
+                    self.__pending_chunks[sequence][location] = new_packet[8:]
+                    self.__pending_timestamps[sequence] = time.time()
+
+            # We have it all!
+            pieces: List[bytes] = []
+            location = 0
+            while location < total_length:
+                pieces.append(self.__pending_chunks[sequence][location])
+                location += len(pieces[-1])
+            msgdata = b"".join(pieces)
+            self.__discard(sequence)
+
+            # Make sure we receive the next packet in order. We intentionally don't
+            # wrap around the sequence here because we want to handle both the case
+            # where the sequence number naturally wraps around as well as the case
+            # of the host system rebooting and restarting its sequence in the same
+            # code section above.
+            self.__recv_sequence += 1
+
+            if zlib_enabled and (msgid & 0x8000 != 0):
+                # It was compressed.
+                if len(msgdata) >= 4:
+                    uncompressed_length = struct.unpack("<I", msgdata[0:4])[0]
+                    uncompressed_data = zlib.decompress(msgdata[4:])
+                    if len(uncompressed_data) != uncompressed_length:
+                        raise MessageException("Decompress error!")
+                    msgdata = uncompressed_data
+                    msgid = msgid & 0x7FFF
+                else:
+                    raise MessageException("Decompress error!")
 
+            if verbose:
+                print(f"Received type: {hex(msgid)}, length: {len(msgdata)}")
+            return Message(msgid, msgdata)
+
+
+class MessagePoller:
+    """
+    Decides when to next look for messages on a channel, for event loops that would
+    otherwise call receive() as fast as they can. Every poll that comes back empty
+    doubles the wait before the next one, up to max_interval, and every message that
+    shows up drops the wait back to min_interval so that conversations stay snappy.
+    Counts of polls and how much CPU time went into the ones that found nothing are
+    kept so the load that an idle cabinet puts on the host can be seen.
+    """
+
+    MIN_INTERVAL: float = 0.0
+    START_INTERVAL: float = 0.005
+    MAX_INTERVAL: float = 0.25
+
+    def __init__(self, channel: MessageChannel, min_interval: Optional[float] = None, max_interval: Optional[float] = None) -> None:
+        self.channel = channel
+        self.min_interval: float = self.MIN_INTERVAL if min_interval is None else min_interval
+        self.max_interval: float = self.MAX_INTERVAL if max_interval is None else max_interval
+        self.interval: float = self.min_interval
+        self.__due: float = 0.0
+
+        self.polls: int = 0
+        self.messages: int = 0
+        self.idle_time: float = 0.0
+        self.idle_cpu: float = 0.0
+
+    def __repr__(self) -> str:
+        return f"MessagePoller(channel={repr(self.channel)}, min_interval={self.min_interval}, max_interval={self.max_interval})"
+
+    def wake(self) -> None:
+        # Something is about to happen, such as us sending a request, so look right away.
+        self.interval = self.min_interval
+        self.__due = 0.0
+
+    def poll(self, verbose: bool = False) -> Optional[Message]:
+        """
+        Wait until the next poll is due, then receive a message from the channel. Returns
+        the message, or None if there wasn't one.
+        """
+        start = time.time()
+        wait = self.__due - start
+        if wait > 0:
+            time.sleep(wait)
+
+        cpu = time.process_time()
+        msg = self.channel.receive(verbose=verbose)
+        self.polls += 1
+        if msg is not None:
+            self.messages += 1
+            self.interval = self.min_interval
+        else:
+            # Both the wait and the poll itself count as idle when nothing showed up.
+            self.idle_cpu += time.process_time() - cpu
+            self.idle_time += time.time() - start
+            self.interval = min(max(self.interval * 2, self.START_INTERVAL), self.max_interval)
+        self.__due = time.time() + self.interval
+        return msg
+
+    @property
+    def stats(self) -> Dict[str, float]:
+        return {
+            "polls": self.polls,
+            "messages": self.messages,
+            "empty_polls": self.polls - self.messages,
+            "interval": self.interval,
+            "idle_time": self.idle_time,
+            "idle_cpu": self.idle_cpu,
+            "idle_cpu_percent": (self.idle_cpu * 100.0 / self.idle_time) if self.idle_time > 0 else 0.0,
+        }
+
+
+def _get_mailbox(netdimm: NetDimm, config: int) -> Optional[Mailbox]:
+    # Use the mailbox if the target has one, falling back to the data register if not.
+    if (config & CONFIG_MESSAGE_HAS_MAILBOX) == 0:
+        return None
+    register = read_mailbox_register(netdimm)
+    if register is None:
+        return None
+    return Mailbox.from_register(register)
 
-pending_received_chunks: Dict[int, Dict[int, bytes]] = {}
-pending_received_sizes: Dict[int, int] = {}
-pending_received_msgids: Dict[int, int] = {}
-pending_received_timestamp: Dict[int, float] = {}
-recv_sequence: int = -1
 
+# Channels for code that calls the functions below instead of making its own, one for
+# each net dimm so that separate cabinets never share sequence numbers.
+_channels: "weakref.WeakKeyDictionary[NetDimm, MessageChannel]" = weakref.WeakKeyDictionary()
+_channels_lock: threading.Lock = threading.Lock()
 
-def _packet_finished(sequence: int) -> bool:
-    if sequence not in pending_received_sizes:
-        return False
-    total_length = pending_received_sizes[sequence]
 
-    for needed_location in range(0, total_length, MAX_MESSAGE_DATA_LENGTH):
-        if needed_location not in pending_received_chunks[sequence]:
-            # We're missing this location.
-            return False
+def _channel(netdimm: NetDimm) -> MessageChannel:
+    with _channels_lock:
+        channel = _channels.get(netdimm)
+        if channel is None:
+            channel = MessageChannel(netdimm)
+            _channels[netdimm] = channel
+        return channel
 
-    # We have all the bits
-    return True
+
+def send_message(netdimm: NetDimm, message: Message, verbose: bool = False) -> None:
+    _channel(netdimm).send(message, verbose=verbose)
 
 
 def receive_message(netdimm: NetDimm, verbose: bool = False) -> Optional[Message]:
-    global recv_sequence
+    return _channel(netdimm).receive(verbose=verbose)
 
-    config = read_config_register(netdimm)
-    if config is None:
-        return None
-    if (config & CONFIG_MESSAGE_EXISTS) == 0:
-        raise MessageException("Host is not running message protocol!")
-    zlib_enabled = (config & CONFIG_MESSAGE_HAS_ZLIB) != 0
-
-    # First, see if all packets are available for the current receive sequence.
-    while True:
-        if _packet_finished(recv_sequence):
-            # We have a finished packet that we can receive!
-            sequence = recv_sequence
-            msgid = pending_received_msgids[sequence]
-            total_length = pending_received_sizes[sequence]
-            break
-        elif recv_sequence > 1 and _packet_finished(1):
-            # We wrapped our sequence number around, or the target restarted
-            # and we want to resync with it here.
-            recv_sequence = 1
-            sequence = recv_sequence
-            msgid = pending_received_msgids[sequence]
-            total_length = pending_received_sizes[sequence]
-            break
-        elif recv_sequence in pending_received_timestamp and time.time() - pending_received_timestamp[recv_sequence] > MAX_MESSAGE_TIMEOUT:
-            # Act like we just connected, force a resync.
-            recv_sequence = -1
-
-        # Try to receive a new packet.
-        new_packet = receive_packet(netdimm)
-        if new_packet is None:
-            # First, if we don't know the received packet, we should grab the
-            # lowest sequence we've received instead of exiting.
-            if recv_sequence < 0:
-                if pending_received_chunks:
-                    potential_sequence = min(pending_received_chunks.keys())
-                    next_potential_sequence = (potential_sequence + 1) & 0xFFFF
-                    if next_potential_sequence == 0:
-                        next_potential_sequence = 1
-
-                    # The potential sequence could have been cut off, so if it is
-                    # not entirely ready, discard it as we have no way in our
-                    # protocol to signal that we need it fully retransmitted.
-                    if potential_sequence in pending_received_chunks and not _packet_finished(potential_sequence) and _packet_finished(next_potential_sequence):
-                        del pending_received_chunks[potential_sequence]
-                        del pending_received_msgids[potential_sequence]
-                        del pending_received_sizes[potential_sequence]
-                        del pending_received_timestamp[potential_sequence]
-
-                        # We know the next packet is ready, so just start there.
-                        recv_sequence = next_potential_sequence
-                        continue
-                    elif _packet_finished(potential_sequence):
-                        # This packet is actually ready, pop around the loop and
-                        # reassemble it and then receive packets from there onward.
-                        recv_sequence = potential_sequence
-                        continue
-
-            # No packets available, return that there isn't anything.
-            return None
 
-        # Make sure it isn't a dud packet.
-        if len(new_packet) < MESSAGE_HEADER_LENGTH:
-            raise MessageException("Got dud packet from target!")
-
-        # See if this packet can be reassembled.
-        msgid, sequence, total_length, location = struct.unpack("<HHHH", new_packet[0:8])
-
-        if sequence not in pending_received_chunks:
-            pending_received_chunks[sequence] = {}
-            pending_received_msgids[sequence] = msgid
-            pending_received_sizes[sequence] = total_length
-            pending_received_timestamp[sequence] = time.time()
-
-        if location not in pending_received_chunks[sequence]:
-            pending_received_chunks[sequence][location] = new_packet[8:]
-            pending_received_timestamp[sequence] = time.time()
-
-    # We have it all!
-    msgdata = b"".join(pending_received_chunks[sequence][position] for position in range(0, total_length, MAX_MESSAGE_DATA_LENGTH))
-    del pending_received_chunks[sequence]
-    del pending_received_msgids[sequence]
-    del pending_received_sizes[sequence]
-    del pending_received_timestamp[sequence]
-
-    # Make sure we receive the next packet in order. We intentionally don't
-    # wrap around the sequence here because we want to handle both the case
-    # where the sequence number naturally wraps around as well as the case
-    # of the host system rebooting and restarting its sequence in the same
-    # code section above.
-    recv_sequence += 1
-
-    if zlib_enabled and (msgid & 0x8000 != 0):
-        # It was compressed.
-        if len(msgdata) >= 4:
-            uncompressed_length = struct.unpack("<I", msgdata[0:4])[0]
-            uncompressed_data = zlib.decompress(msgdata[4:])
-            if len(uncompressed_data) != uncompressed_length:
-                raise MessageException("Decompress error!")
-            msgdata = uncompressed_data
-            msgid = msgid & 0x7FFF
-        else:
-            raise MessageException("Decompress error!")
+def send_stream(
+    netdimm: NetDimm,
+    msgid: int,
+    data: Union[bytes, Iterable[bytes]],
+    length: Optional[int] = None,
+    progress: Optional[Callable[[int, int], None]] = None,
+    verbose: bool = False,
+) -> None:
+    _channel(netdimm).send_stream(msgid, data, length=length, progress=progress, verbose=verbose)
+
 
-    if verbose:
-        print(f"Received type: {hex(msgid)}, length: {len(msgdata)}")
-    return Message(msgid, msgdata)
+def receive_stream(netdimm: NetDimm) -> Optional[MessageStream]:
+    return _channel(netdimm).receive_stream()
@@ -1,18 +1,23 @@
 #!/usr/bin/env python3
 # Triforce Netfirm Toolbox, put into the public domain.
 # Please attribute properly, but only if you want.
+import hashlib
 import os
+import queue
+import random
 import sys
 import socket
 import struct
+import threading
 import time
 import zlib
 from Crypto.Cipher import DES
 from contextlib import contextmanager
 from enum import Enum
-from typing import Any, Callable, Dict, Generator, List, Optional, Union, cast
+from typing import Any, Callable, Dict, Generator, List, Optional, Sequence, Tuple, Union, cast
 
 from arcadeutils import FileBytes
+from netdimm.overlay import OverlayImage
 
 
 class NetDimmException(Exception):
@@ -78,8 +83,96 @@ class NetDimmInfo:
         self.control_address = control_address
 
 
+class NetDimmTransferStats:
+    def __init__(self) -> None:
+        # Total payload bytes and upload packets that made it onto the wire.
+        self.bytes_sent: int = 0
+        self.packets_sent: int = 0
+        # Wall clock time for the entire transfer.
+        self.elapsed: float = 0.0
+        # Time spent slicing, patching, encrypting and CRCing chunks.
+        self.prepare_time: float = 0.0
+        # Time spent handing chunks to the socket.
+        self.send_time: float = 0.0
+        # Time the socket sat idle waiting for the next chunk to be prepared.
+        self.stall_time: float = 0.0
+        # Payload bytes and blocks that the net dimm already had, so weren't sent.
+        self.bytes_skipped: int = 0
+        self.blocks_skipped: int = 0
+
+    @property
+    def throughput(self) -> float:
+        # Bytes per second over the whole transfer.
+        if self.elapsed <= 0.0:
+            return 0.0
+        return self.bytes_sent / self.elapsed
+
+    @property
+    def overlap(self) -> float:
+        # Fraction of the chunk preparation time that was hidden behind sending
+        # a previous chunk. 1.0 means the socket never waited on the CPU work.
+        if self.prepare_time <= 0.0:
+            return 1.0
+        hidden = (self.prepare_time + self.send_time) - self.elapsed
+        return min(max(hidden / self.prepare_time, 0.0), 1.0)
+
+    def __repr__(self) -> str:
+        return (
+            f"NetDimmTransferStats(bytes_sent={self.bytes_sent}, packets_sent={self.packets_sent}, "
+            f"elapsed={self.elapsed:.3f}, prepare_time={self.prepare_time:.3f}, send_time={self.send_time:.3f}, "
+            f"stall_time={self.stall_time:.3f}, bytes_skipped={self.bytes_skipped}, blocks_skipped={self.blocks_skipped}, "
+            f"throughput={self.throughput:.0f}, overlap={self.overlap:.2f})"
+        )
+
+
+class NetDimmManifest:
+    # Size of each block that gets hashed, which matches the size of an upload packet.
+    BLOCK_SIZE: int = 0x8000
+
+    def __init__(self, crc: int, length: int, blocks: Sequence[bytes], complete: bool = True) -> None:
+        # A record of what an image sent to a net dimm looked like, namely the CRC and
+        # length that the net dimm will report for it and a hash of every block. Handing
+        # this back to a later send lets it skip blocks that the net dimm already has.
+        # An incomplete manifest describes an upload that was interrupted, in which case
+        # the length and blocks cover only what made it out before the failure.
+        self.crc = crc
+        self.length = length
+        self.blocks = list(blocks)
+        self.complete = complete
+
+    def __repr__(self) -> str:
+        return f"NetDimmManifest(crc={hex(self.crc)}, length={self.length}, blocks={len(self.blocks)}, complete={self.complete})"
+
+    @staticmethod
+    def hash(pieces: Sequence[Union[bytes, memoryview]]) -> bytes:
+        digest = hashlib.blake2b(digest_size=16)
+        for piece in pieces:
+            digest.update(piece)
+        return digest.digest()
+
+    def to_json(self) -> Dict[str, Any]:
+        return {
+            "crc": self.crc,
+            "length": self.length,
+            "block_size": self.BLOCK_SIZE,
+            "blocks": [block.hex() for block in self.blocks],
+            "complete": self.complete,
+        }
+
+    @staticmethod
+    def from_json(data: Dict[str, Any]) -> "NetDimmManifest":
+        if data.get("block_size") != NetDimmManifest.BLOCK_SIZE:
+            raise NetDimmException("Manifest was made with a different block size!")
+        return NetDimmManifest(
+            int(data["crc"]),
+            int(data["length"]),
+            [bytes.fromhex(block) for block in data["blocks"]],
+            complete=bool(data.get("complete", True)),
+        )
+
+
 class NetDimmPacket:
-    def __init__(self, pktid: int, flags: int, data: bytes = b'') -> None:
+    def __init__(self, pktid: int, flags: int, data: Union[bytes, memoryview] = b'') -> None:
         self.pktid = pktid
         self.flags = flags
         self.data = data
@@ -89,6 +182,38 @@ class NetDimmPacket:
         return len(self.data)
 
 
+def _pieces(data: Union[bytes, memoryview, FileBytes], start: int, end: int) -> List[Union[bytes, memoryview]]:
+    # Slice out part of some data as a list of pieces to be sent back to back. For
+    # overlay images these point straight into the mapped file instead of copying.
+    if isinstance(data, OverlayImage):
+        return data.views(start, end)
+    return [data[start:end]]
+
+
+def _prepare_blocks(
+    data: Union[bytes, memoryview, FileBytes],
+    key: Optional[bytes],
+    addr: int = 0,
+    crc: int = 0,
+) -> Generator[Tuple[int, List[Union[bytes, memoryview]], int, bytes], None, None]:
+    # Read, encrypt and CRC an image one upload packet at a time, starting at addr with
+    # the running CRC of everything before it. Each block comes out as the address, the
+    # block as a list of pieces to send back to back, the running CRC including that
+    # block and a hash of the unencrypted block.
+    des = DES.new(key[::-1], DES.MODE_ECB) if key else None
+    total = len(data)
+    while addr < total:
+        current = _pieces(data, addr, addr + NetDimmManifest.BLOCK_SIZE)
+        digest = NetDimmManifest.hash(current)
+        if des is not None:
+            current = [des.encrypt(b"".join(current)[::-1])[::-1]]
+        for piece in current:
+            crc = zlib.crc32(piece, crc)
+
+        yield (addr, current, crc, digest)
+        addr += sum(len(piece) for piece in current)
+
+
 class NetDimm:
     DEFAULT_TIMEOUTS: Dict[NetDimmTargetEnum, int] = {
         NetDimmTargetEnum.TARGET_UNKNOWN: 15,
@@ -97,11 +222,30 @@ class NetDimm:
         NetDimmTargetEnum.TARGET_TRIFORCE: 40,
     }
 
+    # How many prepared chunks can be waiting to go out on the wire while
+    # sending a file. Each chunk is at most 0x8000 bytes.
+    UPLOAD_PIPELINE_DEPTH: int = 4
+
+    # When resuming an interrupted upload, how many blocks at the end of what we sent
+    # get read back to make sure they landed, and how many blocks before that get
+    # spot-checked to make sure the net dimm wasn't power cycled or written to since.
+    RESUME_VERIFY_TAIL: int = 4
+    RESUME_VERIFY_SAMPLES: int = 4
+
+    # How many peek requests can be in flight at once when peeking in bulk. Every
+    # request and response is 12 bytes, so this stays well inside the socket buffers
+    # on both ends while still hiding the round trip for all but the first request.
+    PEEK_PIPELINE_DEPTH: int = 64
+
     @staticmethod
-    def crc(data: Union[bytes, FileBytes]) -> int:
+    def crc(data: Union[bytes, memoryview, FileBytes]) -> int:
         crc: int = 0
-        if isinstance(data, bytes):
+        if isinstance(data, (bytes, memoryview)):
             crc = zlib.crc32(data, crc)
+        elif isinstance(data, OverlayImage):
+            # Run straight over the mapped file and patches without joining them.
+            for piece in data.views():
+                crc = zlib.crc32(piece, crc)
         elif isinstance(data, FileBytes):
             # Do this in chunks so we don't accidentally load the whole file.
             for offset in range(0, len(data), 0x8000):
@@ -117,8 +261,10 @@ class NetDimm:
         target: Optional[NetDimmTargetEnum] = None,
         log: Optional[Callable[..., Any]] = None,
         timeout: Optional[int] = None,
+        port: int = 10703,
     ) -> None:
         self.ip: str = ip
+        self.port: int = port
         self.sock: Optional[socket.socket] = None
         self.log: Optional[Callable[..., Any]] = log
         self.version: NetDimmVersionEnum = version or NetDimmVersionEnum.VERSION_UNKNOWN
@@ -136,8 +282,17 @@ class NetDimm:
                 timeout = default_timeout
         self.timeout: int = timeout
 
+        # Statistics about the most recent file upload, if any.
+        self.last_transfer: Optional[NetDimmTransferStats] = None
+
+        # What the most recently uploaded file looked like, for sending deltas later.
+        self.last_manifest: Optional[NetDimmManifest] = None
+
+        # How many times we've connected to the net dimm.
+        self.connects: int = 0
+
     def __repr__(self) -> str:
-        return f"NetDimm(ip={repr(self.ip)}, version={repr(self.version)}, target={repr(self.target)}, timeout={repr(self.timeout)})"
+        return f"NetDimm(ip={repr(self.ip)}, port={repr(self.port)}, version={repr(self.version)}, target={repr(self.target)}, timeout={repr(self.timeout)})"
 
     def info(self) -> NetDimmInfo:
         with self.connection():
@@ -150,17 +305,40 @@ class NetDimm:
 
     def send(
         self,
-        data: Union[bytes, FileBytes],
+        data: Union[bytes, memoryview, FileBytes],
         key: Optional[bytes] = None,
         disable_crc_check: bool = False,
         disable_now_loading: bool = False,
         progress_callback: Optional[Callable[[int, int], None]] = None,
+        previous: Optional[NetDimmManifest] = None,
+        source: Optional["NetDimmBroadcastReader"] = None,
     ) -> None:
         with self.connection():
             # First, signal back to calling code that we've started
             if progress_callback:
                 progress_callback(0, len(data))
 
+            if previous is not None:
+                # We can only skip blocks if the net dimm verified that it is holding
+                # exactly the image we were told about. Encrypted images are stored
+                # encrypted, so those are always sent in full.
+                info = self.__get_information()
+                if key:
+                    previous = None
+                elif previous.complete:
+                    if (
+                        info.game_crc_status != CRCStatusEnum.STATUS_VALID or
+                        info.current_game_crc != previous.crc or
+                        info.current_game_size != previous.length
+                    ):
+                        previous = None
+                elif info.current_game_crc != 0 or info.current_game_size != 0:
+                    # An interrupted upload leaves the game information wiped, so if
+                    # anything was stamped since then the memory was sent over again.
+                    previous = None
+                else:
+                    previous = self.__verify_resume(previous)
+
             if not disable_now_loading:
                 # Reboot and display "now loading..." on the cabinet screen
                 self.__set_host_mode(1)
@@ -184,42 +362,81 @@ class NetDimm:
                 self.__enable_crc_check()
 
             # uploads file. Also sets "dimm information" (file length and crc32)
-            self.__upload_file(data, key, progress_callback or (lambda _cur, _tot: None))
+            self.__upload_file(data, key, progress_callback or (lambda _cur, _tot: None), previous, source)
 
-    def receive(self, progress_callback: Optional[Callable[[int, int], None]] = None) -> Optional[bytes]:
+    def receive(self, progress_callback: Optional[Callable[[int, int], None]] = None) -> Optional[bytearray]:
         with self.connection():
             info = self.__get_information()
 
             if info.game_crc_status in {CRCStatusEnum.STATUS_VALID, CRCStatusEnum.STATUS_DISABLED} and info.current_game_size > 0:
-                # First, signal back to calling code that we've started
-                if progress_callback:
-                    progress_callback(0, info.current_game_size)
+                # Download straight into a buffer sized for the whole game, instead of
+                # building up a list of chunks and joining them afterwards. The buffer is
+                # handed back as is, since copying it would need twice the memory.
+                data = bytearray(info.current_game_size)
+                view = memoryview(data)
+                self.__receive_game(info.current_game_size, lambda address, amount: view[address:(address + amount)], progress_callback)
+                view.release()
+                return data
+            else:
+                return None
 
-                data: List[bytes] = []
-                address: int = 0
+    def receive_to_file(self, path: str, progress_callback: Optional[Callable[[int, int], None]] = None) -> bool:
+        with self.connection():
+            info = self.__get_information()
 
-                while address < info.current_game_size:
-                    # Display progress if we're in CLI mode.
-                    self.__print("%08x %d%%\r" % (address, int(float(address * 100) / float(info.current_game_size))), newline=False)
+            if info.game_crc_status in {CRCStatusEnum.STATUS_VALID, CRCStatusEnum.STATUS_DISABLED} and info.current_game_size > 0:
+                # Only ever hold one chunk in memory, writing each to disk as soon as
+                # it has arrived, so that dumping a large game uses bounded memory.
+                chunk = bytearray(0x8000)
+                view = memoryview(chunk)
+                with open(path, "wb") as fp:
+                    self.__receive_game(
+                        info.current_game_size,
+                        lambda address, amount: view[:amount],
+                        progress_callback,
+                        lambda address, amount: fp.write(view[:amount]),
+                    )
+                view.release()
+                return True
+            else:
+                return False
 
-                    # Get next chunk size.
-                    amount = info.current_game_size - address
-                    if amount > 0x8000:
-                        amount = 0x8000
+    def __receive_game(
+        self,
+        size: int,
+        buffer_for: Callable[[int, int], memoryview],
+        progress_callback: Optional[Callable[[int, int], None]],
+        chunk_done: Optional[Callable[[int, int], Any]] = None,
+    ) -> None:
+        # Pull the entire game down 0x8000 bytes at a time. For every chunk we ask
+        # for a buffer to receive it into given the address and size of the chunk,
+        # and then notify that the chunk was fully received.
+        if progress_callback:
+            # First, signal back to calling code that we've started
+            progress_callback(0, size)
 
-                    # Get next chunk.
-                    chunk = self.__download(address, amount)
-                    data.append(chunk)
-                    address += len(chunk)
+        address: int = 0
+        while address < size:
+            # Display progress if we're in CLI mode.
+            self.__print("%08x %d%%\r" % (address, int(float(address * 100) / float(size))), newline=False)
 
-                    if progress_callback:
-                        progress_callback(address, info.current_game_size)
+            # Get next chunk size.
+            amount = size - address
+            if amount > 0x8000:
+                amount = 0x8000
 
-                return b''.join(data)
-            else:
-                return None
+            # Get next chunk.
+            received = self.__download_into(address, buffer_for(address, amount))
+            if received != amount:
+                raise NetDimmException("Unexpected data length returned from download packet!")
+            if chunk_done:
+                chunk_done(address, amount)
+            address += amount
+
+            if progress_callback:
+                progress_callback(address, size)
 
-    def send_chunk(self, offset: int, data: Union[bytes, FileBytes]) -> None:
+    def send_chunk(self, offset: int, data: Union[bytes, memoryview, FileBytes]) -> None:
         with self.connection():
             addr: int = 0
             total: int = len(data)
@@ -227,8 +444,8 @@ class NetDimm:
 
             while addr < total:
                 # Upload data to a particular address.
-                current = data[addr:(addr + 0x8000)]
-                curlen = len(current)
+                current = _pieces(data, addr, addr + 0x8000)
+                curlen = sum(len(piece) for piece in current)
                 last_packet = addr + curlen == total
 
                 self.__upload(sequence, offset + addr, current, last_packet)
@@ -237,7 +454,8 @@ class NetDimm:
 
     def receive_chunk(self, offset: int, length: int) -> bytes:
         with self.connection():
-            data: List[bytes] = []
+            data = bytearray(length)
+            view = memoryview(data)
             address: int = 0
 
             while address < length:
@@ -247,11 +465,13 @@ class NetDimm:
                     amount = 0x8000
 
                 # Get next chunk.
-                chunk = self.__download(offset + address, amount)
-                data.append(chunk)
-                address += len(chunk)
+                received = self.__download_into(offset + address, view[address:(address + amount)])
+                if received == 0:
+                    raise NetDimmException("Unexpected data length returned from download packet!")
+                address += received
 
-            return b''.join(data)
+            view.release()
+            return bytes(data)
 
     def reboot(self) -> None:
         with self.connection():
@@ -280,6 +500,52 @@ class NetDimm:
         with self.connection():
             self.__host_poke(addr, data, type)
 
+    def peek_many(self, addrs: Sequence[int], type: PeekPokeTypeEnum) -> List[int]:
+        with self.connection():
+            return self.__host_peek_many(addrs, type)
+
+    def poke_many(self, pairs: Sequence[Tuple[int, int]], type: PeekPokeTypeEnum) -> None:
+        with self.connection():
+            self.__host_poke_many(pairs, type)
+
+    def peek_bytes(self, addr: int, length: int) -> bytes:
+        # Read a range of host memory using pipelined long-sized peeks for everything
+        # that's aligned and byte-sized peeks for the ragged ends.
+        head, body, tail = self.__split_range(addr, length)
+        with self.connection():
+            data = bytearray()
+            if head:
+                data += bytes(v & 0xFF for v in self.__host_peek_many(head, PeekPokeTypeEnum.TYPE_BYTE))
+            if body:
+                values = self.__host_peek_many(body, PeekPokeTypeEnum.TYPE_LONG)
+                data += struct.pack(f"<{len(values)}I", *(v & 0xFFFFFFFF for v in values))
+            if tail:
+                data += bytes(v & 0xFF for v in self.__host_peek_many(tail, PeekPokeTypeEnum.TYPE_BYTE))
+            return bytes(data)
+
+    def poke_bytes(self, addr: int, data: bytes) -> None:
+        # The write equivalent of peek_bytes(). Like poke(), nothing comes back from the
+        # net dimm so a later peek is needed to know that the writes landed.
+        head, body, tail = self.__split_range(addr, len(data))
+        with self.connection():
+            if head:
+                self.__host_poke_many([(a, data[a - addr]) for a in head], PeekPokeTypeEnum.TYPE_BYTE)
+            if body:
+                start = body[0] - addr
+                values = struct.unpack(f"<{len(body)}I", data[start:(start + (len(body) * 4))])
+                self.__host_poke_many(list(zip(body, values)), PeekPokeTypeEnum.TYPE_LONG)
+            if tail:
+                self.__host_poke_many([(a, data[a - addr]) for a in tail], PeekPokeTypeEnum.TYPE_BYTE)
+
+    @staticmethod
+    def __split_range(addr: int, length: int) -> Tuple[List[int], List[int], List[int]]:
+        # Addresses to access as bytes up to the first long boundary, as longs through the
+        # aligned middle, and as bytes after the last long boundary.
+        end = addr + length
+        bodystart = min((addr + 3) & ~0x3, end)
+        bodyend = max(end & ~0x3, bodystart)
+        return list(range(addr, bodystart)), list(range(bodystart, bodyend, 4)), list(range(bodyend, end))
+
     def __print(self, string: str, newline: bool = True) -> None:
         if self.log is not None:
             try:
@@ -288,23 +554,29 @@ class NetDimm:
                 self.log(string, end=os.linesep if newline else "")
 
     def __read(self, num: int) -> bytes:
+        data = bytearray(num)
+        self.__read_into(memoryview(data))
+        return bytes(data)
+
+    def __read_into(self, view: memoryview) -> None:
         if self.sock is None:
             raise NetDimmException("Not connected to NetDimm")
 
         try:
-            # a function to receive a number of bytes with hard blocking
-            res: List[bytes] = []
-            left: int = num
+            # a function to receive a number of bytes with hard blocking, straight
+            # into the caller's buffer so that large reads don't get copied around.
+            got: int = 0
+            left: int = len(view)
             start = time.time()
 
             while left > 0:
                 if time.time() - start > 10.0:
                     raise NetDimmException("Could not receive data from NetDimm")
-                ret = self.sock.recv(left)
-                left -= len(ret)
-                res.append(ret)
-
-            return b"".join(res)
+                ret = self.sock.recv_into(view[got:], left)
+                if ret == 0:
+                    raise NetDimmException("NetDimm closed the connection")
+                got += ret
+                left -= ret
         except Exception as e:
             raise NetDimmException("Could not receive data from NetDimm") from e
 
@@ -315,7 +587,21 @@ class NetDimm:
             yield
             return
 
-        # connect to the net dimm. Port is tcp/10703.
+        self.open()
+        try:
+            yield
+        finally:
+            self.close()
+
+    def open(self) -> None:
+        """
+        Connect to the net dimm and stay connected until close() is called, so that any
+        number of operations can share one connection without each paying for a new one.
+        """
+        if self.sock is not None:
+            return
+
+        # connect to the net dimm. Port is tcp/10703 unless overridden.
         # note that this port is only open on
         # - all Type-3 triforces,
         # - pre-type3 triforces jumpered to satellite mode.
@@ -336,27 +622,69 @@ class NetDimm:
             if (sys.platform == 'darwin' or os.environ.get('ALTERNATE_TIMEOUT_HANDLING')) and (not os.environ.get('DEFAULT_TIMEOUT_HANDLING')):
                 self.sock.settimeout(self.timeout)
                 self.sock.setblocking(True)
-                self.sock.connect((self.ip, 10703))
+                self.sock.connect((self.ip, self.port))
             else:
                 self.sock.settimeout(1)
-                self.sock.connect((self.ip, 10703))
+                self.sock.connect((self.ip, self.port))
                 self.sock.settimeout(self.timeout)
 
+            # Almost everything we send is a small request that we then wait on a response
+            # for, so don't let Nagle's algorithm hold packets back hoping for more data.
+            try:
+                self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            except OSError:
+                pass
+
         except Exception as e:
+            # Don't leave a socket that never connected lying around for the next
+            # operation to think we're connected.
+            if self.sock is not None:
+                self.sock.close()
+                self.sock = None
             raise NetDimmException("Could not connect to NetDimm") from e
 
+        self.connects += 1
+
         try:
             # Sending this packet is not strictly necessary, but transfergame.exe
             # sends it. It maps to a NOP packet at least on 3.17 firmware but
             # having the net dimm accept it is a good indication that you are talking
             # to an actual net dimm and not some random thing listening on port 10703.
             self.__startup()
+        except BaseException:
+            self.close()
+            raise
 
-            yield
-        finally:
+    def close(self) -> None:
+        if self.sock is not None:
             self.sock.close()
             self.sock = None
 
+    def is_connected(self) -> bool:
+        """
+        Check without a round trip whether a connection made with open() is still good,
+        meaning the net dimm hasn't hung up on us and there's nothing unexpected waiting
+        to be read, either of which would leave us out of step with the net dimm.
+        """
+        if self.sock is None:
+            return False
+        # Put back whatever open() settled on afterwards, which isn't always our timeout
+        # since the alternate timeout handling leaves the socket blocking.
+        timeout = self.sock.gettimeout()
+        try:
+            self.sock.setblocking(False)
+            try:
+                # Either the net dimm closed the connection or there's data nobody asked
+                # for, and either way we can't trust this connection any more.
+                self.sock.recv(1, socket.MSG_PEEK)
+                return False
+            finally:
+                self.sock.settimeout(timeout)
+        except BlockingIOError:
+            return True
+        except OSError:
+            return False
+
     # Both requests and responses follow this header with length data bytes
     # after. Some have the ability to send/receive variable length (like send/recv
     # dimm packets) and some require a specific length or they do not return.
@@ -371,19 +699,50 @@ class NetDimm:
     # CCCC - Length of the data in bytes that follows this header, not including the 4
     #        header bytes.
     def __send_packet(self, packet: NetDimmPacket) -> None:
+        self.__send_packet_parts(packet.pktid, packet.flags, [packet.data])
+
+    def __send_packet_parts(self, pktid: int, flags: int, parts: Sequence[Union[bytes, memoryview]]) -> None:
+        # Same as above, but the packet data is given as a series of buffers that are
+        # sent back to back. This lets large payloads (such as upload chunks which are
+        # views over the file being sent) go to the kernel without first being glued
+        # onto their headers, which would copy every payload byte at least once more.
+        length = sum(len(part) for part in parts)
+        self.__write([self.__packet_header(pktid, flags, length), *parts])
+
+    @staticmethod
+    def __packet_header(pktid: int, flags: int, length: int) -> bytes:
+        return struct.pack(
+            "<I",
+            (
+                ((pktid & 0xFF) << 24) |  # noqa: W504
+                ((flags & 0xFF) << 16) |  # noqa: W504
+                (length & 0xFFFF)
+            ),
+        )
+
+    def __write(self, buffers: Sequence[Union[bytes, memoryview]]) -> None:
         if self.sock is None:
             raise NetDimmException("Not connected to NetDimm")
+
         try:
-            self.sock.send(
-                struct.pack(
-                    "<I",
-                    (
-                        ((packet.pktid & 0xFF) << 24) |  # noqa: W504
-                        ((packet.flags & 0xFF) << 16) |  # noqa: W504
-                        (packet.length & 0xFFFF)
-                    ),
-                ) + packet.data
-            )
+            if not hasattr(self.sock, "sendmsg"):
+                # Windows has no scatter/gather send, so fall back to sending each buffer
+                # in turn. This still avoids concatenating them.
+                for buf in buffers:
+                    self.sock.sendall(buf)
+                return
+
+            # Make sure we write everything we were asked to, since sendmsg is allowed
+            # to only take part of the data. Whatever it didn't take gets sent again
+            # using views so we don't copy the remainder.
+            views = [memoryview(buf).cast("B") for buf in buffers if len(buf) > 0]
+            while views:
+                sent = self.sock.sendmsg(views)
+                while views and sent >= len(views[0]):
+                    sent -= len(views[0])
+                    views.pop(0)
+                if views and sent > 0:
+                    views[0] = views[0][sent:]
         except Exception as e:
             raise NetDimmException("Could not send data to NetDimm") from e
 
@@ -454,9 +813,40 @@ class NetDimm:
         self.__validate_address(addr, type)
         self.__send_packet(NetDimmPacket(0x11, 0x00, struct.pack("<III", addr, type.value, data)))
 
-    def __host_control_read(self) -> int:
-        # Read the control data location from the host that the net dimm is plugged into.
-        self.__send_packet(NetDimmPacket(0x16, 0x00))
+    def __host_peek_many(self, addrs: Sequence[int], type: PeekPokeTypeEnum) -> List[int]:
+        # The net dimm handles requests in the order they arrive and answers each one
+        # before looking at the next, so we can write a whole window of peek requests in
+        # one go and then read the responses back in the same order. This costs one round
+        # trip per window instead of one per peek.
+        for addr in addrs:
+            self.__validate_address(addr, type)
+
+        values: List[int] = []
+        for start in range(0, len(addrs), self.PEEK_PIPELINE_DEPTH):
+            window = addrs[start:(start + self.PEEK_PIPELINE_DEPTH)]
+            header = self.__packet_header(0x10, 0x00, 8)
+            self.__write([b"".join(header + struct.pack("<II", addr, type.value) for addr in window)])
+
+            for _ in window:
+                response = self.__recv_packet()
+                if response.pktid != 0x10:
+                    raise NetDimmException("Unexpected data returned from peek4 packet!")
+                if response.length != 8:
+                    raise NetDimmException("Unexpected data length returned from peek4 packet!")
+                _success, val = struct.unpack("<II", response.data)
+                values.append(cast(int, val))
+        return values
+
+    def __host_poke_many(self, pairs: Sequence[Tuple[int, int]], type: PeekPokeTypeEnum) -> None:
+        # Pokes have no response, so they can all go out in a single write.
+        for addr, _ in pairs:
+            self.__validate_address(addr, type)
+        header = self.__packet_header(0x11, 0x00, 12)
+        self.__write([b"".join(header + struct.pack("<III", addr, type.value, data) for addr, data in pairs)])
+
+    def __receive_host_control(self) -> int:
+        # Read the response to a request for the control data location from the host that
+        # the net dimm is plugged into.
         response = self.__recv_packet()
         if response.pktid != 0x10:
             # Yes, its buggy for this as well, and they reused the peek ID.
@@ -525,7 +915,7 @@ class NetDimm:
             raise NetDimmException("Key code must by 8 bytes in length")
         self.__send_packet(NetDimmPacket(0x7F, 0x00, keydata))
 
-    def __upload(self, sequence: int, addr: int, data: bytes, last_chunk: bool) -> None:
+    def __upload(self, sequence: int, addr: int, data: Union[bytes, memoryview, Sequence[Union[bytes, memoryview]]], last_chunk: bool) -> None:
         # Upload a chunk of data to the DIMM address "addr". The sequence seems to
         # be just a marking for what number packet this is. The last chunk flag is
         # an indicator for whether this is the last packet or not and gets used to
@@ -533,9 +923,15 @@ class NetDimm:
         # to 0xA), the packet will be rejected. The net dimm does not seem to parse
         # the sequence number in fw 3.17 but transfergame.exe sends it. The last
         # short does not seem to do anything and does not appear to even be parsed.
-        self.__send_packet(NetDimmPacket(0x04, 0x81 if last_chunk else 0x80, struct.pack("<IIH", sequence, addr, 0) + data))
+        pieces = [data] if isinstance(data, (bytes, memoryview)) else list(data)
+        self.__send_packet_parts(0x04, 0x81 if last_chunk else 0x80, [struct.pack("<IIH", sequence, addr, 0), *pieces])
 
     def __download(self, addr: int, size: int) -> bytes:
+        data = bytearray(size)
+        received = self.__download_into(addr, memoryview(data))
+        return bytes(data[:received])
+
+    def __download_into(self, addr: int, view: memoryview) -> int:
         # This appears to have access to not just the dimm bank on the net dimm, but also
         # some system registers and status. System registers are mirrored so the address
         # 0x3ffeffe0 is the same as 0xfffeffe0. Various official utilities use either
@@ -547,21 +943,31 @@ class NetDimm:
         # 1 - CRC over data is currently in progress (screen will display now checking...).
         # 2 - CRC over data is correct, game should boot or be running.
         # 3 - CRC over data is incorrect, should be waiting for additional data and CRC stamp.
-        self.__send_packet(NetDimmPacket(0x05, 0x00, struct.pack("<II", addr, size)))
+        self.__send_packet(NetDimmPacket(0x05, 0x00, struct.pack("<II", addr, len(view))))
+        return self.__receive_download_into(view)
 
+    def __receive_download_into(self, view: memoryview) -> int:
         # Read the data back. The flags byte will be 0x80 if the requested data size was
         # too big, and 0x81 if all of the data was able to be returned. It looks like at
         # least for 3.17 this limit is 8192. However, the net dimm will continue sending
-        # packets until all data has been received.
-        data = b""
+        # packets until all data has been received. We read each packet's payload directly
+        # into the right spot in the caller's buffer and return how much data we got.
+        size = len(view)
+        received: int = 0
+        subheader = bytearray(10)
 
         while True:
-            chunk = self.__recv_packet()
+            header = struct.unpack("<I", self.__read(4))[0]
+            pktid = (header >> 24) & 0xFF
+            flags = (header >> 16) & 0xFF
+            length = header & 0xFFFF
 
-            if chunk.pktid != 0x04:
+            if pktid != 0x04:
                 # Yes, they have a bug and they used the upload packet type here.
                 raise NetDimmException("Unexpected data returned from download packet!")
-            if chunk.length <= 10:
+            if length <= 10:
+                raise NetDimmException("Unexpected data length returned from download packet!")
+            if received + (length - 10) > size:
                 raise NetDimmException("Unexpected data length returned from download packet!")
 
             # The sequence is set to 1 for the first packet and then incremented for each
@@ -569,22 +975,13 @@ class NetDimm:
             # discarded in practice. I guess there might be some reason to reassemble with
             # the sequences in the correct order, but as of net dimm 3.17 the firware will
             # always send things back in order one packet at a time.
-            _chunksequence, chunkaddr, _ = struct.unpack("<IIH", chunk.data[0:10])
-            data += chunk.data[10:]
+            self.__read_into(memoryview(subheader))
+            self.__read_into(view[received:(received + length - 10)])
+            received += length - 10
 
-            if chunk.flags & 0x1 != 0:
+            if flags & 0x1 != 0:
                 # We finished!
-                return data
-
-    def __get_crc_information(self) -> int:
-        # Read the system register that the net dimm firmware uses to communicate the
-        # current CRC status.
-        return cast(int, struct.unpack("<I", self.__download(0xfffeffe0, 4))[0])
-
-    def __get_game_size(self) -> int:
-        # Read the system register that the net dimm firmware uses to store the game
-        # size after a __set_information call is performed.
-        return cast(int, struct.unpack("<I", self.__download(0xffff0004, 4))[0])
+                return received
 
     def __disable_crc_check(self) -> None:
         self.__upload(1, 0xfffefff0, struct.pack("<IIII", 0xFFFFFFFF, 0xFFFFFFFF, 0, 0), True)
@@ -593,7 +990,17 @@ class NetDimm:
         self.__upload(1, 0xfffefff0, struct.pack("<IIII", 0, 0, 0, 0), True)
 
     def __get_information(self) -> NetDimmInfo:
-        self.__send_packet(NetDimmPacket(0x18, 0x00))
+        # Everything we want to know goes out back to back and the net dimm answers each
+        # request in order, so this costs a single round trip instead of four. Alongside
+        # the info packet we read the system register that the firmware uses for the
+        # current CRC status, the one where it stores the game size after a
+        # __set_information call, and the BIOS control word.
+        self.__write([
+            self.__packet_header(0x18, 0x00, 0),
+            self.__packet_header(0x05, 0x00, 8) + struct.pack("<II", 0xfffeffe0, 4),
+            self.__packet_header(0x05, 0x00, 8) + struct.pack("<II", 0xffff0004, 4),
+            self.__packet_header(0x16, 0x00, 0),
+        ])
 
         # Get the info from the DIMM.
         response = self.__recv_packet()
@@ -622,8 +1029,15 @@ class NetDimm:
         except ValueError:
             firmware_version = NetDimmVersionEnum.VERSION_UNKNOWN
 
-        # Now, query if the game CRC is valid.
-        crc_info = self.__get_crc_information()
+        # Read the rest of the responses before looking at any of them, so that a bad
+        # value never leaves unread responses behind on the connection.
+        registers = bytearray(8)
+        if self.__receive_download_into(memoryview(registers)[0:4]) != 4 or self.__receive_download_into(memoryview(registers)[4:8]) != 4:
+            raise NetDimmException("Unexpected data length returned from download packet!")
+        crc_info, game_size = struct.unpack("<II", registers)
+        control = self.__receive_host_control()
+
+        # Now, see if the game CRC is valid.
         if crc_info in {0, 1}:
             # CRC is running, unknown.
             crc_status = CRCStatusEnum.STATUS_CHECKING
@@ -642,15 +1056,11 @@ class NetDimm:
         else:
             raise NetDimmException("Unexpected CRC status value returned from download packet!")
 
-        # Now, query the size of the game loaded in bytes.
-        game_size = self.__get_game_size()
+        # Now, look at the size of the game loaded in bytes.
         if game_size == 0 and crc == 0 and crc_status == CRCStatusEnum.STATUS_VALID:
             # We stamped this with an invalid setup and the next transfer was interrupted.
             crc_status = CRCStatusEnum.STATUS_INVALID
 
-        # Now, query the BIOS control word.
-        control = self.__host_control_read()
-
         return NetDimmInfo(
             current_game_crc=crc,
             current_game_size=game_size,
@@ -673,19 +1083,86 @@ class NetDimm:
         # the crc over the first 28 bytes.
         self.__send_packet(NetDimmPacket(0x19, 0x00, struct.pack("<III", crc & 0xFFFFFFFF, length, 0)))
 
-    def __upload_file(self, data: Union[bytes, FileBytes], key: Optional[bytes], progress_callback: Optional[Callable[[int, int], None]]) -> None:
+    def __verify_resume(self, previous: NetDimmManifest) -> Optional[NetDimmManifest]:
+        # Given a manifest of an interrupted upload, read back some of the blocks that
+        # we sent and see how much of it the net dimm really holds. Uploads are never
+        # acknowledged, so the last few blocks may have been lost along with the
+        # connection, and a power cycle since then would have lost everything. We check
+        # the first block, the last few and a random sample of the rest, and resume
+        # from the first one that doesn't match.
+        count = len(previous.blocks)
+        tail = max(count - self.RESUME_VERIFY_TAIL, 0)
+        samples = {0, *range(tail, count), *random.sample(range(tail), min(tail, self.RESUME_VERIFY_SAMPLES))}
+
+        valid = count
+        for block in sorted(samples):
+            if block >= count:
+                break
+            addr = block * NetDimmManifest.BLOCK_SIZE
+            length = min(NetDimmManifest.BLOCK_SIZE, previous.length - addr)
+            if length <= 0 or NetDimmManifest.hash([self.__download(addr, length)]) != previous.blocks[block]:
+                valid = block
+                break
+
+        if valid == 0:
+            return None
+        self.__print("resuming upload after %08x" % (valid * NetDimmManifest.BLOCK_SIZE))
+        return NetDimmManifest(previous.crc, min(valid * NetDimmManifest.BLOCK_SIZE, previous.length), previous.blocks[:valid], complete=False)
+
+    def __upload_file(
+        self,
+        data: Union[bytes, memoryview, FileBytes],
+        key: Optional[bytes],
+        progress_callback: Optional[Callable[[int, int], None]],
+        previous: Optional[NetDimmManifest] = None,
+        source: Optional["NetDimmBroadcastReader"] = None,
+    ) -> None:
         # upload a file into DIMM memory, and optionally encrypt for the given key.
         # note that the re-encryption is obsoleted by just setting a zero-key, which
-        # is a magic to disable the decryption.
-        crc: int = 0
-        addr: int = 0
+        # is a magic to disable the decryption. If we know what the net dimm already
+        # holds, blocks which haven't changed are skipped. If the upload fails partway
+        # through, last_manifest describes what got sent so a later send can resume.
+        # If we're part of a broadcast, blocks come already prepared from the source
+        # instead of being prepared here.
         total: int = len(data)
-        des = DES.new(key[::-1], DES.MODE_ECB) if key else None
-
-        def __encrypt(chunk: bytes) -> bytes:
-            if des is None:
-                return chunk
-            return des.encrypt(chunk[::-1])[::-1]
+        stats = NetDimmTransferStats()
+        self.last_transfer = stats
+
+        # Preparing a chunk (reading it out of a possibly patched FileBytes, encrypting
+        # it and running the CRC over it) is CPU work that would otherwise leave the socket
+        # idle, so we do it on a separate thread and hand finished chunks over through a
+        # bounded queue. That way chunk N+1 gets prepared while chunk N is on the wire.
+        # Each entry is the address, the prepared chunk as a list of pieces to send back to
+        # back, the running CRC including that chunk and a hash of the unencrypted chunk.
+        # A None entry marks the end of data, and an exception entry means the producer
+        # failed and we should bail out.
+        chunks: "queue.Queue[Union[Tuple[int, List[Union[bytes, memoryview]], int, bytes], Exception, None]]" = queue.Queue(maxsize=self.UPLOAD_PIPELINE_DEPTH)
+        abort = threading.Event()
+
+        def __put(entry: Union[Tuple[int, List[Union[bytes, memoryview]], int, bytes], Exception, None]) -> bool:
+            while not abort.is_set():
+                try:
+                    chunks.put(entry, timeout=0.1)
+                    return True
+                except queue.Full:
+                    pass
+            return False
+
+        def __prepare() -> None:
+            try:
+                blocks = _prepare_blocks(data, key)
+                while True:
+                    start = time.time()
+                    entry = next(blocks, None)
+                    stats.prepare_time += time.time() - start
+
+                    if entry is None:
+                        break
+                    if not __put(entry):
+                        return
+                __put(None)
+            except Exception as e:
+                __put(e)
 
         # Make sure that if this is interrupted, but the CRC was marked as valid
         # at one point, when we resync we don't accidentally think we're running a game.
@@ -693,26 +1170,80 @@ class NetDimm:
         # to ensure the net dimm doesn't think anything is valid.
         self.__upload(1, 0xffff0000, b"\0" * 32, False)
 
-        sequence = 2
-        while addr < total:
-            self.__print("%08x %d%%\r" % (addr, int(float(addr * 100) / float(total))), newline=False)
-            if progress_callback:
-                progress_callback(addr, total)
+        begin = time.time()
+        producer: Optional[threading.Thread] = None
+        if source is None:
+            producer = threading.Thread(target=__prepare)
+            producer.daemon = True
+            producer.start()
+
+        try:
+            crc: int = 0
+            addr: int = 0
+            sequence = 2
+            digests: List[bytes] = []
+            sent: int = 0
+            while True:
+                start = time.time()
+                entry = chunks.get() if source is None else source.read()
+                stats.stall_time += time.time() - start
+
+                if entry is None:
+                    break
+                if isinstance(entry, Exception):
+                    raise entry
+
+                addr, current, crc, digest = entry
+                digests.append(digest)
+                self.__print("%08x %d%%\r" % (addr, int(float(addr * 100) / float(total))), newline=False)
+                if progress_callback:
+                    progress_callback(addr, total)
 
-            current = data[addr:(addr + 0x8000)]
-            curlen = len(current)
-            last_packet = addr + curlen == total
+                curlen = sum(len(piece) for piece in current)
+                last_packet = addr + curlen == total
 
-            current = __encrypt(current)
-            self.__upload(sequence, addr, current, last_packet)
-            crc = zlib.crc32(current, crc)
-            addr += curlen
-            sequence += 1
+                # Skip blocks the net dimm already has, but always send the final one so
+                # that the net dimm still sees a packet flagged as the end of the upload.
+                block = len(digests) - 1
+                if previous is not None and not last_packet and block < len(previous.blocks) and previous.blocks[block] == digest:
+                    stats.bytes_skipped += curlen
+                    stats.blocks_skipped += 1
+                    addr += curlen
+                    sent = addr
+                    continue
+
+                start = time.time()
+                self.__upload(sequence, addr, current, last_packet)
+                stats.send_time += time.time() - start
+                stats.bytes_sent += curlen
+                stats.packets_sent += 1
+
+                addr += curlen
+                sent = addr
+                sequence += 1
+        except Exception:
+            # Remember every block that made it onto the wire, so that a later send
+            # can pick up where we left off instead of starting over.
+            self.last_manifest = None if key else NetDimmManifest(0, sent, digests[:((sent + NetDimmManifest.BLOCK_SIZE - 1) // NetDimmManifest.BLOCK_SIZE)], complete=False)
+            raise
+        finally:
+            # Make sure the producer exits if we bailed out early.
+            abort.set()
+            if producer is not None:
+                producer.join()
+            if source is not None:
+                # Don't hold up the rest of the broadcast waiting on us.
+                source.close()
+            stats.elapsed = time.time() - begin
 
         if progress_callback:
             progress_callback(addr, total)
         crc = (~crc) & 0xFFFFFFFF
+        self.last_manifest = None if key else NetDimmManifest(crc, addr, digests)
         self.__print("length: %08x" % addr)
+        self.__print("throughput: %.1f KiB/s, overlap: %d%%" % (stats.throughput / 1024.0, int(stats.overlap * 100)))
+        if stats.blocks_skipped:
+            self.__print("skipped %d unchanged blocks (%d bytes)" % (stats.blocks_skipped, stats.bytes_skipped))
         self.__set_information(crc, addr)
 
     def __close(self) -> None:
@@ -735,3 +1266,289 @@ class NetDimm:
     # a different version of the net dimm firmware. I have not bothered to document the expected
     # sizes or returns for any of these packets. 0x0B appears to only be for triforce/chihiro, as
     # firmware 3.17 explicitly checks against naomi and returns if it is the current target.
+
+
+class NetDimmBroadcastReader:
+    """
+    One net dimm's view of a NetDimmBroadcast, handing out prepared blocks in order.
+    Pass it as the source argument to NetDimm.send() along with the broadcast's data.
+    """
+
+    def __init__(self, broadcast: "NetDimmBroadcast") -> None:
+        self.__broadcast = broadcast
+
+        # The next block we want, along with the address and running CRC that it starts
+        # at, which is where we pick up from on our own if we get cut loose.
+        self.position: int = 0
+        self.addr: int = 0
+        self.crc: int = 0
+
+        self.started: bool = False
+        self.waiting: bool = False
+        self.detached: bool = False
+        self.closed: bool = False
+        self.blocks: Optional[Generator[Tuple[int, List[Union[bytes, memoryview]], int, bytes], None, None]] = None
+
+    def read(self) -> Optional[Tuple[int, List[Union[bytes, memoryview]], int, bytes]]:
+        # The next prepared block, or None once the whole image has been read.
+        return self.__broadcast.read(self)
+
+    def close(self) -> None:
+        self.__broadcast.leave(self)
+
+
+class NetDimmBroadcast:
+    """
+    Sends the same image to several net dimms at once, reading, encrypting and CRCing
+    every block once no matter how many net dimms it goes to. A single thread prepares
+    blocks and every net dimm sends them out as fast as it can on a thread of its own.
+    Prepared blocks are kept around until every net dimm has sent them, up to a window
+    of blocks. If a net dimm falls so far behind that the fastest one has been waiting
+    on it for longer than the lag timeout, it is cut loose and prepares the rest of the
+    image itself, so one slow or unresponsive net dimm can't drag everybody else down
+    with it.
+    """
+
+    # How many blocks the fastest net dimm can get ahead of the slowest one. Each block
+    # is 0x8000 bytes, so this is how much memory a broadcast holds onto at most.
+    DEFAULT_WINDOW: int = 64
+
+    # How long the fastest net dimm will wait on the slowest once the window is full, and
+    # how long net dimms get to finish getting ready for the upload before they can be
+    # cut loose for not having read anything yet.
+    DEFAULT_LAG_TIMEOUT: float = 1.0
+    DEFAULT_START_TIMEOUT: float = 5.0
+
+    def __init__(
+        self,
+        data: Union[bytes, memoryview, FileBytes],
+        key: Optional[bytes] = None,
+        window: int = DEFAULT_WINDOW,
+        lag_timeout: float = DEFAULT_LAG_TIMEOUT,
+        start_timeout: float = DEFAULT_START_TIMEOUT,
+    ) -> None:
+        if window < 1:
+            raise NetDimmException("Broadcast window must hold at least one block!")
+
+        self.data: Union[bytes, memoryview, FileBytes] = data
+        self.key: Optional[bytes] = key
+        self.window: int = window
+        self.lag_timeout: float = lag_timeout
+        self.start_timeout: float = start_timeout
+        self.__started: float = 0.0
+        # When somebody started waiting on a full window, until the slowest catches up.
+        self.__blocked: Optional[float] = None
+        self.__lock: threading.Condition = threading.Condition()
+        self.__readers: List[NetDimmBroadcastReader] = []
+        self.__blocks: Dict[int, Tuple[int, List[Union[bytes, memoryview]], int, bytes]] = {}
+        self.__produced: int = 0
+        self.__finished: bool = False
+        self.__error: Optional[Exception] = None
+        self.__thread: Optional[threading.Thread] = None
+
+        # Blocks prepared once for everybody, blocks prepared again by net dimms that were
+        # cut loose, and how many net dimms that happened to.
+        self.blocks_prepared: int = 0
+        self.blocks_prepared_detached: int = 0
+        self.detached: int = 0
+
+    def __repr__(self) -> str:
+        return f"NetDimmBroadcast(length={len(self.data)}, window={repr(self.window)}, lag_timeout={repr(self.lag_timeout)}, start_timeout={repr(self.start_timeout)})"
+
+    @property
+    def stats(self) -> Dict[str, int]:
+        with self.__lock:
+            return {
+                "blocks_prepared": self.blocks_prepared,
+                "blocks_prepared_detached": self.blocks_prepared_detached,
+                "detached": self.detached,
+            }
+
+    def reader(self) -> NetDimmBroadcastReader:
+        """
+        Add a net dimm to the broadcast. Every reader has to be added before any of them
+        starts reading, since blocks are thrown away as soon as everybody has them.
+        """
+        with self.__lock:
+            if self.__thread is not None:
+                raise NetDimmException("Cannot add to a broadcast that has already started!")
+            reader = NetDimmBroadcastReader(self)
+            self.__readers.append(reader)
+            return reader
+
+    def send(
+        self,
+        netdimms: Sequence[NetDimm],
+        disable_crc_check: bool = False,
+        disable_now_loading: bool = False,
+        progress_callback: Optional[Callable[[NetDimm, int, int], None]] = None,
+        previous: Optional[Sequence[Optional[NetDimmManifest]]] = None,
+    ) -> List[Optional[Exception]]:
+        """
+        Send the image to every net dimm given, returning None for each one that succeeded
+        or what went wrong for each one that didn't. The progress callback gets told which
+        net dimm it is hearing about, and previous optionally holds a manifest for each net
+        dimm to skip unchanged blocks just like NetDimm.send() does.
+        """
+        readers = [self.reader() for _ in netdimms]
+        results: List[Optional[Exception]] = [None] * len(netdimms)
+
+        def __send(index: int) -> None:
+            netdimm = netdimms[index]
+            try:
+                netdimm.send(
+                    self.data,
+                    key=self.key,
+                    disable_crc_check=disable_crc_check,
+                    disable_now_loading=disable_now_loading,
+                    progress_callback=(lambda cur, tot: progress_callback(netdimm, cur, tot)) if progress_callback else None,
+                    previous=previous[index] if previous else None,
+                    source=readers[index],
+                )
+            except Exception as e:
+                results[index] = e
+            finally:
+                # If we never got as far as reading anything, make sure nobody waits on us.
+                readers[index].close()
+
+        threads = [threading.Thread(target=__send, args=(index,)) for index in range(len(netdimms))]
+        for thread in threads:
+            thread.daemon = True
+            thread.start()
+        for thread in threads:
+            thread.join()
+
+        with self.__lock:
+            producer = self.__thread
+        if producer is not None:
+            producer.join()
+
+        # Let go of every view into the data that we or a failed send might still be holding
+        # on to, so that whatever backs it, such as an mmap, can be closed right away.
+        with self.__lock:
+            self.__blocks.clear()
+        for reader in readers:
+            reader.blocks = None
+        for result in results:
+            error: Optional[BaseException] = result
+            while error is not None:
+                error.__traceback__ = None
+                error = error.__cause__ or error.__context__
+        return results
+
+    def read(self, reader: NetDimmBroadcastReader) -> Optional[Tuple[int, List[Union[bytes, memoryview]], int, bytes]]:
+        with self.__lock:
+            if reader.closed:
+                raise NetDimmException("Cannot read from a closed broadcast reader!")
+            reader.started = True
+            if self.__thread is None:
+                self.__started = time.time()
+                self.__thread = threading.Thread(target=self.__produce)
+                self.__thread.daemon = True
+                self.__thread.start()
+
+            while not reader.detached:
+                if reader.position < self.__produced:
+                    entry = self.__blocks[reader.position]
+                    reader.position += 1
+                    reader.addr = entry[0] + sum(len(piece) for piece in entry[1])
+                    reader.crc = entry[2]
+                    self.__trim()
+                    return entry
+                if self.__error is not None:
+                    raise self.__error
+                if self.__finished:
+                    return None
+
+                reader.waiting = True
+                self.__lock.notify_all()
+                self.__lock.wait()
+                reader.waiting = False
+
+        # We fell too far behind, so we're on our own from where we left off.
+        if reader.blocks is None:
+            reader.blocks = _prepare_blocks(self.data, self.key, reader.addr, reader.crc)
+        block = next(reader.blocks, None)
+        if block is not None:
+            with self.__lock:
+                self.blocks_prepared_detached += 1
+        return block
+
+    def leave(self, reader: NetDimmBroadcastReader) -> None:
+        # A net dimm is done, whether it finished or failed, so stop holding blocks for it.
+        with self.__lock:
+            reader.closed = True
+            if reader in self.__readers:
+                self.__readers.remove(reader)
+                self.__trim()
+
+    def __trim(self) -> None:
+        # Throw away blocks that every net dimm still in the broadcast has already read,
+        # and wake up the producer since there may be room for more. Note that this should
+        # only be called by something that has a lock.
+        oldest = min((reader.position for reader in self.__readers), default=self.__produced)
+        for block in [block for block in self.__blocks if block < oldest]:
+            del self.__blocks[block]
+        self.__lock.notify_all()
+
+    def __produce(self) -> None:
+        blocks = _prepare_blocks(self.data, self.key)
+        try:
+            while True:
+                with self.__lock:
+                    while True:
+                        if not self.__readers:
+                            # Everybody finished or gave up, nothing left to do.
+                            return
+
+                        oldest = min(reader.position for reader in self.__readers)
+                        newest = max(reader.position for reader in self.__readers)
+                        if (newest - oldest) < max(self.window // 2, 1):
+                            # Whoever was lagging caught back up, so they're off the hook.
+                            self.__blocked = None
+                        if self.__produced < oldest + self.window:
+                            break
+                        if self.__blocked is None and any(reader.waiting for reader in self.__readers):
+                            self.__blocked = time.time()
+                        if self.__blocked is None:
+                            self.__lock.wait()
+                            continue
+
+                        # Somebody is waiting on a block that we can't prepare without going
+                        # past the window. Give whoever is holding it open a little while to
+                        # catch up, or a while longer if they're still getting ready to
+                        # upload, and then cut them loose.
+                        slowest = [reader for reader in self.__readers if reader.position == oldest]
+                        if any(not reader.started for reader in slowest):
+                            deadline = self.__started + self.start_timeout
+                        else:
+                            deadline = self.__blocked + self.lag_timeout
+                        remaining = deadline - time.time()
+                        if remaining > 0.0:
+                            self.__lock.wait(remaining)
+                            continue
+
+                        for reader in slowest:
+                            reader.detached = True
+                            self.__readers.remove(reader)
+                            self.detached += 1
+                        self.__blocked = None
+                        self.__trim()
+
+                # Prepare outside of the lock so net dimms can keep sending what we have.
+                entry = next(blocks, None)
+
+                with self.__lock:
+                    if entry is None:
+                        self.__finished = True
+                        self.__lock.notify_all()
+                        return
+
+                    self.__blocks[self.__produced] = entry
+                    self.__produced += 1
+                    self.blocks_prepared += 1
+                    self.__lock.notify_all()
+        except Exception as e:
+            with self.__lock:
+                self.__error = e
+                self.__lock.notify_all()
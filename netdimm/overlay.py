@@ -0,0 +1,195 @@
+import bisect
+import mmap
+import os
+from typing import Any, BinaryIO, List, Optional, Union
+
+from arcadeutils import FileBytes
+
+
+class OverlayImage(FileBytes):
+    """
+    A patched view of a file on disk which never copies the file itself. The file is
+    mapped read-only and shared between all clones, and every write lands in a sorted
+    list of replaced ranges or in a tail of appended data. Reading walks these layers,
+    and views() hands back memoryviews straight out of the mapping wherever the file
+    hasn't been patched, so that uploading or CRCing an image reads the file once.
+
+    This is a drop-in replacement for FileBytes everywhere that patches get applied,
+    so code which checks for FileBytes keeps working. Cloning only copies the list of
+    replaced ranges, making the copy-on-write clones that patchers make cheap.
+    """
+
+    # How much to read at a time when searching.
+    SEARCH_WINDOW: int = 1024 * 1024
+
+    def __init__(self, handle: BinaryIO) -> None:
+        super().__init__(handle)
+        size = os.fstat(handle.fileno()).st_size
+        self.__mmap: Optional[mmap.mmap] = mmap.mmap(handle.fileno(), 0, access=mmap.ACCESS_READ) if size > 0 else None
+        self.__base: memoryview = memoryview(self.__mmap) if self.__mmap is not None else memoryview(b"")
+
+        # How much of the base file is still visible, which only shrinks on truncation.
+        self.__limit: int = size
+
+        # Sorted, non-overlapping and non-adjacent replaced ranges within the visible
+        # base file, stored as parallel lists of start offsets and replacement data.
+        self.__starts: List[int] = []
+        self.__chunks: List[bytes] = []
+
+        # Data logically placed right after the visible base file.
+        self.__tail: bytearray = bytearray()
+
+    @property
+    def patched_ranges(self) -> int:
+        return len(self.__starts)
+
+    def __len__(self) -> int:
+        return self.__limit + len(self.__tail)
+
+    def clone(self) -> "OverlayImage":
+        new = OverlayImage.__new__(OverlayImage)
+        new.__dict__.update(self.__dict__)
+        new.__starts = list(self.__starts)
+        new.__chunks = list(self.__chunks)
+        new.__tail = bytearray(self.__tail)
+        return new
+
+    def __add__(self, other: Any) -> "OverlayImage":
+        new = self.clone()
+        new.append(bytes(other))
+        return new
+
+    def append(self, data: bytes) -> None:
+        self.__tail += data
+
+    def truncate(self, size: int) -> None:
+        if size >= len(self):
+            return
+        if size >= self.__limit:
+            del self.__tail[(size - self.__limit):]
+            return
+
+        # Cutting into the base file, so throw away anything past the new end.
+        self.__limit = size
+        self.__tail = bytearray()
+        index = bisect.bisect_left(self.__starts, size)
+        del self.__starts[index:]
+        del self.__chunks[index:]
+        if self.__starts and self.__starts[-1] + len(self.__chunks[-1]) > size:
+            self.__chunks[-1] = self.__chunks[-1][:(size - self.__starts[-1])]
+
+    def views(self, start: int = 0, end: Optional[int] = None) -> List[Union[bytes, memoryview]]:
+        """
+        Return the data between start and end as a list of pieces which, concatenated,
+        are the same as slicing. Unpatched parts of the file are memoryviews into the
+        mapping rather than copies.
+        """
+        length = len(self)
+        end = length if end is None else min(end, length)
+        start = max(start, 0)
+        pieces: List[Union[bytes, memoryview]] = []
+
+        position = start
+        baseend = min(end, self.__limit)
+        index = bisect.bisect_right(self.__starts, position) - 1
+        if index < 0 or (self.__starts[index] + len(self.__chunks[index])) <= position:
+            index += 1
+        while position < baseend:
+            if index < len(self.__starts) and self.__starts[index] <= position:
+                chunkstart = self.__starts[index]
+                chunkend = min(chunkstart + len(self.__chunks[index]), baseend)
+                pieces.append(memoryview(self.__chunks[index])[(position - chunkstart):(chunkend - chunkstart)])
+                position = chunkend
+                index += 1
+            else:
+                upto = min(self.__starts[index], baseend) if index < len(self.__starts) else baseend
+                pieces.append(self.__base[position:upto])
+                position = upto
+
+        if end > self.__limit and position < end:
+            # Copy out of the tail, since it can still grow and views would pin it.
+            pieces.append(bytes(self.__tail[(position - self.__limit):(end - self.__limit)]))
+        return pieces
+
+    def __getitem__(self, key: Any) -> Any:
+        if isinstance(key, int):
+            if key < 0:
+                key += len(self)
+            if key < 0 or key >= len(self):
+                raise IndexError("OverlayImage index out of range")
+            return self.views(key, key + 1)[0][0]
+        if isinstance(key, slice):
+            start, stop, step = key.indices(len(self))
+            if step != 1:
+                return b"".join(self.views(0, len(self)))[key]
+            if stop <= start:
+                return b""
+            return b"".join(self.views(start, stop))
+        raise TypeError(f"OverlayImage indices must be integers or slices, not {type(key).__name__}")
+
+    def __setitem__(self, key: Any, value: Any) -> None:
+        if isinstance(key, int):
+            if key < 0:
+                key += len(self)
+            if key < 0 or key >= len(self):
+                raise IndexError("OverlayImage index out of range")
+            start, data = key, bytes([value])
+        elif isinstance(key, slice):
+            start, stop, step = key.indices(len(self))
+            data = bytes(value)
+            if step != 1 or (stop - start) != len(data):
+                raise NotImplementedError("OverlayImage does not support resizing or extended slice assignment")
+        else:
+            raise TypeError(f"OverlayImage indices must be integers or slices, not {type(key).__name__}")
+        if not data:
+            return
+
+        # Anything landing after the base file goes straight into the tail.
+        if start + len(data) > self.__limit:
+            split = max(self.__limit - start, 0)
+            tailstart = start + split - self.__limit
+            self.__tail[tailstart:(tailstart + len(data) - split)] = data[split:]
+            data = data[:split]
+            if not data:
+                return
+        self.__replace(start, data)
+
+    def __replace(self, start: int, data: bytes) -> None:
+        # Merge this write with every existing range it overlaps or touches, so that the
+        # list stays short no matter how many small patches get applied.
+        end = start + len(data)
+        first = bisect.bisect_left(self.__starts, start)
+        if first > 0 and self.__starts[first - 1] + len(self.__chunks[first - 1]) >= start:
+            first -= 1
+        last = first
+        while last < len(self.__starts) and self.__starts[last] <= end:
+            last += 1
+
+        if first == last:
+            self.__starts.insert(first, start)
+            self.__chunks.insert(first, data)
+            return
+
+        mergedstart = min(start, self.__starts[first])
+        mergedend = max(end, self.__starts[last - 1] + len(self.__chunks[last - 1]))
+        merged = bytearray(mergedend - mergedstart)
+        for index in range(first, last):
+            offset = self.__starts[index] - mergedstart
+            merged[offset:(offset + len(self.__chunks[index]))] = self.__chunks[index]
+        merged[(start - mergedstart):(end - mergedstart)] = data
+
+        self.__starts[first:last] = [mergedstart]
+        self.__chunks[first:last] = [bytes(merged)]
+
+    def search(self, needle: bytes, start: Optional[int] = None, end: Optional[int] = None) -> Optional[int]:
+        start = start or 0
+        end = len(self) if end is None else min(end, len(self))
+        position = start
+        while position < end:
+            # Overlap windows so that matches straddling a boundary are still found.
+            window: bytes = self[position:min(end, position + self.SEARCH_WINDOW + len(needle) - 1)]
+            location = window.find(needle)
+            if location >= 0:
+                return position + location
+            position += self.SEARCH_WINDOW
+        return None
@@ -0,0 +1,711 @@
+#!/usr/bin/env python3
+# A local stand-in for a net dimm, for testing and benchmarking without hardware.
+import queue
+import random
+import socket
+import struct
+import threading
+import time
+import zlib
+from typing import Callable, Dict, List, Optional, Tuple
+
+from netdimm.netdimm import NetDimmVersionEnum
+from netdimm.message import (
+    CONFIG_MESSAGE_EXISTS,
+    CONFIG_MESSAGE_HAS_MAILBOX,
+    CONFIG_MESSAGE_HAS_STREAMS,
+    CONFIG_MESSAGE_HAS_ZLIB,
+    CONFIG_REGISTER,
+    CONFIG_REGISTER_SEED,
+    DATA_REGISTER,
+    MAILBOX_REGISTER,
+    MAILBOX_REGISTER_SEED,
+    MAX_MESSAGE_DATA_LENGTH,
+    MESSAGE_HEADER_LENGTH,
+    MESSAGE_STREAM_ACK,
+    MESSAGE_STREAM_DATA,
+    Mailbox,
+    RECV_STATUS_REGISTER,
+    RECV_STATUS_REGISTER_SEED,
+    SCRATCH1_REGISTER,
+    SCRATCH2_REGISTER,
+    SEND_STATUS_REGISTER,
+    SEND_STATUS_REGISTER_SEED,
+    STREAM_CHUNK_LENGTH,
+    STREAM_HEADER_LENGTH,
+    STREAM_WINDOW,
+    checksum_stamp,
+)
+
+
+class NetDimmSimulatorStats:
+    def __init__(self) -> None:
+        self.connections: int = 0
+        self.packets_received: Dict[int, int] = {}
+        self.packets_sent: int = 0
+        self.bytes_received: int = 0
+        self.bytes_sent: int = 0
+        self.stalls: int = 0
+
+    @property
+    def total_packets_received(self) -> int:
+        return sum(self.packets_received.values())
+
+    def __repr__(self) -> str:
+        return (
+            f"NetDimmSimulatorStats(connections={self.connections}, packets_received={self.total_packets_received}, "
+            f"packets_sent={self.packets_sent}, bytes_received={self.bytes_received}, bytes_sent={self.bytes_sent}, "
+            f"stalls={self.stalls})"
+        )
+
+
+class SimulatedMessageTarget:
+    # Plays the part of a Naomi homebrew program running the packet and message protocol
+    # from libnaomi, as seen through the peek/poke registers that netdimm/message.py drives.
+    # If a mailbox size is given, it also reserves a mailbox of that size in net dimm memory
+    # once attached to a simulator, and sends and receives packets through it instead.
+    def __init__(self, zlib_enabled: bool = True, mailbox_size: Optional[int] = None, streams_enabled: bool = True) -> None:
+        self.zlib_enabled = zlib_enabled
+        self.streams_enabled = streams_enabled
+        self.mailbox_size = mailbox_size
+        self.mailbox: Optional[Mailbox] = None
+        self.scratch1: int = 0
+        self.scratch2: int = 0
+
+        # Access to the simulated net dimm memory, for the mailbox.
+        self.__read: Optional[Callable[[int, int], bytes]] = None
+        self.__write: Optional[Callable[[int, bytes], None]] = None
+
+        # Packets waiting to be read by the host, and our position in the current one.
+        self.outbound: List[bytes] = []
+        self.outbound_location: int = 0
+
+        # Packet being written by the host, and every complete packet it has sent.
+        self.inbound_length: int = 0
+        self.inbound_data: bytearray = bytearray()
+        self.inbound: List[bytes] = []
+
+        # Message layer state, for both directions.
+        self.send_sequence: int = 1
+        self.pending: Dict[int, Dict[int, bytes]] = {}
+        self.messages: List[Tuple[int, bytes]] = []
+
+        # Stream layer state. Streams being sent are the message type, data and how much
+        # the host has acknowledged and been sent, and we track the most we ever had sent
+        # without being acknowledged.
+        self.stream_id: int = 1
+        self.incoming_streams: Dict[int, bytearray] = {}
+        self.streams: List[Tuple[int, bytes]] = []
+        self.outgoing_streams: Dict[int, Tuple[int, bytes, int, int]] = {}
+        self.max_in_flight: int = 0
+
+    @property
+    def config(self) -> int:
+        return (
+            CONFIG_MESSAGE_EXISTS |  # noqa: W504
+            (CONFIG_MESSAGE_HAS_ZLIB if self.zlib_enabled else 0) |  # noqa: W504
+            (CONFIG_MESSAGE_HAS_MAILBOX if self.mailbox is not None else 0) |  # noqa: W504
+            (CONFIG_MESSAGE_HAS_STREAMS if self.streams_enabled else 0)
+        )
+
+    def attach(self, address: int, read: Callable[[int, int], bytes], write: Callable[[int, bytes], None]) -> None:
+        # Called by the simulator to give us somewhere in memory to put our mailbox.
+        self.__read = read
+        self.__write = write
+        if self.mailbox_size:
+            self.mailbox = Mailbox(address, self.mailbox_size)
+            write(address, b"\0" * 16)
+
+    def service(self) -> None:
+        # Called by the simulator around every packet, much like the homebrew program
+        # would poll the mailbox in its main loop.
+        if self.mailbox is None or self.__read is None or self.__write is None:
+            return
+        mailbox = self.mailbox
+        to_target_head, to_target_tail, to_host_head, to_host_tail = struct.unpack("<IIII", self.__read(mailbox.address, 16))
+
+        # Pull in everything the host has finished writing.
+        while ((to_target_head - to_target_tail) & 0xFFFFFFFF) >= 2:
+            length = struct.unpack("<H", self.__ring_read(mailbox.to_target, to_target_tail, 2))[0]
+            packet = self.__ring_read(mailbox.to_target, to_target_tail + 2, length)
+            to_target_tail = (to_target_tail + length + 2) & 0xFFFFFFFF
+            self.inbound.append(packet)
+            self.__receive_message_packet(packet)
+        self.__write(mailbox.address + 0x4, struct.pack("<I", to_target_tail))
+
+        # Push out whatever we have waiting, as long as there is room for it.
+        while self.outbound and mailbox.size - ((to_host_head - to_host_tail) & 0xFFFFFFFF) >= len(self.outbound[0]) + 2:
+            packet = self.outbound.pop(0)
+            self.__ring_write(mailbox.to_host, to_host_head, struct.pack("<H", len(packet)) + packet)
+            to_host_head = (to_host_head + len(packet) + 2) & 0xFFFFFFFF
+        self.__write(mailbox.address + 0x8, struct.pack("<I", to_host_head))
+
+    def __ring_read(self, ring: int, position: int, length: int) -> bytes:
+        if self.mailbox is None or self.__read is None:
+            raise Exception("Logic error!")
+        offset = position % self.mailbox.size
+        first = min(length, self.mailbox.size - offset)
+        return self.__read(ring + offset, first) + self.__read(ring, length - first)
+
+    def __ring_write(self, ring: int, position: int, data: bytes) -> None:
+        if self.mailbox is None or self.__write is None:
+            raise Exception("Logic error!")
+        offset = position % self.mailbox.size
+        first = min(len(data), self.mailbox.size - offset)
+        self.__write(ring + offset, data[:first])
+        self.__write(ring, data[first:])
+
+    def queue_packet(self, data: bytes) -> None:
+        self.outbound.append(data)
+
+    def queue_message(self, msgid: int, data: bytes = b"") -> None:
+        # Split a message up into packets the same way libnaomi's message_send does.
+        sequence = self.send_sequence
+        self.send_sequence = (self.send_sequence + 1) & 0xFFFF
+        if self.send_sequence == 0:
+            self.send_sequence = 1
+
+        if not data:
+            self.queue_packet(struct.pack("<HHHH", msgid & 0x7FFF, sequence, 0, 0))
+            return
+        chunksize = (self.mailbox.max_packet_length - MESSAGE_HEADER_LENGTH) if self.mailbox is not None else MAX_MESSAGE_DATA_LENGTH
+        for location in range(0, len(data), chunksize):
+            chunk = data[location:(location + chunksize)]
+            self.queue_packet(struct.pack("<HHHH", msgid & 0x7FFF, sequence, len(data), location) + chunk)
+
+    def queue_stream(self, msgid: int, data: bytes) -> None:
+        stream_id = self.stream_id
+        self.stream_id = (self.stream_id + 1) & 0xFFFF or 1
+        self.outgoing_streams[stream_id] = (msgid, data, 0, 0)
+        self.__send_stream(stream_id)
+
+    def __send_stream(self, stream_id: int) -> None:
+        # Send as much as the window allows, like a program streaming out of a buffer.
+        msgid, data, acked, sent = self.outgoing_streams[stream_id]
+        while sent - acked < STREAM_WINDOW and (sent < len(data) or sent == 0):
+            chunk = data[sent:(sent + STREAM_CHUNK_LENGTH)]
+            self.queue_message(MESSAGE_STREAM_DATA, struct.pack("<HHII", msgid, stream_id, len(data), sent) + chunk)
+            sent += len(chunk)
+            if not data:
+                break
+        self.max_in_flight = max(self.max_in_flight, sent - acked)
+        if acked >= len(data):
+            del self.outgoing_streams[stream_id]
+        else:
+            self.outgoing_streams[stream_id] = (msgid, data, acked, sent)
+
+    def __receive_stream_message(self, msgid: int, data: bytes) -> bool:
+        if not self.streams_enabled:
+            return False
+        if msgid == MESSAGE_STREAM_ACK:
+            stream_id, position = struct.unpack("<HI", data[0:6])
+            if stream_id in self.outgoing_streams:
+                streamid, streamdata, acked, sent = self.outgoing_streams[stream_id]
+                self.outgoing_streams[stream_id] = (streamid, streamdata, max(acked, position), sent)
+                self.__send_stream(stream_id)
+            return True
+        if msgid == MESSAGE_STREAM_DATA:
+            streamid, stream_id, length, offset = struct.unpack("<HHII", data[0:STREAM_HEADER_LENGTH])
+            received = self.incoming_streams.setdefault(stream_id, bytearray())
+            if offset == len(received):
+                received += data[STREAM_HEADER_LENGTH:]
+            if len(received) >= length:
+                del self.incoming_streams[stream_id]
+                self.streams.append((streamid, bytes(received)))
+            if length:
+                self.queue_message(MESSAGE_STREAM_ACK, struct.pack("<HI", stream_id, len(received)))
+            return True
+        return False
+
+    def peek(self, addr: int) -> Optional[int]:
+        if addr == CONFIG_REGISTER:
+            return checksum_stamp(self.config, CONFIG_REGISTER_SEED)
+        if addr == SCRATCH1_REGISTER:
+            return self.scratch1
+        if addr == SCRATCH2_REGISTER:
+            return self.scratch2
+        if addr == MAILBOX_REGISTER:
+            return checksum_stamp(self.mailbox.to_register(), MAILBOX_REGISTER_SEED) if self.mailbox is not None else 0
+        if addr == SEND_STATUS_REGISTER:
+            length = len(self.outbound[0]) if self.outbound else 0
+            return checksum_stamp(((length & 0xFFF) << 12) | (self.outbound_location & 0xFFF), SEND_STATUS_REGISTER_SEED)
+        if addr == RECV_STATUS_REGISTER:
+            return checksum_stamp(((self.inbound_length & 0xFFF) << 12) | (len(self.inbound_data) & 0xFFF), RECV_STATUS_REGISTER_SEED)
+        if addr == DATA_REGISTER:
+            if not self.outbound or self.outbound_location >= len(self.outbound[0]):
+                return 0
+            packet = self.outbound[0]
+            location = self.outbound_location
+            chunk = (((location // 3) + 1) & 0xFF) << 24
+            for shift in [16, 8, 0]:
+                if location < len(packet):
+                    chunk |= packet[location] << shift
+                    location += 1
+            self.outbound_location = location
+            return chunk
+        return None
+
+    def poke(self, addr: int, value: int) -> bool:
+        if addr == SCRATCH1_REGISTER:
+            self.scratch1 = value
+            return True
+        if addr == SCRATCH2_REGISTER:
+            self.scratch2 = value
+            return True
+        if addr == SEND_STATUS_REGISTER:
+            location = value & 0xFFF
+            if self.outbound and location >= len(self.outbound[0]):
+                # Host acknowledged the whole packet.
+                self.outbound.pop(0)
+                self.outbound_location = 0
+            else:
+                # Host is rewinding or resuming a partial transfer.
+                self.outbound_location = location
+            return True
+        if addr == RECV_STATUS_REGISTER:
+            # Host is either starting a new transfer or cancelling one.
+            self.inbound_length = (value >> 12) & 0xFFF
+            self.inbound_data = bytearray()
+            return True
+        if addr == DATA_REGISTER:
+            if self.inbound_length == 0:
+                return True
+            location = (((value >> 24) & 0xFF) - 1) * 3
+            if location != len(self.inbound_data):
+                # Out of order, the host will see our location and resend from there.
+                return True
+            for shift in [16, 8, 0]:
+                if len(self.inbound_data) < self.inbound_length:
+                    self.inbound_data.append((value >> shift) & 0xFF)
+            if len(self.inbound_data) == self.inbound_length:
+                packet = bytes(self.inbound_data)
+                self.inbound.append(packet)
+                self.inbound_length = 0
+                self.inbound_data = bytearray()
+                self.__receive_message_packet(packet)
+            return True
+        return False
+
+    def __receive_message_packet(self, packet: bytes) -> None:
+        if len(packet) < MESSAGE_HEADER_LENGTH:
+            return
+        msgid, sequence, total_length, location = struct.unpack("<HHHH", packet[0:MESSAGE_HEADER_LENGTH])
+        chunks = self.pending.setdefault(sequence, {})
+        chunks[location] = packet[MESSAGE_HEADER_LENGTH:]
+        pieces: List[bytes] = []
+        position = 0
+        while position < total_length:
+            piece = chunks.get(position)
+            if not piece:
+                return
+            pieces.append(piece)
+            position += len(piece)
+
+        del self.pending[sequence]
+        data = b"".join(pieces)
+        if msgid & 0x8000:
+            data = zlib.decompress(data[4:])
+        if not self.__receive_stream_message(msgid & 0x7FFF, data):
+            self.messages.append((msgid & 0x7FFF, data))
+
+
+class NetDimmSimulator:
+    # System registers, all mirrored at 0x3fxxxxxx like the real net dimm.
+    CRC_STATUS_REGISTER: int = 0xfffeffe0
+    CRC_DISABLE_REGISTER: int = 0xfffefff0
+    INFORMATION_REGISTER: int = 0xffff0000
+
+    # How long TCP takes to recover from a lost segment, which is what packet loss
+    # looks like to anything above the socket layer. This is the Linux minimum RTO.
+    RETRANSMIT_DELAY: float = 0.2
+
+    PAGE_SIZE: int = 0x100000
+
+    def __init__(
+        self,
+        host: str = "127.0.0.1",
+        port: int = 0,
+        *,
+        version: NetDimmVersionEnum = NetDimmVersionEnum.VERSION_4_01,
+        memory_size: int = 512,
+        bandwidth: Optional[float] = None,
+        latency: float = 0.0,
+        packet_loss: float = 0.0,
+        message_target: Optional[SimulatedMessageTarget] = None,
+        seed: Optional[int] = None,
+    ) -> None:
+        self.host = host
+        self.version = version
+        # Size of the dimm in megabytes.
+        self.memory_size = memory_size
+        # Link characteristics. Bandwidth is in bytes per second, None for unlimited.
+        # Latency is the round trip time in seconds added to every response. Like a real
+        # link it delays responses without stopping us from handling the next request,
+        # so a host that pipelines requests pays it once. Packet loss is the chance from
+        # 0.0-1.0 that any given packet suffers a retransmit.
+        self.bandwidth = bandwidth
+        self.latency = latency
+        self.packet_loss = packet_loss
+        self.message_target = message_target or SimulatedMessageTarget()
+        self.stats = NetDimmSimulatorStats()
+
+        self.host_mode: int = 0
+        self.dimm_mode: int = 0
+        self.key: bytes = b"\0" * 8
+        self.time_limit: Optional[int] = None
+        self.restarts: int = 0
+        self.host_memory: Dict[int, int] = {}
+
+        self.__pages: Dict[int, bytearray] = {}
+        self.__registers: Dict[int, int] = {}
+        self.__crc_status: int = 0
+        self.__random = random.Random(seed)
+        self.__lock = threading.Lock()
+        self.__link_free: float = 0.0
+
+        # Anything running on the target gets the last part of memory, past where games go.
+        self.message_target.attach(max(memory_size - 16, 0) << 20, self.__read, self.__write)
+
+        self.__server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.__server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.__server.bind((host, port))
+        self.__server.listen(8)
+        self.port: int = self.__server.getsockname()[1]
+        self.__running = False
+        self.__thread: Optional[threading.Thread] = None
+        self.__connections: List[socket.socket] = []
+
+    def __repr__(self) -> str:
+        return f"NetDimmSimulator(host={repr(self.host)}, port={repr(self.port)}, version={repr(self.version)}, bandwidth={repr(self.bandwidth)}, latency={repr(self.latency)}, packet_loss={repr(self.packet_loss)})"
+
+    def __enter__(self) -> "NetDimmSimulator":
+        self.start()
+        return self
+
+    def __exit__(self, *args: object) -> None:
+        self.stop()
+
+    def start(self) -> None:
+        if self.__running:
+            return
+        self.__running = True
+        self.__thread = threading.Thread(target=self.__accept_thread)
+        self.__thread.daemon = True
+        self.__thread.start()
+
+    def stop(self) -> None:
+        self.__running = False
+        self.disconnect()
+        if self.__thread is not None:
+            self.__thread.join()
+            self.__thread = None
+        self.__server.close()
+
+    def disconnect(self) -> None:
+        # Hang up on everybody connected right now, like a net dimm that lost power.
+        with self.__lock:
+            connections = self.__connections
+            self.__connections = []
+        for conn in connections:
+            try:
+                conn.shutdown(socket.SHUT_RDWR)
+            except OSError:
+                pass
+
+    def serve_forever(self) -> None:
+        self.__running = True
+        self.__accept_thread()
+
+    # Direct access to simulated state, for setting up and checking tests.
+
+    @property
+    def crc_status(self) -> int:
+        return self.__crc_status
+
+    @crc_status.setter
+    def crc_status(self, status: int) -> None:
+        self.__crc_status = status
+
+    @property
+    def information(self) -> Tuple[int, int]:
+        crc, length = struct.unpack("<II", self.read(self.INFORMATION_REGISTER, 8))
+        return (crc, length)
+
+    def load_game(self, data: bytes, crc_status: int = 2) -> None:
+        # Place a game in memory as if it had been sent and verified.
+        self.write(0, data)
+        self.__set_information(zlib.crc32(data) ^ 0xFFFFFFFF, len(data))
+        self.__crc_status = crc_status
+
+    def read(self, addr: int, size: int) -> bytes:
+        with self.__lock:
+            return self.__read(addr, size)
+
+    def write(self, addr: int, data: bytes) -> None:
+        with self.__lock:
+            self.__write(addr, data)
+
+    def __is_system(self, addr: int) -> bool:
+        return (addr & 0x3FFFFFFF) >= 0x3FFE0000
+
+    def __read(self, addr: int, size: int) -> bytes:
+        if self.__is_system(addr):
+            addr |= 0xC0000000
+            if addr == self.CRC_STATUS_REGISTER and size == 4:
+                return struct.pack("<I", self.__crc_status)
+            return bytes(self.__registers.get(addr + i, 0) for i in range(size))
+
+        out = bytearray()
+        while size > 0:
+            page, offset = divmod(addr, self.PAGE_SIZE)
+            amount = min(size, self.PAGE_SIZE - offset)
+            if page in self.__pages:
+                out += self.__pages[page][offset:(offset + amount)]
+            else:
+                out += b"\0" * amount
+            addr += amount
+            size -= amount
+        return bytes(out)
+
+    def __write(self, addr: int, data: bytes) -> None:
+        if self.__is_system(addr):
+            addr |= 0xC0000000
+            for i, b in enumerate(data):
+                self.__registers[addr + i] = b
+            return
+
+        view = memoryview(data)
+        while view:
+            page, offset = divmod(addr, self.PAGE_SIZE)
+            amount = min(len(view), self.PAGE_SIZE - offset)
+            if page not in self.__pages:
+                self.__pages[page] = bytearray(self.PAGE_SIZE)
+            self.__pages[page][offset:(offset + amount)] = view[:amount]
+            addr += amount
+            view = view[amount:]
+
+    def __set_information(self, crc: int, length: int) -> None:
+        info = struct.pack("<III", crc & 0xFFFFFFFF, length, 0) + (b"\0" * 16)
+        info += struct.pack("<I", zlib.crc32(info) & 0xFFFFFFFF)
+        self.__write(self.INFORMATION_REGISTER, info)
+
+    def __crc_check(self) -> None:
+        # Runs on restart, much like the "CHECKING MEMORY" screen.
+        if self.__read(self.CRC_DISABLE_REGISTER, 8) == b"\xff" * 8:
+            self.__crc_status = 5
+            return
+        crc, length = struct.unpack("<II", self.__read(self.INFORMATION_REGISTER, 8))
+        if length == 0:
+            self.__crc_status = 3
+            return
+        actual = 0
+        for addr in range(0, length, self.PAGE_SIZE):
+            actual = zlib.crc32(self.__read(addr, min(self.PAGE_SIZE, length - addr)), actual)
+        self.__crc_status = 2 if (actual ^ 0xFFFFFFFF) == crc else 3
+
+    def __version_word(self) -> int:
+        if self.version == NetDimmVersionEnum.VERSION_UNKNOWN:
+            return 0
+        high, low = self.version.value.split(".")
+        return (int(high, 16) << 8) | int(low, 16)
+
+    # Network handling, including simulated link conditions.
+
+    def __accept_thread(self) -> None:
+        # Wake up periodically so that stop() doesn't have to rely on closing the
+        # listening socket interrupting accept(), which it doesn't on every OS.
+        self.__server.settimeout(0.1)
+        while self.__running:
+            try:
+                conn, _ = self.__server.accept()
+            except socket.timeout:
+                continue
+            except OSError:
+                return
+            conn.settimeout(None)
+            conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            with self.__lock:
+                self.stats.connections += 1
+                self.__connections.append(conn)
+            # The real firmware services one connection at a time, so a new connection
+            # only gets looked at once everything sent on the previous one is handled.
+            self.__serve_connection(conn)
+
+    def __serve_connection(self, conn: socket.socket) -> None:
+        # Responses go out on their own thread once their latency has passed, so that
+        # requests which arrive back to back are handled back to back as well.
+        outbound: "queue.Queue[Optional[Tuple[float, List[Tuple[int, int, bytes]]]]]" = queue.Queue()
+        responder = threading.Thread(target=self.__respond_thread, args=(conn, outbound))
+        responder.daemon = True
+        responder.start()
+
+        try:
+            while self.__running:
+                header = self.__recv(conn, 4)
+                if header is None:
+                    return
+                headerbytes = struct.unpack("<I", header)[0]
+                pktid = (headerbytes >> 24) & 0xFF
+                flags = (headerbytes >> 16) & 0xFF
+                length = headerbytes & 0xFFFF
+                data = b""
+                if length > 0:
+                    maybe = self.__recv(conn, length)
+                    if maybe is None:
+                        return
+                    data = maybe
+
+                self.__link(4 + length)
+                with self.__lock:
+                    self.stats.packets_received[pktid] = self.stats.packets_received.get(pktid, 0) + 1
+                    self.stats.bytes_received += 4 + length
+                    responses = self.__handle(pktid, flags, data)
+                if pktid == 0x09:
+                    return
+
+                if responses:
+                    outbound.put((time.time() + self.latency, responses))
+        except OSError:
+            pass
+        finally:
+            # Let anything we already answered go out before hanging up.
+            outbound.put(None)
+            responder.join()
+            with self.__lock:
+                if conn in self.__connections:
+                    self.__connections.remove(conn)
+            conn.close()
+
+    def __respond_thread(self, conn: socket.socket, outbound: "queue.Queue[Optional[Tuple[float, List[Tuple[int, int, bytes]]]]]") -> None:
+        while True:
+            entry = outbound.get()
+            if entry is None:
+                return
+            due, responses = entry
+            delay = due - time.time()
+            if delay > 0.0:
+                time.sleep(delay)
+            try:
+                for rpktid, rflags, rdata in responses:
+                    self.__link(4 + len(rdata))
+                    conn.sendall(struct.pack("<I", (rpktid << 24) | (rflags << 16) | len(rdata)) + rdata)
+                    with self.__lock:
+                        self.stats.packets_sent += 1
+                        self.stats.bytes_sent += 4 + len(rdata)
+            except OSError:
+                # The host went away, so drain whatever is left without sending it.
+                pass
+
+    def __recv(self, conn: socket.socket, length: int) -> Optional[bytes]:
+        data = bytearray(length)
+        view = memoryview(data)
+        got = 0
+        while got < length:
+            amount = conn.recv_into(view[got:], length - got)
+            if amount == 0:
+                return None
+            got += amount
+        return bytes(data)
+
+    def __link(self, nbytes: int) -> None:
+        # Pace traffic to the configured bandwidth, and occasionally stall for a
+        # retransmit to simulate packet loss.
+        delay = 0.0
+        with self.__lock:
+            now = time.time()
+            if self.bandwidth:
+                self.__link_free = max(self.__link_free, now) + (nbytes / self.bandwidth)
+                delay = self.__link_free - now
+            if self.packet_loss > 0.0 and self.__random.random() < self.packet_loss:
+                self.stats.stalls += 1
+                delay += self.RETRANSMIT_DELAY
+        if delay > 0.0:
+            time.sleep(delay)
+
+    def __handle(self, pktid: int, flags: int, data: bytes) -> List[Tuple[int, int, bytes]]:
+        # Give the target a chance to look at its mailbox on both sides of every packet.
+        self.message_target.service()
+        try:
+            return self.__handle_packet(pktid, flags, data)
+        finally:
+            self.message_target.service()
+
+    def __handle_packet(self, pktid: int, flags: int, data: bytes) -> List[Tuple[int, int, bytes]]:
+        if pktid == 0x01:
+            # Startup NOP.
+            return []
+        if pktid == 0x04:
+            # Upload to dimm memory or system registers.
+            if len(data) > 10:
+                _sequence, addr, _ = struct.unpack("<IIH", data[0:10])
+                self.__write(addr, data[10:])
+            return []
+        if pktid == 0x05:
+            # Download, returned in 8KiB upload packets like firmware 3.17 does.
+            addr, size = struct.unpack("<II", data[0:8])
+            payload = self.__read(addr, size)
+            responses: List[Tuple[int, int, bytes]] = []
+            for sequence, offset in enumerate(range(0, max(len(payload), 1), 0x2000)):
+                chunk = payload[offset:(offset + 0x2000)]
+                last = (offset + 0x2000) >= len(payload)
+                responses.append((0x04, 0x81 if last else 0x80, struct.pack("<IIH", sequence + 1, addr + offset, 0) + chunk))
+            return responses
+        if pktid in {0x07, 0x08}:
+            # Exchange host or dimm mode.
+            request = struct.unpack("<I", data[0:4])[0]
+            mask, setbits = (request >> 8) & 0xFF, request & 0xFF
+            if pktid == 0x07:
+                self.host_mode = (self.host_mode & mask) | setbits
+                mode = self.host_mode
+            else:
+                self.dimm_mode = (self.dimm_mode & mask) | setbits
+                mode = self.dimm_mode
+            return [(pktid, 0x00, struct.pack("<I", mode))]
+        if pktid == 0x0A:
+            # Restart the host, which kicks off a CRC check of the game.
+            self.restarts += 1
+            self.host_mode = 0
+            self.__crc_check()
+            return []
+        if pktid == 0x10:
+            # Peek host memory.
+            addr, typ = struct.unpack("<II", data[0:8])
+            return [(0x10, 0x00, struct.pack("<II", 1, self.__peek(addr, typ)))]
+        if pktid == 0x11:
+            # Poke host memory.
+            addr, typ, value = struct.unpack("<III", data[0:12])
+            self.__poke(addr, typ, value)
+            return []
+        if pktid == 0x16:
+            # Host control read, which reuses the peek response ID.
+            return [(0x10, 0x00, struct.pack("<II", 1, 0x8C000000))]
+        if pktid == 0x17:
+            self.time_limit = struct.unpack("<I", data[0:4])[0]
+            return []
+        if pktid == 0x18:
+            crc = struct.unpack("<I", self.__read(self.INFORMATION_REGISTER, 4))[0]
+            game_memory = max(self.memory_size - 32, 0)
+            return [(0x18, 0x00, struct.pack("<HHHHI", 0xC, self.__version_word(), game_memory, self.memory_size, crc))]
+        if pktid == 0x19:
+            crc, length = struct.unpack("<II", data[0:8])
+            self.__set_information(crc, length)
+            return []
+        if pktid == 0x7F:
+            self.key = data[0:8]
+            return []
+        # Unknown packets are ignored, much like the real firmware.
+        return []
+
+    def __peek(self, addr: int, typ: int) -> int:
+        value = self.message_target.peek(addr)
+        if value is not None:
+            return value
+        size = {1: 1, 2: 2, 3: 4}.get(typ, 4)
+        return sum(self.host_memory.get(addr + i, 0) << (8 * i) for i in range(size))
+
+    def __poke(self, addr: int, typ: int, value: int) -> None:
+        if self.message_target.poke(addr, value):
+            return
+        size = {1: 1, 2: 2, 3: 4}.get(typ, 4)
+        for i in range(size):
+            self.host_memory[addr + i] = (value >> (8 * i)) & 0xFF
@@ -4,7 +4,7 @@ import os
 import sys
 
 from arcadeutils import FileBytes
-from netdimm import NetDimm, NetDimmException, Message, send_message, receive_message, MESSAGE_HOST_STDOUT, MESSAGE_HOST_STDERR
+from netdimm import NetDimm, NetDimmException, Message, MessageChannel, MessagePoller, MESSAGE_HOST_STDOUT, MESSAGE_HOST_STDERR
 
 
 # The root of the repo.
@@ -104,14 +104,16 @@ def main() -> int:
                 return 1
 
         try:
+            channel = MessageChannel(netdimm)
+            poller = MessagePoller(channel)
             with netdimm.connection():
                 while True:
-                    msg = receive_message(netdimm, verbose=verbose)
+                    msg = poller.poll(verbose=verbose)
                     if not msg:
                         continue
                     if msg.id == MESSAGE_READY:
                         print("Dumping SRAM...")
-                        send_message(netdimm, Message(MESSAGE_SRAM_READ_REQUEST), verbose=verbose)
+                        channel.send(Message(MESSAGE_SRAM_READ_REQUEST), verbose=verbose)
                     elif msg.id == MESSAGE_SRAM_READ:
                         if len(msg.data) != 0x8000:
                             print("Got wrong size for SRAM!")
@@ -120,7 +122,7 @@ def main() -> int:
                             with open(args.sram, "wb") as fp:
                                 fp.write(msg.data)
                             print(f"Wrote SRAM from Naomi to '{args.sram}'.")
-                            send_message(netdimm, Message(MESSAGE_DONE), verbose=verbose)
+                            channel.send(Message(MESSAGE_DONE), verbose=verbose)
                             break
                     elif msg.id == MESSAGE_HOST_STDOUT:
                         print(msg.data.decode('utf-8'), end="")
@@ -151,19 +153,21 @@ def main() -> int:
                 return 1
 
         try:
+            channel = MessageChannel(netdimm)
+            poller = MessagePoller(channel)
             with netdimm.connection():
                 while True:
-                    msg = receive_message(netdimm, verbose=verbose)
+                    msg = poller.poll(verbose=verbose)
                     if not msg:
                         continue
                     if msg.id == MESSAGE_READY:
-                        send_message(netdimm, Message(MESSAGE_SRAM_WRITE_REQUEST), verbose=verbose)
+                        channel.send(Message(MESSAGE_SRAM_WRITE_REQUEST), verbose=verbose)
 
                         print("Restoring SRAM...")
                         with open(args.sram, "rb") as fp:
                             data = fp.read()
-                        send_message(netdimm, Message(MESSAGE_SRAM_WRITE, data), verbose=verbose)
-                        send_message(netdimm, Message(MESSAGE_DONE), verbose=verbose)
+                        channel.send(Message(MESSAGE_SRAM_WRITE, data), verbose=verbose)
+                        channel.send(Message(MESSAGE_DONE), verbose=verbose)
                         break
                     elif msg.id == MESSAGE_HOST_STDOUT:
                         print(msg.data.decode('utf-8'), end="")
@@ -1,9 +1,7 @@
 #!/usr/bin/env python3
 import argparse
 import os
-import platform
 import struct
-import subprocess
 import sys
 import time
 import yaml
@@ -12,8 +10,8 @@ from typing import Dict, List, Optional, Set, Tuple
 from arcadeutils import FileBytes, BinaryDiff
 from naomi import NaomiRom, NaomiRomRegionEnum, NaomiSettingsPatcher, get_default_trojan, add_or_update_section
 from naomi.settings import NaomiSettingsManager, NaomiSettingsWrapper, get_default_settings_directory, Setting, ReadOnlyCondition
-from netdimm import NetDimm, NetDimmException, Message, send_message, receive_message, write_scratch1_register, MESSAGE_HOST_STDOUT, MESSAGE_HOST_STDERR
-from netboot import PatchManager
+from netdimm import NetDimm, NetDimmException, OverlayImage, Message, MessageChannel, MessagePoller, write_scratch1_register, MESSAGE_HOST_STDOUT, MESSAGE_HOST_STDERR
+from netboot import LivenessProber, PatchManager
 
 
 # The root of the repo.
@@ -377,7 +375,7 @@ def main() -> int:
         # Now, load up the menu ROM and append the settings to it.
         if success:
             with open(args.exe, "rb") as fp:
-                menudata = add_or_update_section(FileBytes(fp), 0x0D000000, config, verbose=verbose)
+                menudata = add_or_update_section(OverlayImage(fp), 0x0D000000, config, verbose=verbose)
 
                 try:
                     # Now, connect to the net dimm, send the menu and then start communicating with it.
@@ -409,9 +407,11 @@ def main() -> int:
             try:
                 # Always show game send progress.
                 netdimm = NetDimm(args.ip, log=print)
+                channel = MessageChannel(netdimm)
+                poller = MessagePoller(channel)
                 with netdimm.connection():
                     while True:
-                        msg = receive_message(netdimm, verbose=verbose)
+                        msg = poller.poll(verbose=verbose)
                         if msg:
                             if msg.id == MESSAGE_SELECTION:
                                 index = struct.unpack("<I", msg.data)[0]
@@ -436,7 +436,7 @@ def main() -> int:
 
                                 # First, grab a handle to the data itself.
                                 fp = open(filename, "rb")
-                                gamedata = FileBytes(fp)
+                                gamedata: FileBytes = OverlayImage(fp)
                                 gamesettings = settings.game_settings.get(filename, GameSettings.default())
 
                                 # Now, patch with selected patches.
@@ -466,15 +466,17 @@ def main() -> int:
                                         print(f"Could not apply EEPROM settings to {filename}: {str(e)}", file=sys.stderr)
 
                                 # Finally, send it!
-                                send_message(netdimm, Message(MESSAGE_LOAD_PROGRESS, struct.pack("<ii", len(gamedata), 0)), verbose=verbose)
+                                channel.send(Message(MESSAGE_LOAD_PROGRESS, struct.pack("<ii", len(gamedata), 0)), verbose=verbose)
                                 selected_file = gamedata
+                                if verbose:
+                                    print(f"Message polling stats: {poller.stats}")
                                 break
 
                             elif msg.id == MESSAGE_LOAD_SETTINGS:
                                 index = struct.unpack("<I", msg.data)[0]
                                 filename = games[index][0]
                                 print(f"Requested settings for {games[index][1]}...")
-                                send_message(netdimm, Message(MESSAGE_LOAD_SETTINGS_ACK, msg.data), verbose=verbose)
+                                channel.send(Message(MESSAGE_LOAD_SETTINGS_ACK, msg.data), verbose=verbose)
 
                                 # Grab the configured settings for this game.
                                 gamesettings = settings.game_settings.get(filename, GameSettings.default())
@@ -568,7 +570,7 @@ def main() -> int:
                                     response += struct.pack("<BBB", 0, 0, 0)
 
                                 # Send settings over.
-                                send_message(netdimm, Message(MESSAGE_LOAD_SETTINGS_DATA, response), verbose=verbose)
+                                channel.send(Message(MESSAGE_LOAD_SETTINGS_DATA, response), verbose=verbose)
 
                             elif msg.id == MESSAGE_SAVE_SETTINGS_DATA:
                                 index, patchlen = struct.unpack("<IB", msg.data[0:5])
@@ -632,7 +634,7 @@ def main() -> int:
                                     # Save the final updates.
                                     settings.game_settings[filename] = gamesettings
                                     settings_save(args.menu_settings_file, args.ip, settings)
-                                send_message(netdimm, Message(MESSAGE_SAVE_SETTINGS_ACK), verbose=verbose)
+                                channel.send(Message(MESSAGE_SAVE_SETTINGS_ACK), verbose=verbose)
 
                             elif msg.id == MESSAGE_SAVE_CONFIG:
                                 if len(msg.data) == SETTINGS_SIZE:
@@ -660,7 +662,7 @@ def main() -> int:
                                     settings.joy2_calibration = joy2
                                     settings_save(args.menu_settings_file, args.ip, settings)
 
-                                    send_message(netdimm, Message(MESSAGE_SAVE_CONFIG_ACK), verbose=verbose)
+                                    channel.send(Message(MESSAGE_SAVE_CONFIG_ACK), verbose=verbose)
                             elif msg.id == MESSAGE_HOST_STDOUT:
                                 print(msg.data.decode('utf-8'), end="")
                             elif msg.id == MESSAGE_HOST_STDERR:
@@ -717,20 +719,11 @@ def main() -> int:
                 # Wait for cabinet to disappear again before we start the process over.
                 print("Waiting for cabinet to be power cycled to resend menu...")
                 failure_count: int = 0
-                on_windows: bool = platform.system() == "Windows"
+                prober = LivenessProber()
 
                 while True:
-                    # Constantly ping the net dimm to see if it is still alive.
-                    with open(os.devnull, 'w') as DEVNULL:
-                        try:
-                            if on_windows:
-                                call = ["ping", "-n", "1", "-w", "1", args.ip]
-                            else:
-                                call = ["ping", "-c1", "-W1", args.ip]
-                            subprocess.check_call(call, stdout=DEVNULL, stderr=DEVNULL)
-                            alive = True
-                        except subprocess.CalledProcessError:
-                            alive = False
+                    # Constantly probe the net dimm to see if it is still alive.
+                    alive = prober.probe([args.ip])[args.ip] is not None
 
                     # We start with the understanding that the host is up, but if we
                     # miss a ping its not that big of a deal. We just want to know that
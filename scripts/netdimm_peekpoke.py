@@ -2,7 +2,6 @@
 # Triforce Netfirm Toolbox, put into the public domain.
 # Please attribute properly, but only if you want.
 import argparse
-import struct
 import sys
 
 from netdimm import NetDimm, PeekPokeTypeEnum
@@ -97,6 +96,11 @@ def main() -> int:
         type=int,
         help="The size in bytes you want to read.",
     )
+    dump_parser.add_argument(
+        "--dimm",
+        action="store_true",
+        help="Treat the address as an offset into net dimm memory instead of host memory, which is much faster to read.",
+    )
 
     load_parser = subparsers.add_parser(
         'load',
@@ -121,6 +125,11 @@ def main() -> int:
         type=str,
         help="The hex address of memory that you would like to load to.",
     )
+    load_parser.add_argument(
+        "--dimm",
+        action="store_true",
+        help="Treat the address as an offset into net dimm memory instead of host memory, which is much faster to write.",
+    )
 
     args = parser.parse_args()
     netdimm = NetDimm(args.ip)
@@ -151,17 +160,29 @@ def main() -> int:
             raise Exception(f"Invalid size selection {args.size}!")
 
     elif args.action == "dump":
+        # Net dimm memory can be read in big blocks, host memory has to be peeked at but
+        # we can at least do that a long at a time with lots of requests in flight.
+        if args.dimm:
+            payload = netdimm.receive_chunk(int(args.address, 16), args.size)
+        else:
+            payload = netdimm.peek_bytes(int(args.address, 16), args.size)
         with open(args.file, "wb") as bfp:
-            for i in range(args.size):
-                data = netdimm.peek(int(args.address, 16) + i, PeekPokeTypeEnum.TYPE_BYTE) & 0xFF
-                bfp.write(struct.pack("B", data))
+            bfp.write(payload)
         print(f"Dumped {args.size} bytes to {args.file}")
 
     elif args.action == "load":
         with open(args.file, "rb") as bfp:
-            for amount, b in enumerate(bfp.read()):
-                netdimm.poke(int(args.address, 16) + amount, PeekPokeTypeEnum.TYPE_BYTE, b)
-        print(f"Loaded {amount} bytes from {args.file}")
+            payload = bfp.read()
+        with netdimm.connection():
+            if args.dimm:
+                netdimm.send_chunk(int(args.address, 16), payload)
+            else:
+                netdimm.poke_bytes(int(args.address, 16), payload)
+
+            # Neither of these get a response, so make sure everything landed before we
+            # hang up on the net dimm.
+            netdimm.info()
+        print(f"Loaded {len(payload)} bytes from {args.file}")
 
     return 0
 
@@ -79,13 +79,8 @@ def main() -> int:
     print("receiving...", file=sys.stderr)
     netdimm = NetDimm(args.ip, version=args.version, target=args.target, timeout=args.receive_timeout)
 
-    # Receive the binary.
-    data = netdimm.receive()
-
-    if data:
-        with open(args.image, "wb") as fp:
-            fp.write(data)
-
+    # Receive the binary, streaming it straight to disk.
+    if netdimm.receive_to_file(args.image):
         print("ok!", file=sys.stderr)
     else:
         print("no valid game exists on net dimm!", file=sys.stderr)
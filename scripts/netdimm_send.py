@@ -5,8 +5,8 @@ import argparse
 import enum
 import sys
 import time
-from arcadeutils import FileBytes, BinaryDiff
-from netdimm import NetDimm, NetDimmVersionEnum, NetDimmTargetEnum
+from arcadeutils import BinaryDiff
+from netdimm import NetDimm, NetDimmVersionEnum, NetDimmTargetEnum, OverlayImage
 from naomi import NaomiSettingsPatcher, get_default_trojan as get_default_naomi_trojan
 from typing import Any, Optional
 
@@ -141,7 +141,7 @@ def main() -> int:
 
     # Grab the binary, patch it with requested patches.
     with open(args.image, "rb") as fp:
-        data = FileBytes(fp)
+        data = OverlayImage(fp)
         for patch in args.patch_file or []:
             with open(patch, "r") as pp:
                 differences = pp.readlines()
@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+# Triforce Netfirm Toolbox, put into the public domain.
+# Please attribute properly, but only if you want.
+import argparse
+import enum
+import sys
+from netdimm import NetDimmVersionEnum
+from netdimm.simulator import NetDimmSimulator, SimulatedMessageTarget
+from typing import Any
+
+
+class EnumAction(argparse.Action):
+    """
+    Argparse action for handling Enums
+    """
+    def __init__(self, **kwargs: Any):
+        # Pop off the type value
+        enum_type = kwargs.pop("type", None)
+
+        # Ensure an Enum subclass is provided
+        if enum_type is None:
+            raise ValueError("type must be assigned an Enum when using EnumAction")
+        if not issubclass(enum_type, enum.Enum):
+            raise TypeError("type must be an Enum when using EnumAction")
+
+        # Generate choices from the Enum
+        kwargs.setdefault("choices", tuple(e.value for e in enum_type))
+
+        super(EnumAction, self).__init__(**kwargs)
+
+        self._enum = enum_type
+
+    def __call__(self, parser: Any, namespace: Any, values: Any, option_string: Any = None) -> None:
+        # Convert value back into an Enum
+        value = self._enum(values)
+        setattr(namespace, self.dest, value)
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description="Simulate a NetDimm on the local machine for testing and benchmarking.")
+    parser.add_argument(
+        "--ip",
+        metavar="IP",
+        type=str,
+        default="127.0.0.1",
+        help="The IP address to listen on. Defaults to 127.0.0.1.",
+    )
+    parser.add_argument(
+        "--port",
+        metavar="PORT",
+        type=int,
+        default=10703,
+        help="The port to listen on. Defaults to 10703, the port a real NetDimm uses.",
+    )
+    parser.add_argument(
+        "--version",
+        metavar="VERSION",
+        type=NetDimmVersionEnum,
+        action=EnumAction,
+        default=NetDimmVersionEnum.VERSION_4_01,
+        help="NetDimm firmware version to report. Defaults to '4.01'. Choose from '1.02', '2.06', '2.17', '3.03', '3.17', '4.01' or '4.02'.",
+    )
+    parser.add_argument(
+        "--memory-size",
+        metavar="MB",
+        type=int,
+        default=512,
+        help="Size of the simulated DIMM in megabytes. Defaults to 512.",
+    )
+    parser.add_argument(
+        "--bandwidth",
+        metavar="BYTES",
+        type=float,
+        default=None,
+        help="Limit the simulated link to this many bytes per second. Defaults to unlimited.",
+    )
+    parser.add_argument(
+        "--latency",
+        metavar="SECONDS",
+        type=float,
+        default=0.0,
+        help="Round trip latency in seconds to add to every response. Defaults to 0.",
+    )
+    parser.add_argument(
+        "--packet-loss",
+        metavar="CHANCE",
+        type=float,
+        default=0.0,
+        help="Chance from 0.0 to 1.0 that a packet needs to be retransmitted. Defaults to 0.",
+    )
+    parser.add_argument(
+        "--no-zlib",
+        action="store_true",
+        help="Do not advertise zlib support in the simulated message protocol.",
+    )
+
+    args = parser.parse_args()
+
+    simulator = NetDimmSimulator(
+        args.ip,
+        args.port,
+        version=args.version,
+        memory_size=args.memory_size,
+        bandwidth=args.bandwidth,
+        latency=args.latency,
+        packet_loss=args.packet_loss,
+        message_target=SimulatedMessageTarget(zlib_enabled=not args.no_zlib),
+    )
+    print(f"Simulating a NetDimm on {args.ip}:{simulator.port}...", file=sys.stderr)
+
+    try:
+        simulator.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+    print(simulator.stats, file=sys.stderr)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
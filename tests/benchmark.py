@@ -0,0 +1,394 @@
+#!/usr/bin/env python3
+# Transfer benchmarks for the netdimm module, run against the local simulator so that
+# results are comparable between releases without needing a cabinet. Run with
+# "python3 -m tests.benchmark --help" from the root of the repository for options.
+import argparse
+import json
+import math
+import os
+import platform
+import socket
+import statistics
+import sys
+import time
+import tracemalloc
+from typing import Any, Callable, Dict, List, Optional, Sequence
+
+from netdimm import NetDimm, Message, PeekPokeTypeEnum, send_message, receive_message, MAX_PACKET_LENGTH
+from netdimm.message import PacketAssembler
+from netdimm.simulator import NetDimmSimulator, SimulatedMessageTarget
+
+
+class PacketTimingSocket:
+    # Wraps the socket that a NetDimm instance talks over and records a timestamp each
+    # time a packet goes out or a packet header comes back. The netdimm module writes
+    # every packet with a single sendmsg or sendall call and reads every response header
+    # with a single 4 byte read, so these line up with packets on the wire.
+    def __init__(self, sock: socket.socket) -> None:
+        self.sock = sock
+        self.events: List[float] = []
+
+    def sendmsg(self, buffers: Sequence[Any]) -> int:
+        sent = self.sock.sendmsg(buffers)
+        self.events.append(time.perf_counter())
+        return sent
+
+    def sendall(self, data: Any) -> None:
+        self.sock.sendall(data)
+        self.events.append(time.perf_counter())
+
+    def recv_into(self, buffer: Any, nbytes: int = 0) -> int:
+        received = self.sock.recv_into(buffer, nbytes)
+        if nbytes == 4:
+            self.events.append(time.perf_counter())
+        return received
+
+    def __getattr__(self, name: str) -> Any:
+        return getattr(self.sock, name)
+
+
+class BenchmarkCase:
+    def __init__(
+        self,
+        name: str,
+        size: int,
+        latency: float,
+        setup: Callable[[NetDimmSimulator], None],
+        run: Callable[[NetDimm], int],
+        mailbox_size: Optional[int] = None,
+    ) -> None:
+        # The size is the payload size for transfers, or the number of operations for
+        # peek and poke. The run function returns the number of payload bytes moved.
+        # Message benchmarks go over a mailbox of the given size if there is one.
+        self.name = name
+        self.size = size
+        self.latency = latency
+        self.setup = setup
+        self.run = run
+        self.mailbox_size = mailbox_size
+
+
+def percentile(samples: List[float], pct: float) -> float:
+    if not samples:
+        return 0.0
+    # Nearest-rank percentile, so the result is always a sample we actually saw.
+    ordered = sorted(samples)
+    rank = int(math.ceil((pct / 100.0) * len(ordered)))
+    return ordered[min(len(ordered), max(rank, 1)) - 1]
+
+
+def run_case(case: BenchmarkCase, repeat: int) -> Dict[str, Any]:
+    durations: List[float] = []
+    intervals: List[float] = []
+    moved: int = 0
+    peak: int = 0
+
+    # Do the timed runs first, then one more with allocation tracking turned on since
+    # tracemalloc slows everything down. The simulator runs in this process too, so its
+    # per-packet buffers are included in the peak but memory set up beforehand isn't.
+    for attempt in range(repeat + 1):
+        traced = attempt == repeat
+        with NetDimmSimulator(latency=case.latency, message_target=SimulatedMessageTarget(mailbox_size=case.mailbox_size)) as dimm:
+            case.setup(dimm)
+            netdimm = NetDimm("127.0.0.1", port=dimm.port, timeout=10)
+            with netdimm.connection():
+                timing = PacketTimingSocket(netdimm.sock)  # type: ignore
+                netdimm.sock = timing  # type: ignore
+
+                if traced:
+                    tracemalloc.start()
+                start = time.perf_counter()
+                moved = case.run(netdimm)
+                elapsed = time.perf_counter() - start
+                if traced:
+                    peak = tracemalloc.get_traced_memory()[1]
+                    tracemalloc.stop()
+
+                netdimm.sock = timing.sock
+
+        if not traced:
+            durations.append(elapsed)
+            intervals.extend(b - a for a, b in zip(timing.events, timing.events[1:]))
+
+    duration = statistics.median(durations)
+    return {
+        "name": case.name,
+        "size": case.size,
+        "latency_ms": case.latency * 1000.0,
+        "runs": repeat,
+        "seconds": duration,
+        "bytes": moved,
+        "throughput_mbps": (float(moved) / duration / 1024.0 / 1024.0) if duration > 0.0 else 0.0,
+        "packets": len(intervals) // max(repeat, 1) + 1,
+        "packet_latency_p50_ms": percentile(intervals, 50.0) * 1000.0,
+        "packet_latency_p99_ms": percentile(intervals, 99.0) * 1000.0,
+        "peak_memory_bytes": peak,
+    }
+
+
+def run_reassembly(name: str, packets: int, repeat: int) -> Dict[str, Any]:
+    # Measures the CPU cost of putting packets read out of the data register back together,
+    # with no networking involved, since on slow hosts such as a Raspberry Pi this is what
+    # limits message throughput once the round trips are pipelined away. The resume variant
+    # loses every tenth chunk on the first pass and has to go back for them.
+    data = os.urandom(MAX_PACKET_LENGTH)
+    words = [
+        ((index + 1) << 24) | int.from_bytes(data[(index * 3):((index * 3) + 3)].ljust(3, b"\0"), "big")
+        for index in range((len(data) + 2) // 3)
+    ]
+    first = [word for index, word in enumerate(words) if name != "reassemble_packet_resume" or index % 10 != 5]
+
+    timings: List[float] = []
+    for _ in range(repeat):
+        start = time.process_time()
+        for _ in range(packets):
+            assembler = PacketAssembler(len(data))
+            for word in first:
+                assembler.add(word)
+            while not assembler.complete:
+                resume = assembler.resume_point // 3
+                for word in words[resume:(resume + 1)]:
+                    assembler.add(word)
+            if assembler.data != data:
+                raise Exception("Reassembled packet does not match!")
+        timings.append(time.process_time() - start)
+
+    return {
+        "name": name,
+        "packet_length": len(data),
+        "packets": packets,
+        "runs": repeat,
+        "cpu_us_per_packet": statistics.median(timings) / packets * 1000000.0,
+    }
+
+
+def build_cases(
+    transfer_sizes: List[int],
+    chunk_sizes: List[int],
+    message_sizes: List[int],
+    operations: int,
+    latencies: List[float],
+) -> List[BenchmarkCase]:
+    cases: List[BenchmarkCase] = []
+
+    def nothing(dimm: NetDimmSimulator) -> None:
+        pass
+
+    for latency in latencies:
+        for size in transfer_sizes:
+            data = os.urandom(size)
+
+            def prefault(dimm: NetDimmSimulator, size: int = size) -> None:
+                # Touch the simulated memory so page allocation isn't part of the peak.
+                dimm.write(0, b"\0" * size)
+
+            def send(netdimm: NetDimm, data: bytes = data) -> int:
+                netdimm.send(data, disable_now_loading=True)
+                return len(data)
+
+            def load(dimm: NetDimmSimulator, data: bytes = data) -> None:
+                dimm.load_game(data)
+
+            def receive(netdimm: NetDimm) -> int:
+                return len(netdimm.receive() or b"")
+
+            cases.append(BenchmarkCase("send", size, latency, prefault, send))
+            cases.append(BenchmarkCase("receive", size, latency, load, receive))
+
+        for size in chunk_sizes:
+            data = os.urandom(size)
+
+            def send_chunk(netdimm: NetDimm, data: bytes = data) -> int:
+                netdimm.send_chunk(0, data)
+                # Chunk sends have no response, so round trip to know they landed.
+                netdimm.info()
+                return len(data)
+
+            def receive_chunk(netdimm: NetDimm, size: int = size) -> int:
+                return len(netdimm.receive_chunk(0, size))
+
+            def prefault(dimm: NetDimmSimulator, size: int = size) -> None:
+                dimm.write(0, b"\0" * size)
+
+            cases.append(BenchmarkCase("send_chunk", size, latency, prefault, send_chunk))
+            cases.append(BenchmarkCase("receive_chunk", size, latency, nothing, receive_chunk))
+
+        def peek(netdimm: NetDimm) -> int:
+            for i in range(operations):
+                netdimm.peek(0xc000000 + (i * 4), PeekPokeTypeEnum.TYPE_LONG)
+            return operations * 4
+
+        def poke(netdimm: NetDimm) -> int:
+            for i in range(operations):
+                netdimm.poke(0xc000000 + (i * 4), PeekPokeTypeEnum.TYPE_LONG, i)
+            # Pokes have no response, so round trip to know they landed.
+            netdimm.peek(0xc000000, PeekPokeTypeEnum.TYPE_LONG)
+            return operations * 4
+
+        def peek_many(netdimm: NetDimm) -> int:
+            netdimm.peek_many([0xc000000 + (i * 4) for i in range(operations)], PeekPokeTypeEnum.TYPE_LONG)
+            return operations * 4
+
+        def poke_many(netdimm: NetDimm) -> int:
+            netdimm.poke_many([(0xc000000 + (i * 4), i) for i in range(operations)], PeekPokeTypeEnum.TYPE_LONG)
+            netdimm.peek(0xc000000, PeekPokeTypeEnum.TYPE_LONG)
+            return operations * 4
+
+        def dump_bytewise(netdimm: NetDimm) -> int:
+            # How netdimm_peekpoke used to dump host memory, to compare against below.
+            for i in range(operations * 4):
+                netdimm.peek(0xc000001 + i, PeekPokeTypeEnum.TYPE_BYTE)
+            return operations * 4
+
+        def dump(netdimm: NetDimm) -> int:
+            return len(netdimm.peek_bytes(0xc000001, operations * 4))
+
+        def load_bytewise(netdimm: NetDimm) -> int:
+            for i in range(operations * 4):
+                netdimm.poke(0xc000001 + i, PeekPokeTypeEnum.TYPE_BYTE, i & 0xFF)
+            netdimm.peek(0xc000000, PeekPokeTypeEnum.TYPE_LONG)
+            return operations * 4
+
+        def load_bytes(netdimm: NetDimm) -> int:
+            netdimm.poke_bytes(0xc000001, bytes(i & 0xFF for i in range(operations * 4)))
+            netdimm.peek(0xc000000, PeekPokeTypeEnum.TYPE_LONG)
+            return operations * 4
+
+        cases.append(BenchmarkCase("peek", operations, latency, nothing, peek))
+        cases.append(BenchmarkCase("poke", operations, latency, nothing, poke))
+        cases.append(BenchmarkCase("peek_many", operations, latency, nothing, peek_many))
+        cases.append(BenchmarkCase("poke_many", operations, latency, nothing, poke_many))
+        cases.append(BenchmarkCase("dump_bytewise", operations * 4, latency, nothing, dump_bytewise))
+        cases.append(BenchmarkCase("dump", operations * 4, latency, nothing, dump))
+        cases.append(BenchmarkCase("load_bytewise", operations * 4, latency, nothing, load_bytewise))
+        cases.append(BenchmarkCase("load", operations * 4, latency, nothing, load_bytes))
+
+        for size in message_sizes:
+            # Random data so that compression doesn't make larger messages look cheap.
+            data = os.urandom(size)
+
+            def message_send(netdimm: NetDimm, data: bytes = data) -> int:
+                send_message(netdimm, Message(0x1234, data))
+                return len(data)
+
+            def message_queue(dimm: NetDimmSimulator, data: bytes = data) -> None:
+                dimm.message_target.queue_message(0x1234, data)
+
+            def message_receive(netdimm: NetDimm) -> int:
+                message = receive_message(netdimm)
+                if message is None:
+                    raise Exception("Message did not arrive!")
+                return len(message.data or b"")
+
+            cases.append(BenchmarkCase("send_message", size, latency, nothing, message_send))
+            cases.append(BenchmarkCase("receive_message", size, latency, message_queue, message_receive))
+            cases.append(BenchmarkCase("send_message_mailbox", size, latency, nothing, message_send, mailbox_size=0x10000))
+            cases.append(BenchmarkCase("receive_message_mailbox", size, latency, message_queue, message_receive, mailbox_size=0x10000))
+
+    return cases
+
+
+def run_benchmarks(
+    transfer_sizes: List[int],
+    chunk_sizes: List[int],
+    message_sizes: List[int],
+    operations: int,
+    latencies: List[float],
+    repeat: int,
+    only: Optional[List[str]] = None,
+    verbose: bool = False,
+    micro_packets: int = 2000,
+) -> Dict[str, Any]:
+    micro: List[Dict[str, Any]] = []
+    for name in ["reassemble_packet", "reassemble_packet_resume"]:
+        if only and name not in only:
+            continue
+        result = run_reassembly(name, micro_packets, repeat)
+        if verbose:
+            print(f"{result['name']:>24} length={result['packet_length']:<5} {result['cpu_us_per_packet']:9.1f} us/packet", file=sys.stderr)
+        micro.append(result)
+
+    results: List[Dict[str, Any]] = []
+    for case in build_cases(transfer_sizes, chunk_sizes, message_sizes, operations, latencies):
+        if only and case.name not in only:
+            continue
+        result = run_case(case, repeat)
+        if verbose:
+            print(
+                f"{result['name']:>16} size={result['size']:<9} latency={result['latency_ms']:.1f}ms "
+                f"{result['throughput_mbps']:9.2f} MB/s p50={result['packet_latency_p50_ms']:.3f}ms "
+                f"p99={result['packet_latency_p99_ms']:.3f}ms peak={result['peak_memory_bytes']}",
+                file=sys.stderr,
+            )
+        results.append(result)
+
+    return {
+        "version": 1,
+        "timestamp": time.time(),
+        "python": platform.python_version(),
+        "platform": platform.platform(),
+        "results": results,
+        "microbenchmarks": micro,
+    }
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description="Benchmark net dimm transfers against a local simulated net dimm.")
+    parser.add_argument(
+        "--output",
+        metavar="FILE",
+        type=str,
+        default=None,
+        help="Write JSON results to this file instead of stdout.",
+    )
+    parser.add_argument(
+        "--quick",
+        action="store_true",
+        help="Run a small set of sizes and latencies, useful for a quick sanity check.",
+    )
+    parser.add_argument(
+        "--repeat",
+        metavar="COUNT",
+        type=int,
+        default=3,
+        help="Number of timed runs of each benchmark, the median of which is reported. Defaults to 3.",
+    )
+    parser.add_argument(
+        "--only",
+        metavar="NAME",
+        type=str,
+        action="append",
+        help="Only run benchmarks with this name, such as send or receive_message. Can be specified more than once.",
+    )
+    parser.add_argument(
+        "--verbose",
+        action="store_true",
+        help="Print a human-readable line to stderr as each benchmark finishes.",
+    )
+    args = parser.parse_args()
+
+    if args.quick:
+        report = run_benchmarks([64 * 1024, 1024 * 1024], [32 * 1024], [64, 2048], 100, [0.0, 0.001], args.repeat, args.only, args.verbose, 200)
+    else:
+        report = run_benchmarks(
+            [64 * 1024, 1024 * 1024, 8 * 1024 * 1024],
+            [32 * 1024, 256 * 1024],
+            [64, 2048, 16384],
+            500,
+            [0.0, 0.001, 0.005],
+            args.repeat,
+            args.only,
+            args.verbose,
+        )
+
+    output = json.dumps(report, indent=2)
+    if args.output:
+        with open(args.output, "w") as fp:
+            fp.write(output + "\n")
+    else:
+        print(output)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,30 @@
+import json
+import unittest
+
+from tests.benchmark import percentile, run_benchmarks
+
+
+class TestBenchmark(unittest.TestCase):
+    def test_percentile(self) -> None:
+        samples = [float(x) for x in range(1, 101)]
+        self.assertEqual(percentile(samples, 50.0), 50.0)
+        self.assertEqual(percentile(samples, 99.0), 99.0)
+        self.assertEqual(percentile([], 50.0), 0.0)
+
+    def test_report(self) -> None:
+        # Run the smallest possible version of the suite to make sure that every
+        # benchmark still works and the report is something we can serialize.
+        report = run_benchmarks([4096], [4096], [16], 4, [0.0], 1, micro_packets=10)
+        json.dumps(report)
+
+        self.assertEqual({result["name"] for result in report["microbenchmarks"]}, {"reassemble_packet", "reassemble_packet_resume"})
+        for result in report["microbenchmarks"]:
+            self.assertGreater(result["cpu_us_per_packet"], 0.0)
+
+        names = {result["name"] for result in report["results"]}
+        self.assertEqual(names, {"send", "receive", "send_chunk", "receive_chunk", "peek", "poke", "peek_many", "poke_many", "dump_bytewise", "dump", "load_bytewise", "load", "send_message", "receive_message", "send_message_mailbox", "receive_message_mailbox"})
+        for result in report["results"]:
+            self.assertGreater(result["bytes"], 0)
+            self.assertGreater(result["throughput_mbps"], 0.0)
+            self.assertGreater(result["peak_memory_bytes"], 0)
+            self.assertGreaterEqual(result["packet_latency_p99_ms"], result["packet_latency_p50_ms"])
@@ -1,12 +1,17 @@
+import socket
+import time
 import unittest
-from typing import List, Optional, Tuple
+from typing import Any, Dict, List, Optional, Tuple
 from unittest.mock import MagicMock, patch
 
 # We import internal stuff here since we don't want to test the public
 # interfaces.
-from netboot.cabinet import Cabinet, CabinetStateEnum, CabinetRegionEnum
-from netboot.hostutils import HostStatusEnum
-from netdimm import NetDimmInfo, CRCStatusEnum, NetDimmVersionEnum
+from netboot.cabinet import Cabinet, CabinetManager, CabinetStateEnum, CabinetRegionEnum
+from netboot.hostutils import FanOut, Host, HostStatusEnum
+from netboot.scheduler import Scheduler
+from netboot.transfers import TransferScheduler
+from netdimm import NetDimm, NetDimmInfo, CRCStatusEnum, NetDimmVersionEnum
+from netdimm.simulator import NetDimmSimulator
 
 
 class TestCabinet(unittest.TestCase):
@@ -24,6 +29,7 @@ class TestCabinet(unittest.TestCase):
             settings={},
             srams={},
             outlet=None,
+            transfers=TransferScheduler(),
         )
         host = MagicMock()
         host.ip = "1.2.3.4"
@@ -74,7 +80,60 @@ class TestCabinet(unittest.TestCase):
             cabinet.tick()
             self.assertEqual(cabinet.state[0], CabinetStateEnum.STATE_SEND_CURRENT_GAME)
             self.assertEqual(["Cabinet 1.2.3.4 sending game abc.bin."], logs)
-            host.send.assert_called_with("abc.bin", [], {})
+            host.send.assert_called_with("abc.bin", [], {}, rate=cabinet.transfers.rate("1.2.3.4"))
+
+    def test_state_host_alive_game_queued_transition(self) -> None:
+        logs: List[str] = []
+        with patch('netboot.cabinet.log', new_callable=lambda: lambda log, newline: logs.append(log)):
+            cabinet, host = self.spawn_cabinet(
+                state=CabinetStateEnum.STATE_WAIT_FOR_CABINET_POWER_ON,
+                filename="abc.bin",
+            )
+            host.alive = True
+            cabinet.fanout = FanOut()
+
+            # Somebody else is already using the only send slot.
+            cabinet.transfers.configure(max_concurrent=1)
+            cabinet.transfers.request("5.6.7.8", 1024)
+
+            cabinet.tick()
+            self.assertEqual(cabinet.state, (CabinetStateEnum.STATE_WAIT_FOR_SEND_SLOT, 1))
+            cabinet.tick()
+            self.assertEqual(cabinet.state, (CabinetStateEnum.STATE_WAIT_FOR_SEND_SLOT, 1))
+            host.send.assert_not_called()
+
+            # While we wait, sends of the same game know to wait for us to join in.
+            self.assertEqual(cabinet.fanout.stats["wanted"], ["1.2.3.4"])
+
+            cabinet.transfers.release("5.6.7.8")
+            cabinet.tick()
+            self.assertEqual(cabinet.state[0], CabinetStateEnum.STATE_SEND_CURRENT_GAME)
+            self.assertEqual(cabinet.fanout.stats["wanted"], [])
+            self.assertEqual(["Cabinet 1.2.3.4 waiting to send game abc.bin, number 1 in line.", "Cabinet 1.2.3.4 sending game abc.bin."], logs)
+            host.send.assert_called_with("abc.bin", [], {}, rate=cabinet.transfers.rate("1.2.3.4"))
+
+            # Finishing up gives the slot back.
+            host.status = HostStatusEnum.STATUS_COMPLETED
+            cabinet.tick()
+            self.assertEqual(cabinet.state[0], CabinetStateEnum.STATE_CHECK_CURRENT_GAME)
+            self.assertIsNone(cabinet.transfers.position("1.2.3.4"))
+
+    def test_state_host_queued_turned_off_transition(self) -> None:
+        logs: List[str] = []
+        with patch('netboot.cabinet.log', new_callable=lambda: lambda log, newline: logs.append(log)):
+            cabinet, host = self.spawn_cabinet(
+                state=CabinetStateEnum.STATE_WAIT_FOR_SEND_SLOT,
+                filename="abc.bin",
+            )
+            cabinet.transfers.configure(max_concurrent=1)
+            cabinet.transfers.request("5.6.7.8", 1024)
+            cabinet.transfers.request("1.2.3.4", 1024)
+            host.alive = False
+
+            cabinet.tick()
+            self.assertEqual(cabinet.state[0], CabinetStateEnum.STATE_WAIT_FOR_CABINET_POWER_ON)
+            self.assertEqual(["Cabinet 1.2.3.4 turned off, waiting for power on."], logs)
+            self.assertIsNone(cabinet.transfers.position("1.2.3.4"))
 
     def test_state_host_alive_already_running_transition(self) -> None:
         logs: List[str] = []
@@ -158,7 +217,7 @@ class TestCabinet(unittest.TestCase):
             cabinet.tick()
             self.assertEqual(cabinet.state[0], CabinetStateEnum.STATE_SEND_CURRENT_GAME)
             self.assertEqual(["Cabinet 1.2.3.4 sending game abc.bin."], logs)
-            host.send.assert_called_with("abc.bin", [], {})
+            host.send.assert_called_with("abc.bin", [], {}, rate=cabinet.transfers.rate("1.2.3.4"))
 
     def test_state_host_alive_different_crc_game_transition(self) -> None:
         logs: List[str] = []
@@ -186,7 +245,31 @@ class TestCabinet(unittest.TestCase):
             cabinet.tick()
             self.assertEqual(cabinet.state[0], CabinetStateEnum.STATE_SEND_CURRENT_GAME)
             self.assertEqual(["Cabinet 1.2.3.4 sending game abc.bin."], logs)
-            host.send.assert_called_with("abc.bin", [], {})
+            host.send.assert_called_with("abc.bin", [], {}, rate=cabinet.transfers.rate("1.2.3.4"))
+
+    def test_state_host_joins_fanout_without_slot(self) -> None:
+        logs: List[str] = []
+        with patch('netboot.cabinet.log', new_callable=lambda: lambda log, newline: logs.append(log)):
+            cabinet, host = self.spawn_cabinet(
+                state=CabinetStateEnum.STATE_WAIT_FOR_SEND_SLOT,
+                filename="abc.bin",
+            )
+            cabinet.transfers = TransferScheduler(max_concurrent=1)
+            cabinet.transfers.request("5.6.7.8", 1)
+            cabinet.transfers.request("1.2.3.4", 1)
+            cabinet.fanout = MagicMock()
+            cabinet.fanout.joinable.return_value = True
+            host.alive = True
+            host.info.return_value = None
+
+            # The same game is about to go out to somebody else, so we tag along instead
+            # of waiting for a place of our own.
+            cabinet.tick()
+            self.assertEqual(cabinet.state[0], CabinetStateEnum.STATE_SEND_CURRENT_GAME)
+            self.assertIsNone(cabinet.transfers.position("1.2.3.4"))
+            self.assertEqual(cabinet.transfers.stats["active"], ["5.6.7.8"])
+            host.send.assert_called_once_with("abc.bin", [], {}, rate=None)
+            self.assertEqual(["Cabinet 1.2.3.4 sending game abc.bin."], logs)
 
     def test_state_host_sending_no_transition(self) -> None:
         logs: List[str] = []
@@ -404,3 +487,106 @@ class TestCabinet(unittest.TestCase):
             cabinet.tick()
             self.assertEqual(cabinet.state[0], CabinetStateEnum.STATE_WAIT_FOR_CABINET_POWER_ON)
             self.assertEqual(["Cabinet 1.2.3.4 changed game to xyz.bin, waiting for power on."], logs)
+
+
+class TestCabinetManager(unittest.TestCase):
+    def test_slow_cabinet_doesnt_stall_others(self) -> None:
+        cabinets: List[MagicMock] = []
+        for i in range(40):
+            cabinet = MagicMock()
+            cabinet.ip = f"10.0.0.{i + 1}"
+            cabinets.append(cabinet)
+
+        # The first cabinet's tick hangs like it would waiting on an unreachable net dimm.
+        cabinets[0].tick.side_effect = lambda: time.sleep(0.5)
+
+        with patch.object(CabinetManager, "TICK_SECONDS", 0.05):
+            manager = CabinetManager(cabinets, scheduler=Scheduler(workers=4))
+            start = time.time()
+            while cabinets[-1].tick.call_count < 3 and (time.time() - start) < 5.0:
+                time.sleep(0.01)
+            elapsed = time.time() - start
+            stats = manager.tick_stats
+
+            for cabinet in cabinets:
+                manager.remove_cabinet(cabinet.ip)
+
+        # The last cabinet got ticked on schedule rather than after the first one's tick.
+        self.assertGreaterEqual(cabinets[-1].tick.call_count, 3)
+        self.assertLess(elapsed, 0.4)
+        self.assertTrue(stats["10.0.0.1"]["running"])
+        self.assertGreaterEqual(stats["10.0.0.40"]["runs"], 3)
+        self.assertEqual(manager.tick_stats, {})
+
+        # Removed cabinets stop their hosts' background work too.
+        for cabinet in cabinets:
+            cabinet.close.assert_called_once_with()
+
+    def test_unresponsive_net_dimm_doesnt_stall_others(self) -> None:
+        # Each net dimm is still checking its game, so every tick asks it how it's going.
+        sims = [NetDimmSimulator() for _ in range(3)]
+        for sim in sims:
+            sim.load_game(b"game" * 256, crc_status=CRCStatusEnum.STATUS_CHECKING.value)
+            sim.start()
+
+        # A net dimm that takes our connection but never answers anything we send it.
+        hung = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        hung.bind(("127.0.0.1", 0))
+        hung.listen(5)
+
+        ports: Dict[str, int] = {"10.0.0.1": hung.getsockname()[1]}
+        for i, sim in enumerate(sims):
+            ports[f"10.0.0.{i + 2}"] = sim.port
+
+        def netdimm(ip: str, **kwargs: Any) -> NetDimm:
+            return NetDimm("127.0.0.1", port=ports[ip], **kwargs)
+
+        # Every cabinet looks like it's up, so they all want to talk to their net dimm.
+        prober = MagicMock()
+        prober.interval = 0.05
+        prober.consecutive.return_value = (10, 0)
+
+        scheduler = Scheduler(workers=2)
+        with patch("netboot.hostutils.NetDimm", netdimm), patch.object(Host, "TIME_HACK_SECONDS", 0.05), patch.object(CabinetManager, "TICK_SECONDS", 0.05):
+            cabinets = [
+                Cabinet(
+                    ip=ip,
+                    region=CabinetRegionEnum.REGION_USA,
+                    description="test",
+                    filename="abc.bin",
+                    patches={},
+                    settings={},
+                    srams={},
+                    outlet=None,
+                    time_hack=True,
+                    quiet=True,
+                    transfers=TransferScheduler(),
+                    fanout=FanOut(),
+                    prober=prober,
+                    scheduler=scheduler,
+                )
+                for ip in ports
+            ]
+            for cabinet in cabinets:
+                cabinet._Cabinet__state = (CabinetStateEnum.STATE_CHECK_CURRENT_GAME, 0)  # type: ignore
+                cabinet._Cabinet__host._Host__alive = True  # type: ignore
+            manager = CabinetManager(cabinets, scheduler=scheduler)
+
+            time.sleep(1.0)
+            stats = manager.tick_stats
+            states = [cabinet.state[0] for cabinet in cabinets[1:]]
+            for task in scheduler.tasks:
+                task.cancel()
+            for cabinet in cabinets[1:]:
+                cabinet.close()
+
+        hung.close()
+        for sim in sims:
+            sim.stop()
+
+        # The hung cabinet and its host only ever had one worker between them, so the
+        # other one kept everybody else ticking along.
+        self.assertEqual(stats["10.0.0.1"]["runs"], 0)
+        self.assertEqual(states, [CabinetStateEnum.STATE_CHECK_CURRENT_GAME] * 3)
+        for ip in ["10.0.0.2", "10.0.0.3", "10.0.0.4"]:
+            self.assertGreaterEqual(stats[ip]["runs"], 10)
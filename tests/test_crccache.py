@@ -0,0 +1,151 @@
+import os
+import sys
+import tempfile
+import unittest
+import zlib
+from typing import Dict, List
+from unittest import mock
+
+from arcadeutils import FileBytes
+from netboot.crccache import CRCCache, crc32_combine
+from netboot.hostutils import SettingsEnum, _handle_patches
+from netdimm import NetDimm, NetDimmTargetEnum
+
+
+class TestCRCCache(unittest.TestCase):
+    def setUp(self) -> None:
+        self.tmpdir = tempfile.TemporaryDirectory()
+        self.rom = os.path.join(self.tmpdir.name, "game.bin")
+        self.cachefile = os.path.join(self.tmpdir.name, "crc.json")
+        self.data = os.urandom(10 * 1024 + 123)
+        with open(self.rom, "wb") as bfp:
+            bfp.write(self.data)
+
+    def tearDown(self) -> None:
+        self.tmpdir.cleanup()
+
+    def make_cache(self) -> CRCCache:
+        cache = CRCCache(self.cachefile)
+        # Small blocks so that patches land in a handful of different ones.
+        cache.BLOCK_SIZE = 1024
+        return cache
+
+    def make_patch(self, name: str, changes: Dict[int, bytes]) -> str:
+        path = os.path.join(self.tmpdir.name, name)
+        with open(path, "w") as fp:
+            fp.write("# Description: test patch\n")
+            for offset, new in changes.items():
+                old = " ".join(f"{b:02X}" for b in self.data[offset:(offset + len(new))])
+                fp.write(f"{offset:X}: {old} -> {' '.join(f'{b:02X}' for b in new)}\n")
+        return path
+
+    def expected(self, patches: List[str]) -> int:
+        with open(self.rom, "rb") as fp:
+            return NetDimm.crc(_handle_patches(FileBytes(fp), NetDimmTargetEnum.TARGET_NAOMI, patches, {}))
+
+    def lookup(self, cache: CRCCache, patches: List[str], settings: Dict[SettingsEnum, bytes] = {}) -> int:
+        return cache.crc(
+            self.rom,
+            NetDimmTargetEnum.TARGET_NAOMI,
+            patches,
+            settings,
+            lambda data: _handle_patches(data, NetDimmTargetEnum.TARGET_NAOMI, patches, settings),
+        )
+
+    def test_crc32_combine(self) -> None:
+        for split in [0, 1, 7, 1024, len(self.data) - 1, len(self.data)]:
+            first, second = self.data[:split], self.data[split:]
+            self.assertEqual(crc32_combine(zlib.crc32(first), zlib.crc32(second), len(second)), zlib.crc32(self.data))
+
+    def test_cached(self) -> None:
+        patch = self.make_patch("one.binpatch", {0x10: b"\x01\x02"})
+
+        cache = self.make_cache()
+        self.assertEqual(self.lookup(cache, [patch]), self.expected([patch]))
+        self.assertEqual((cache.hits, cache.incremental, cache.misses), (0, 0, 1))
+        self.assertEqual(self.lookup(cache, [patch]), self.expected([patch]))
+        self.assertEqual((cache.hits, cache.incremental, cache.misses), (1, 0, 1))
+
+        # A fresh cache, like after a restart, should find it on disk.
+        cache = self.make_cache()
+        self.assertEqual(self.lookup(cache, [patch]), self.expected([patch]))
+        self.assertEqual((cache.hits, cache.incremental, cache.misses), (1, 0, 0))
+
+    def test_needs_path(self) -> None:
+        patch = self.make_patch("one.binpatch", {0x10: b"\x01\x02"})
+
+        # Without a path, the cache is only good for as long as it's around.
+        cache = CRCCache()
+        with mock.patch("tempfile.mkstemp") as mkstemp:
+            self.assertEqual(self.lookup(cache, [patch]), self.expected([patch]))
+            self.assertEqual(self.lookup(cache, [patch]), self.expected([patch]))
+            mkstemp.assert_not_called()
+        self.assertEqual((cache.hits, cache.misses), (1, 1))
+
+        cache.configure(path=self.cachefile)
+        self.lookup(cache, [patch])
+        self.assertTrue(os.path.exists(self.cachefile))
+
+    @unittest.skipIf(sys.platform == "win32", "Permissions work differently on Windows")
+    def test_private_directory(self) -> None:
+        patch = self.make_patch("one.binpatch", {0x10: b"\x01\x02"})
+        self.lookup(self.make_cache(), [patch])
+
+        # Once anybody else can write next to the cache, we can't trust what it says.
+        os.chmod(self.tmpdir.name, 0o777)
+        try:
+            cache = self.make_cache()
+            self.assertEqual(self.lookup(cache, [patch]), self.expected([patch]))
+            self.assertEqual((cache.hits, cache.misses), (0, 1))
+        finally:
+            os.chmod(self.tmpdir.name, 0o700)
+
+        cache = self.make_cache()
+        self.assertEqual(self.lookup(cache, [patch]), self.expected([patch]))
+        self.assertEqual((cache.hits, cache.misses), (1, 0))
+
+    def test_incremental(self) -> None:
+        cache = self.make_cache()
+        self.assertEqual(self.lookup(cache, []), self.expected([]))
+        self.assertEqual(cache.misses, 1)
+
+        # Patches spanning block boundaries and touching the final partial block.
+        patch = self.make_patch("two.binpatch", {0x3FF: b"\xAA\xBB", 0x1800: b"\xCC", len(self.data) - 1: b"\xDD"})
+        self.assertEqual(self.lookup(cache, [patch]), self.expected([patch]))
+        other = self.make_patch("three.binpatch", {0x0: b"\x00\x11\x22\x33"})
+        self.assertEqual(self.lookup(cache, [patch, other]), self.expected([patch, other]))
+        self.assertEqual((cache.incremental, cache.misses), (2, 1))
+
+        # Learning base blocks from a patched image should give the same answers.
+        os.remove(self.cachefile)
+        cache = self.make_cache()
+        self.assertEqual(self.lookup(cache, [patch]), self.expected([patch]))
+        self.assertEqual(self.lookup(cache, []), self.expected([]))
+        self.assertEqual(self.lookup(cache, [other]), self.expected([other]))
+        self.assertEqual((cache.incremental, cache.misses), (2, 1))
+
+    def test_invalidation(self) -> None:
+        patch = self.make_patch("one.binpatch", {0x10: b"\x01\x02"})
+        cache = self.make_cache()
+        self.lookup(cache, [patch])
+
+        # Editing a patch file must not hand back the old answer.
+        patch = self.make_patch("one.binpatch", {0x10: b"\x03\x04"})
+        self.assertEqual(self.lookup(cache, [patch]), self.expected([patch]))
+        self.assertEqual(cache.hits, 0)
+
+        # Neither must changing the ROM itself.
+        self.data = os.urandom(len(self.data))
+        with open(self.rom, "wb") as bfp:
+            bfp.write(self.data)
+        os.utime(self.rom, ns=(1, 1))
+        patch = self.make_patch("one.binpatch", {0x10: b"\x03\x04"})
+        self.assertEqual(self.lookup(cache, [patch]), self.expected([patch]))
+        self.assertEqual(cache.hits, 0)
+
+        # Different settings are a different configuration. Settings only apply to
+        # Naomi ROMs, so for this test the other targets just ignore them.
+        before = cache.misses
+        cache.crc(self.rom, NetDimmTargetEnum.TARGET_CHIHIRO, [patch], {SettingsEnum.SETTINGS_SRAM: b"\0" * 16}, lambda data: data)
+        cache.crc(self.rom, NetDimmTargetEnum.TARGET_CHIHIRO, [patch], {SettingsEnum.SETTINGS_SRAM: b"\1" * 16}, lambda data: data)
+        self.assertEqual(cache.misses, before + 2)
@@ -0,0 +1,267 @@
+import multiprocessing
+import os
+import sys
+import tempfile
+import time
+import unittest
+from functools import partial
+from typing import Any, List, Tuple
+from unittest import mock
+
+from netboot.hostutils import FanOut, Host, HostStatusEnum, _send_file_to_hosts
+from netboot.prober import LivenessProber
+from netboot.scheduler import Scheduler
+from netdimm import NetDimm
+from netdimm.simulator import NetDimmSimulator
+
+
+class TestHostSession(unittest.TestCase):
+    def setUp(self) -> None:
+        self.dimm = NetDimmSimulator()
+        self.dimm.start()
+        self.patcher = mock.patch("netboot.hostutils.NetDimm", partial(NetDimm, port=self.dimm.port))
+        self.patcher.start()
+
+        # Periodic work goes on a scheduler of its own, and without the time hack none
+        # of it talks to the simulator.
+        self.scheduler = Scheduler()
+        self.prober = LivenessProber(method="tcp")
+        self.host = Host("127.0.0.1", quiet=True, scheduler=self.scheduler, prober=self.prober)
+
+    def tearDown(self) -> None:
+        self.host.close()
+        self.patcher.stop()
+        self.dimm.stop()
+
+    def test_reuses_connection(self) -> None:
+        for _ in range(5):
+            self.assertIsNotNone(self.host.info())
+        self.host.wipe()
+        self.assertIsNotNone(self.host.info())
+
+        self.assertEqual(self.host.stats, {"connects": 1, "reconnects": 0, "operations": 7})
+        self.assertEqual(self.dimm.stats.connections, 1)
+        self.assertEqual(self.dimm.stats.packets_received[0x01], 1)
+
+        # Rebooting starts over with a new connection.
+        self.assertTrue(self.host.reboot())
+        self.assertIsNotNone(self.host.info())
+        self.assertEqual(self.host.stats["connects"], 2)
+        self.assertEqual(self.dimm.restarts, 1)
+
+    def test_reconnects(self) -> None:
+        self.assertIsNotNone(self.host.info())
+        self.dimm.disconnect()
+        time.sleep(0.1)
+
+        # The dropped connection gets noticed and replaced without the caller knowing.
+        self.assertIsNotNone(self.host.info())
+        self.assertEqual(self.host.stats, {"connects": 2, "reconnects": 1, "operations": 2})
+        self.assertEqual(self.dimm.stats.connections, 2)
+
+    def test_pauses_prober(self) -> None:
+        # While we have the net dimm's only connection, the prober leaves it alone.
+        self.assertEqual(self.prober.paused, [])
+        self.assertIsNotNone(self.host.info())
+        self.assertEqual(self.prober.paused, ["127.0.0.1"])
+        self.dimm.disconnect()
+        time.sleep(0.1)
+        self.assertIsNotNone(self.host.info())
+        self.assertEqual(self.prober.paused, ["127.0.0.1"])
+
+        self.host.close()
+        self.assertEqual(self.prober.paused, [])
+
+    def test_time_hack_notices_power_loss(self) -> None:
+        # The time hack mustn't keep the prober away from a net dimm that's gone quiet.
+        prober = LivenessProber(port=self.dimm.port, interval=0.05, timeout=0.1, method="tcp")
+        with mock.patch.object(Host, "TIME_HACK_SECONDS", 0.1):
+            host = Host("127.0.0.1", quiet=True, time_hack=True, scheduler=self.scheduler, prober=prober)
+        try:
+            deadline = time.time() + 5.0
+            while time.time() < deadline and not (host.alive and self.dimm.time_limit == 10):
+                time.sleep(0.01)
+            self.assertTrue(host.alive)
+            self.assertEqual(self.dimm.time_limit, 10)
+
+            # Now the cabinet loses power, so nothing answers anymore but nothing hangs up
+            # on us either.
+            with mock.patch.object(prober, "_LivenessProber__probe_tcp", lambda hosts: {ip: None for ip in hosts}):
+                deadline = time.time() + 5.0
+                while time.time() < deadline and host.alive:
+                    time.sleep(0.01)
+                self.assertFalse(host.alive)
+                self.assertEqual(prober.paused, [])
+        finally:
+            host.close()
+
+    def test_close(self) -> None:
+        self.assertIsNotNone(self.host.info())
+        self.host.close()
+
+        # With our session closed, somebody else can talk to the net dimm.
+        self.assertIsNotNone(NetDimm("127.0.0.1", port=self.dimm.port, timeout=5).info())
+        self.assertEqual(self.dimm.stats.connections, 2)
+
+        # Nothing keeps running in the background for a host that's gone, and closing
+        # twice doesn't take somebody else's host out of the prober.
+        self.assertEqual(self.scheduler.tasks, [])
+        self.assertEqual(self.prober.hosts, [])
+        self.prober.add("127.0.0.1")
+        self.host.close()
+        self.assertEqual(self.prober.hosts, ["127.0.0.1"])
+
+
+@unittest.skipUnless(sys.platform.startswith("linux"), "Needs every address in 127.0.0.0/8 to be local")
+class TestFanOut(unittest.TestCase):
+    def setUp(self) -> None:
+        # Every host needs its own address so they can all listen on the standard port.
+        self.ips = ["127.0.0.2", "127.0.0.3", "127.0.0.4"]
+        self.dimms = [NetDimmSimulator(host=ip, port=10703) for ip in self.ips]
+        for dimm in self.dimms:
+            dimm.start()
+        self.cleanup()
+
+        self.tmpdir = tempfile.TemporaryDirectory()
+        self.fanout = FanOut(gather=0.2)
+        self.prober = LivenessProber(method="tcp")
+        self.hosts = [Host(ip, quiet=True, scheduler=Scheduler(), prober=self.prober, fanout=self.fanout) for ip in self.ips]
+
+    def tearDown(self) -> None:
+        for host in self.hosts:
+            host.close()
+        for dimm in self.dimms:
+            dimm.stop()
+        self.tmpdir.cleanup()
+        self.cleanup()
+
+    def cleanup(self) -> None:
+        # Start with fresh net dimms, not ones we remember sending to before.
+        for ip in self.ips:
+            manifest = os.path.join(tempfile.gettempdir(), f"{ip}.manifest")
+            if os.path.exists(manifest):
+                os.remove(manifest)
+
+    def write_rom(self, name: str, length: int) -> str:
+        rom = os.path.join(self.tmpdir.name, name)
+        with open(rom, "wb") as bfp:
+            bfp.write(os.urandom(length))
+        return rom
+
+    def wait(self, hosts: List[Host]) -> None:
+        start = time.time()
+        while any(host.status == HostStatusEnum.STATUS_TRANSFERRING for host in hosts) and time.time() - start < 30.0:
+            for host in hosts:
+                host.tick()
+            time.sleep(0.05)
+
+    def test_same_image_sent_once(self) -> None:
+        shared = self.write_rom("shared.bin", 0x8000 * 16)
+        other = self.write_rom("other.bin", 0x8000 * 4)
+
+        # The second host's cabinet is coming up too, so the first send waits for it. Nobody
+        # else wants the other game, so that goes out right away.
+        self.fanout.want(self.ips[1], shared)
+        self.hosts[0].send(shared, [], {})
+        self.hosts[1].send(shared, [], {})
+        self.hosts[2].send(other, [], {})
+        self.assertEqual(self.fanout.stats["pending"], self.ips[:2])
+        self.assertEqual(self.fanout.stats["running"], self.ips[2:])
+        self.assertEqual(self.prober.paused, self.ips)
+        self.wait(self.hosts)
+        self.assertEqual(self.prober.paused, [])
+
+        # The two hosts wanting the same game got it from the same send.
+        for host in self.hosts:
+            self.assertEqual(host.status, HostStatusEnum.STATUS_COMPLETED)
+        stats = self.fanout.stats
+        self.assertEqual((stats["groups"], stats["sends"], stats["largest"]), (2, 3, 2))
+        self.assertEqual((stats["pending"], stats["running"]), ([], []))
+
+        for dimm, rom in zip(self.dimms, [shared, shared, other]):
+            with open(rom, "rb") as bfp:
+                data = bfp.read()
+            self.assertEqual(dimm.read(0, len(data)), data)
+
+    def test_cancel_is_isolated(self) -> None:
+        rom = self.write_rom("game.bin", 0x8000 * 32)
+
+        # Slow both sends down so there's time to give up on one partway through.
+        self.fanout.want(self.ips[1], rom)
+        for host in self.hosts[:2]:
+            host.send(rom, [], {}, rate=multiprocessing.Value('d', 512.0 * 1024, lock=False))
+        start = time.time()
+        while self.hosts[0].progress[0] == 0 and time.time() - start < 10.0:
+            self.hosts[0].tick()
+            time.sleep(0.05)
+
+        # Giving up on one host partway through leaves the other one going.
+        self.hosts[0].alive = False
+        self.assertEqual(self.hosts[0].status, HostStatusEnum.STATUS_INACTIVE)
+        self.wait(self.hosts[1:2])
+        self.assertEqual(self.hosts[1].status, HostStatusEnum.STATUS_COMPLETED)
+        self.assertEqual(self.fanout.stats["running"], [])
+
+        with open(rom, "rb") as bfp:
+            data = bfp.read()
+        self.assertEqual(self.dimms[1].read(0, len(data)), data)
+
+    def test_lone_send_doesnt_wait(self) -> None:
+        rom = self.write_rom("game.bin", 0x8000 * 4)
+
+        # Nobody else wants this game, so there's nothing to wait for.
+        self.fanout.configure(gather=30.0)
+        self.hosts[0].send(rom, [], {})
+        self.assertEqual(self.fanout.stats["running"], self.ips[:1])
+        self.wait(self.hosts[:1])
+        self.assertEqual(self.hosts[0].status, HostStatusEnum.STATUS_COMPLETED)
+
+    def test_joiners_share_rate(self) -> None:
+        rom = self.write_rom("game.bin", 0x8000 * 4)
+        rate = multiprocessing.Value('d', 0.0, lock=False)
+
+        # A host joining in without a place in line of its own goes at the first one's rate.
+        self.fanout.want(self.ips[1], rom)
+        self.hosts[0].send(rom, [], {}, rate=rate)
+        self.assertTrue(self.fanout.joinable(rom, [], {}, self.hosts[1].target, self.hosts[1].version))
+        self.hosts[1].send(rom, [], {})
+        group = self.hosts[1]._Host__proc.group  # type: ignore
+        self.assertEqual([host[4] for host in group.hosts], [rate, rate])
+        self.wait(self.hosts[:2])
+        self.assertFalse(self.fanout.joinable(rom, [], {}, self.hosts[1].target, self.hosts[1].version))
+
+    def test_group_sticks_to_rate(self) -> None:
+        rom = self.write_rom("game.bin", 0x8000 * 32)
+        rate = multiprocessing.Value('d', 1024.0 * 1024, lock=False)
+
+        # Both hosts together only get the one host's share, not one share each.
+        self.fanout.want(self.ips[1], rom)
+        start = time.time()
+        self.hosts[0].send(rom, [], {}, rate=rate)
+        self.hosts[1].send(rom, [], {})
+        self.wait(self.hosts[:2])
+        elapsed = time.time() - start
+        for host in self.hosts[:2]:
+            self.assertEqual(host.status, HostStatusEnum.STATUS_COMPLETED)
+
+        sent = sum(dimm.stats.bytes_received for dimm in self.dimms[:2])
+        self.assertGreaterEqual(sent, 2 * 0x8000 * 32)
+        self.assertLess(sent / elapsed, rate.value * 1.25)
+
+    def test_parent_gone(self) -> None:
+        rom = self.write_rom("game.bin", 0x8000 * 4)
+        parent = multiprocessing.Process(target=int)
+        parent.start()
+        parent.join()
+        assert parent.pid is not None
+
+        # Every host hears that the send failed, instead of the threads sending to them
+        # quietly going away.
+        queues: List["multiprocessing.Queue[Tuple[str, Any]]"] = [multiprocessing.Queue() for _ in self.ips[:2]]
+        hosts = [(ip, None, None, q, None, multiprocessing.Value('b', 0, lock=False)) for ip, q in zip(self.ips[:2], queues)]
+        _send_file_to_hosts(hosts, rom, [], {}, self.hosts[0].target, self.hosts[0].version, None, self.fanout.window, parent.pid)
+        for q in queues:
+            update = q.get(timeout=5.0)
+            while update[0] == "progress":
+                update = q.get(timeout=5.0)
+            self.assertEqual(update, ("failure", "Parent process went away"))
@@ -0,0 +1,137 @@
+import os
+import queue
+import stat
+import sys
+import tempfile
+import time
+import unittest
+from functools import partial
+from unittest import mock
+from typing import Any, Dict, List, Tuple
+
+from netboot.hostutils import _send_file_to_host, _handle_patches
+from netboot.imagecache import ImageCache
+from netdimm import NetDimm, NetDimmTargetEnum, NetDimmVersionEnum
+from netdimm.simulator import NetDimmSimulator
+
+
+class TestImageCache(unittest.TestCase):
+    def setUp(self) -> None:
+        self.tmpdir = tempfile.TemporaryDirectory()
+        self.cachedir = os.path.join(self.tmpdir.name, "cache")
+        self.rom = os.path.join(self.tmpdir.name, "game.bin")
+        self.data = os.urandom(0x8000 * 3 + 17)
+        with open(self.rom, "wb") as bfp:
+            bfp.write(self.data)
+        self.patch = os.path.join(self.tmpdir.name, "game.binpatch")
+        with open(self.patch, "w") as fp:
+            fp.write(f"10: {self.data[0x10]:02X} -> 5A\n")
+
+    def tearDown(self) -> None:
+        self.tmpdir.cleanup()
+
+    def patched(self, patches: List[str]) -> bytes:
+        return _handle_patches(self.data, NetDimmTargetEnum.TARGET_NAOMI, patches, {})
+
+    def test_key(self) -> None:
+        key = ImageCache.key(self.rom, NetDimmTargetEnum.TARGET_NAOMI, [self.patch], {}, b"trojan")
+        self.assertEqual(key, ImageCache.key(self.rom, NetDimmTargetEnum.TARGET_NAOMI, [self.patch], {}, b"other"))
+        self.assertNotEqual(key, ImageCache.key(self.rom, NetDimmTargetEnum.TARGET_NAOMI, [], {}, b"trojan"))
+        self.assertNotEqual(key, ImageCache.key(self.rom, NetDimmTargetEnum.TARGET_CHIHIRO, [self.patch], {}, b"trojan"))
+
+        settings: Dict[Any, bytes] = {NetDimmTargetEnum.TARGET_NAOMI: b"settings"}
+        withsettings = ImageCache.key(self.rom, NetDimmTargetEnum.TARGET_NAOMI, [self.patch], settings, b"trojan")
+        self.assertNotEqual(key, withsettings)
+        self.assertNotEqual(withsettings, ImageCache.key(self.rom, NetDimmTargetEnum.TARGET_NAOMI, [self.patch], settings, b"other"))
+
+        # Touching the ROM means it could have changed.
+        os.utime(self.rom, ns=(1, 1))
+        self.assertNotEqual(key, ImageCache.key(self.rom, NetDimmTargetEnum.TARGET_NAOMI, [self.patch], {}, b"trojan"))
+
+    def test_store_and_evict(self) -> None:
+        cache = ImageCache(self.cachedir, max_size=len(self.data) * 2)
+        self.assertIsNone(cache.lookup("a"))
+
+        data = self.patched([self.patch])
+        path = cache.store("a", data)
+        self.assertIsNotNone(path)
+        self.assertEqual(cache.lookup("a"), path)
+        with open(cache.lookup("a") or "", "rb") as bfp:
+            self.assertEqual(bfp.read(), data)
+
+        # Make sure "a" looks older than anything stored afterwards.
+        os.utime(cache.lookup("a") or "", (time.time() - 10, time.time() - 10))
+        cache.store("b", data)
+        self.assertEqual(cache.stats["entries"], 2)
+
+        # Using "a" makes "b" the least recently used, so it goes first.
+        cache.lookup("a")
+        os.utime(cache.lookup("b") or "", (time.time() - 20, time.time() - 20))
+        cache.store("c", data)
+        self.assertIsNotNone(cache.lookup("a"))
+        self.assertIsNone(cache.lookup("b"))
+        self.assertIsNotNone(cache.lookup("c"))
+        self.assertLessEqual(cache.stats["size"], cache.max_size)
+
+        # Too big to ever fit.
+        small = ImageCache(self.cachedir, max_size=len(self.data) - 1)
+        self.assertIsNone(small.store("d", data))
+
+    def test_needs_directory(self) -> None:
+        # Nothing gets cached anywhere unless somewhere to put it has been configured.
+        cache = ImageCache()
+        data = self.patched([self.patch])
+        self.assertIsNone(cache.store("a", data))
+        self.assertIsNone(cache.lookup("a"))
+
+        cache.configure(directory=self.cachedir)
+        self.assertIsNotNone(cache.store("a", data))
+        self.assertEqual(stat.S_IMODE(os.stat(self.cachedir).st_mode), 0o700)
+
+    @unittest.skipIf(sys.platform == "win32", "Permissions work differently on Windows")
+    def test_private_directory(self) -> None:
+        cache = ImageCache(self.cachedir)
+        data = self.patched([self.patch])
+        path = cache.store("a", data)
+        self.assertIsNotNone(path)
+
+        # Once anybody else can write to the cache, we can't trust anything in it.
+        os.chmod(self.cachedir, 0o777)
+        self.assertIsNone(cache.lookup("a"))
+        self.assertIsNone(cache.store("b", data))
+        os.chmod(self.cachedir, 0o700)
+        self.assertEqual(cache.lookup("a"), path)
+
+        with mock.patch("os.getuid", return_value=os.getuid() + 1):
+            self.assertIsNone(cache.lookup("a"))
+
+    def send(self, dimm: NetDimmSimulator, cache: ImageCache) -> List[Tuple[str, Any]]:
+        updates: "queue.Queue[Tuple[str, Any]]" = queue.Queue()
+        with mock.patch("netboot.hostutils.NetDimm", partial(NetDimm, port=dimm.port)):
+            _send_file_to_host(
+                "127.0.0.1",
+                self.rom,
+                [self.patch],
+                {},
+                NetDimmTargetEnum.TARGET_NAOMI,
+                NetDimmVersionEnum.VERSION_4_01,
+                5,
+                (self.cachedir, cache.max_size),
+                None,
+                os.getpid(),
+                updates,  # type: ignore
+            )
+        NetDimm("127.0.0.1", port=dimm.port, timeout=5).info()
+        return [update for update in list(updates.queue) if update[0] != "progress"]
+
+    def test_send(self) -> None:
+        cache = ImageCache(self.cachedir)
+        expected = self.patched([self.patch])
+        with NetDimmSimulator() as dimm:
+            self.assertEqual(self.send(dimm, cache), [("cache", False), ("success", None)])
+            self.assertEqual(dimm.read(0, len(expected)), expected)
+
+            dimm.write(0, b"\0" * len(expected))
+            self.assertEqual(self.send(dimm, cache), [("cache", True), ("success", None)])
+            self.assertEqual(dimm.read(0, len(expected)), expected)
+        self.assertEqual(cache.stats["entries"], 1)
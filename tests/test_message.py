@@ -0,0 +1,469 @@
+import os
+import threading
+import time
+import unittest
+from unittest import mock
+from typing import List, Optional, Tuple
+
+from netdimm import (
+    NetDimm,
+    Message,
+    MessageChannel,
+    MessageException,
+    MessagePoller,
+    receive_packet,
+    send_packet,
+    read_scratch1_register,
+    write_scratch1_register,
+    receive_message,
+    send_message,
+    receive_mailbox_packet,
+    send_mailbox_packet,
+    MAX_PACKET_LENGTH,
+)
+from netdimm.message import (
+    CONFIG_MESSAGE_EXISTS,
+    CONFIG_MESSAGE_HAS_ZLIB,
+    CONFIG_REGISTER,
+    STREAM_WINDOW,
+    PacketAssembler,
+    choose_compression,
+    read_config_register,
+)
+from netdimm.simulator import NetDimmSimulator, SimulatedMessageTarget
+
+
+class TestMessage(unittest.TestCase):
+    def setUp(self) -> None:
+        self.target = SimulatedMessageTarget()
+        self.dimm = NetDimmSimulator(message_target=self.target)
+        self.dimm.start()
+        self.netdimm = NetDimm("127.0.0.1", port=self.dimm.port, timeout=5)
+
+    def tearDown(self) -> None:
+        self.dimm.stop()
+
+    def test_scratch_registers(self) -> None:
+        write_scratch1_register(self.netdimm, 0xdeadbeef)
+        self.assertEqual(read_scratch1_register(self.netdimm), 0xdeadbeef)
+
+    def test_packets(self) -> None:
+        self.assertTrue(send_packet(self.netdimm, b"hello, world"))
+        self.assertEqual(self.target.inbound, [b"hello, world"])
+
+        self.assertIsNone(receive_packet(self.netdimm))
+        self.target.queue_packet(b"\x01\x02\x03\x04\x05")
+        self.assertEqual(receive_packet(self.netdimm), b"\x01\x02\x03\x04\x05")
+        self.assertIsNone(receive_packet(self.netdimm))
+
+    def test_send_message(self) -> None:
+        with self.netdimm.connection():
+            send_message(self.netdimm, Message(0x1234))
+            send_message(self.netdimm, Message(0x5678, b"short"))
+
+            # Multi-packet message that compresses well.
+            send_message(self.netdimm, Message(0x1111, b"A" * 5000))
+
+            # Multi-packet message that doesn't compress.
+            random = os.urandom(2000)
+            send_message(self.netdimm, Message(0x2222, random))
+
+        self.assertEqual(self.target.messages, [
+            (0x1234, b""),
+            (0x5678, b"short"),
+            (0x1111, b"A" * 5000),
+            (0x2222, random),
+        ])
+
+    def test_receive_message(self) -> None:
+        random = os.urandom(3000)
+        self.target.queue_message(0x1234)
+        self.target.queue_message(0x5678, random)
+
+        with self.netdimm.connection():
+            msg = receive_message(self.netdimm)
+            self.assertIsNotNone(msg)
+            if msg is not None:
+                self.assertEqual((msg.id, msg.data), (0x1234, b""))
+
+            msg = receive_message(self.netdimm)
+            self.assertIsNotNone(msg)
+            if msg is not None:
+                self.assertEqual((msg.id, msg.data), (0x5678, random))
+
+            self.assertIsNone(receive_message(self.netdimm))
+
+    def test_message_latency(self) -> None:
+        # Packet data moves through pipelined peeks and pokes, so a message costs a
+        # handful of round trips rather than one for every three bytes of payload.
+        self.dimm.latency = 0.01
+        random = os.urandom(1500)
+        self.target.queue_message(0x1234, random)
+
+        with self.netdimm.connection():
+            start = time.time()
+            send_message(self.netdimm, Message(0x5678, random))
+            msg = receive_message(self.netdimm)
+            elapsed = time.time() - start
+
+        self.assertIsNotNone(msg)
+        if msg is not None:
+            self.assertEqual((msg.id, msg.data), (0x1234, random))
+        self.assertEqual(self.target.messages, [(0x5678, random)])
+        self.assertLess(elapsed, (len(random) // 3) * 0.01 / 4)
+
+
+class TestPacketAssembler(unittest.TestCase):
+    def words(self, data: bytes) -> List[int]:
+        return [
+            ((index + 1) << 24) | int.from_bytes(data[(index * 3):((index * 3) + 3)].ljust(3, b"\0"), "big")
+            for index in range((len(data) + 2) // 3)
+        ]
+
+    def test_out_of_order(self) -> None:
+        data = os.urandom(100)
+        words = self.words(data)
+        assembler = PacketAssembler(len(data))
+        self.assertEqual((assembler.missing, assembler.resume_point), (34, 0))
+
+        # Empty reads don't count as data.
+        self.assertFalse(assembler.add(0))
+        self.assertFalse(assembler.add(0xFFFFFFFF))
+
+        for word in words[10:] + words[10:12]:
+            self.assertTrue(assembler.add(word))
+        self.assertEqual((assembler.missing, assembler.resume_point), (10, 0))
+        for word in reversed(words[:9]):
+            assembler.add(word)
+        self.assertEqual((assembler.missing, assembler.resume_point), (1, 27))
+        self.assertFalse(assembler.complete)
+
+        assembler.add(words[9])
+        self.assertTrue(assembler.complete)
+        self.assertEqual(assembler.resume_point, len(data))
+        self.assertEqual(bytes(assembler.data), data)
+
+    def test_packet_lengths(self) -> None:
+        for length in [1, 2, 3, 4, MAX_PACKET_LENGTH]:
+            data = os.urandom(length)
+            assembler = PacketAssembler(length)
+            for word in self.words(data):
+                assembler.add(word)
+            self.assertTrue(assembler.complete)
+            self.assertEqual(bytes(assembler.data), data)
+
+
+class TestMailbox(unittest.TestCase):
+    def setUp(self) -> None:
+        # A small mailbox, so that packets have to wrap around the end of the rings.
+        self.target = SimulatedMessageTarget(mailbox_size=0x1000)
+        self.dimm = NetDimmSimulator(message_target=self.target)
+        self.dimm.start()
+        self.netdimm = NetDimm("127.0.0.1", port=self.dimm.port, timeout=5)
+
+    def tearDown(self) -> None:
+        self.dimm.stop()
+
+    def test_mailbox_packets(self) -> None:
+        mailbox = self.target.mailbox
+        self.assertIsNotNone(mailbox)
+        if mailbox is None:
+            return
+
+        with self.netdimm.connection():
+            for size in [1, 100, mailbox.max_packet_length, 7, mailbox.max_packet_length - 1]:
+                data = os.urandom(size)
+                self.target.queue_packet(data)
+                self.assertTrue(send_mailbox_packet(self.netdimm, mailbox, data))
+                self.assertEqual(receive_mailbox_packet(self.netdimm, mailbox), data)
+                self.assertIsNone(receive_mailbox_packet(self.netdimm, mailbox))
+
+                # Sends have no response, but receiving made a round trip since.
+                self.assertEqual(self.target.inbound[-1], data)
+
+    def test_mailbox_messages(self) -> None:
+        random = os.urandom(20000)
+        self.target.queue_message(0x1234, random)
+        self.target.queue_message(0x5678)
+
+        with self.netdimm.connection():
+            send_message(self.netdimm, Message(0x1111, random))
+            send_message(self.netdimm, Message(0x2222, b"A" * 5000))
+
+            msg = receive_message(self.netdimm)
+            self.assertIsNotNone(msg)
+            if msg is not None:
+                self.assertEqual((msg.id, msg.data), (0x1234, random))
+            msg = receive_message(self.netdimm)
+            self.assertIsNotNone(msg)
+            if msg is not None:
+                self.assertEqual((msg.id, msg.data), (0x5678, b""))
+            self.assertIsNone(receive_message(self.netdimm))
+
+        self.assertEqual(self.target.messages, [(0x1111, random), (0x2222, b"A" * 5000)])
+
+    def test_mailbox_packet_count(self) -> None:
+        # The same message over the data register and over the mailbox, where the mailbox
+        # should need a tiny fraction of the round trips.
+        random = os.urandom(3000)
+        with self.netdimm.connection():
+            send_message(self.netdimm, Message(0x1234, random))
+        mailbox_packets = self.dimm.stats.total_packets_received
+
+        with NetDimmSimulator(message_target=SimulatedMessageTarget()) as dimm:
+            netdimm = NetDimm("127.0.0.1", port=dimm.port, timeout=5)
+            with netdimm.connection():
+                send_message(netdimm, Message(0x1234, random))
+            register_packets = dimm.stats.total_packets_received
+
+        self.assertLess(mailbox_packets * 20, register_packets)
+
+
+class TestMessageChannel(unittest.TestCase):
+    def test_concurrent_cabinets(self) -> None:
+        # One thread per cabinet, all in the same process, each with their own sequences.
+        targets = [SimulatedMessageTarget(mailbox_size=(0x1000 if i % 2 else None)) for i in range(4)]
+        dimms = [NetDimmSimulator(message_target=target) for target in targets]
+        for dimm in dimms:
+            dimm.start()
+        payloads = [os.urandom(1000 + i) for i in range(4)]
+        for target, payload in zip(targets, payloads):
+            target.queue_message(0x1000, payload)
+            target.queue_message(0x1001, payload[::-1])
+
+        received: List[List[Optional[Message]]] = [[] for _ in dimms]
+        errors: List[Exception] = []
+
+        def talk(index: int) -> None:
+            try:
+                channel = MessageChannel(NetDimm("127.0.0.1", port=dimms[index].port, timeout=5))
+                for _ in range(3):
+                    channel.send(Message(0x2000 + index, payloads[index]))
+                received[index].append(channel.receive())
+                received[index].append(channel.receive())
+                received[index].append(channel.receive())
+            except Exception as e:
+                errors.append(e)
+
+        threads = [threading.Thread(target=talk, args=(i,)) for i in range(len(dimms))]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        for dimm in dimms:
+            dimm.stop()
+
+        self.assertEqual(errors, [])
+        for index, target in enumerate(targets):
+            self.assertEqual(target.messages, [(0x2000 + index, payloads[index])] * 3)
+            messages = [(msg.id, msg.data) if msg is not None else None for msg in received[index]]
+            self.assertEqual(messages, [(0x1000, payloads[index]), (0x1001, payloads[index][::-1]), None])
+
+    def test_shared_channel(self) -> None:
+        # Several threads sending through the same channel take turns.
+        target = SimulatedMessageTarget()
+        with NetDimmSimulator(message_target=target) as dimm:
+            channel = MessageChannel(NetDimm("127.0.0.1", port=dimm.port, timeout=5))
+
+            def send(index: int) -> None:
+                for count in range(5):
+                    channel.send(Message(index, bytes([count]) * 300))
+
+            threads = [threading.Thread(target=send, args=(i,)) for i in range(4)]
+            for thread in threads:
+                thread.start()
+            for thread in threads:
+                thread.join()
+            self.assertIsNone(channel.receive())
+
+        self.assertEqual(sorted(target.messages), sorted((i, bytes([c]) * 300) for i in range(4) for c in range(5)))
+
+    def test_cached_config(self) -> None:
+        target = SimulatedMessageTarget()
+        with NetDimmSimulator(message_target=target) as dimm:
+            channel = MessageChannel(NetDimm("127.0.0.1", port=dimm.port, timeout=5))
+            with channel.netdimm.connection():
+                self.assertIsNone(channel.receive())
+
+                # Polling for messages only has to check the status register now.
+                before = dimm.stats.total_packets_received
+                self.assertIsNone(channel.receive())
+                self.assertEqual(dimm.stats.total_packets_received - before, 1)
+
+                # Forgetting what we know reads the config register again.
+                channel.invalidate()
+                before = dimm.stats.total_packets_received
+                self.assertIsNone(channel.receive())
+                self.assertEqual(dimm.stats.total_packets_received - before, 2)
+
+    def test_adaptive_compression(self) -> None:
+        text = b"".join(f"line {i}: the quick brown fox\n".encode("ascii") for i in range(200))
+        random = os.urandom(2000)
+
+        target = SimulatedMessageTarget()
+        with NetDimmSimulator(message_target=target) as dimm:
+            channel = MessageChannel(NetDimm("127.0.0.1", port=dimm.port, timeout=5))
+            results: List[Tuple[Optional[str], Optional[int], str]] = []
+            for payload in [text, text[:500], random, b"tiny"]:
+                channel.send(Message(0x1234, payload))
+                stats = channel.last_send
+                self.assertIsNotNone(stats)
+                if stats is not None:
+                    results.append((stats.codec, stats.level, stats.reason))
+                    self.assertEqual(stats.length, len(payload))
+            self.assertIsNone(channel.receive())
+
+        # The data register is slow, so anything worth compressing gets compressed hard,
+        # although short payloads don't get the best level. Loopback is much faster than
+        # real hardware, so after the first send the link no longer counts as slow.
+        self.assertEqual([(codec, level) for codec, level, _ in results[:2]], [("zlib", 9), ("zlib", 6)])
+        self.assertEqual(results[0][2], "slow link")
+        self.assertEqual(results[2:], [
+            (None, None, "incompressible"),
+            (None, None, "too small"),
+        ])
+        self.assertEqual(target.messages, [(0x1234, p) for p in [text, text[:500], random, b"tiny"]])
+
+        target = SimulatedMessageTarget(mailbox_size=0x1000)
+        with NetDimmSimulator(message_target=target) as dimm:
+            channel = MessageChannel(NetDimm("127.0.0.1", port=dimm.port, timeout=5))
+            channel.send(Message(0x1234, text * 4))
+            stats = channel.last_send
+            self.assertIsNotNone(stats)
+            if stats is not None:
+                # The mailbox is fast, so only the cheapest level pays for itself.
+                self.assertEqual((stats.codec, stats.level), ("zlib", 1))
+                self.assertLess(stats.ratio, 0.5)
+                self.assertGreaterEqual(stats.compress_time, 0.0)
+            channel.send(Message(0x1234, text[:2000]))
+            stats = channel.last_send
+            if stats is not None:
+                self.assertEqual((stats.codec, stats.reason), (None, "single packet"))
+            self.assertIsNone(channel.receive())
+
+        self.assertEqual(target.messages, [(0x1234, text * 4), (0x1234, text[:2000])])
+
+    def test_choose_compression(self) -> None:
+        text = b"hello, world! " * 500
+        config = CONFIG_MESSAGE_EXISTS | CONFIG_MESSAGE_HAS_ZLIB
+        self.assertEqual(choose_compression(text, CONFIG_MESSAGE_EXISTS, 1024, 745)[2], "no codec")
+        self.assertEqual(choose_compression(text, config, 1024, 745)[1], 9)
+        self.assertEqual(choose_compression(text, config, 256 * 1024, 745)[1], 6)
+        self.assertEqual(choose_compression(text, config, 16 * 1024 * 1024, 745)[1], 1)
+        self.assertEqual(choose_compression(text, config, 16 * 1024 * 1024, 0x8000)[2], "single packet")
+
+
+class TestMessageStream(unittest.TestCase):
+    def test_send_stream(self) -> None:
+        # Bigger than any single message could be, over both transports.
+        for mailbox_size, size in [(0x10000, 300000), (None, 70000)]:
+            target = SimulatedMessageTarget(mailbox_size=mailbox_size)
+            payload = os.urandom(size)
+            with NetDimmSimulator(message_target=target) as dimm:
+                channel = MessageChannel(NetDimm("127.0.0.1", port=dimm.port, timeout=5))
+                progress: List[Tuple[int, int]] = []
+                channel.send_stream(0x1234, payload, progress=lambda done, total: progress.append((done, total)))
+
+                # Iterables work too, as long as we're told how long they are.
+                pieces = [payload[i:(i + 1000)] for i in range(0, 5000, 1000)]
+                channel.send_stream(0x5678, iter(pieces), length=5000)
+                channel.send_stream(0x1ABC, b"")
+                self.assertIsNone(channel.receive())
+
+            self.assertEqual(target.streams, [(0x1234, payload), (0x5678, payload[:5000]), (0x1ABC, b"")])
+            self.assertEqual(target.messages, [])
+            self.assertEqual(progress[-1], (size, size))
+            self.assertEqual(progress, sorted(progress))
+
+    def test_receive_stream(self) -> None:
+        target = SimulatedMessageTarget(mailbox_size=0x10000)
+        payload = os.urandom(400000)
+        with NetDimmSimulator(message_target=target) as dimm:
+            channel = MessageChannel(NetDimm("127.0.0.1", port=dimm.port, timeout=5))
+            self.assertIsNone(channel.receive_stream())
+
+            target.queue_stream(0x1234, payload)
+            target.queue_message(0x5555, b"in between")
+            stream = None
+            while stream is None:
+                stream = channel.receive_stream()
+            self.assertEqual((stream.id, stream.length), (0x1234, len(payload)))
+
+            # The program can't get more than a window ahead of what we've consumed.
+            chunks = iter(stream)
+            first = next(chunks)
+            self.assertIsNone(channel.receive_stream())
+            self.assertLessEqual(target.max_in_flight, STREAM_WINDOW)
+
+            progress: List[Tuple[int, int]] = []
+            stream.progress = lambda done, total: progress.append((done, total))
+            self.assertEqual(first + b"".join(chunks), payload)
+            self.assertEqual(progress[-1], (len(payload), len(payload)))
+
+            # Ordinary messages that arrived along the way are still there.
+            msg = channel.receive()
+            self.assertIsNotNone(msg)
+            if msg is not None:
+                self.assertEqual((msg.id, msg.data), (0x5555, b"in between"))
+            self.assertIsNone(channel.receive())
+            self.assertEqual(target.outgoing_streams, {})
+
+    def test_streams_unsupported(self) -> None:
+        target = SimulatedMessageTarget(streams_enabled=False)
+        with NetDimmSimulator(message_target=target) as dimm:
+            channel = MessageChannel(NetDimm("127.0.0.1", port=dimm.port, timeout=5))
+            with self.assertRaises(MessageException):
+                channel.send_stream(0x1234, b"data")
+            with self.assertRaises(MessageException):
+                channel.send_stream(0x1234, iter([b"data"]))
+
+
+class TestMessagePoller(unittest.TestCase):
+    def test_backoff(self) -> None:
+        target = SimulatedMessageTarget()
+        with NetDimmSimulator(message_target=target) as dimm:
+            poller = MessagePoller(MessageChannel(NetDimm("127.0.0.1", port=dimm.port, timeout=5)), max_interval=0.05)
+            with poller.channel.netdimm.connection():
+                # Sitting idle, polls get further and further apart.
+                start = time.time()
+                while time.time() - start < 0.5:
+                    self.assertIsNone(poller.poll())
+                self.assertEqual(poller.interval, 0.05)
+                self.assertLess(poller.polls, 25)
+                idle_polls = dimm.stats.total_packets_received
+
+                # Traffic snaps the interval right back down.
+                target.queue_message(0x1234, b"hello")
+                target.queue_message(0x5678, b"world")
+                msg = None
+                while msg is None:
+                    msg = poller.poll()
+                self.assertEqual(poller.interval, poller.min_interval)
+                msg = poller.poll()
+                self.assertIsNotNone(msg)
+                if msg is not None:
+                    self.assertEqual((msg.id, msg.data), (0x5678, b"world"))
+
+            stats = poller.stats
+            self.assertEqual(stats["messages"], 2)
+            self.assertEqual(stats["polls"], stats["messages"] + stats["empty_polls"])
+            self.assertGreater(stats["idle_time"], 0.4)
+            self.assertLess(stats["idle_cpu_percent"], 50.0)
+
+            # Capabilities are cached, so an idle poll only costs a status register read.
+            self.assertLess(idle_polls, poller.polls + 10)
+
+    def test_dead_register(self) -> None:
+        class DeadTarget(SimulatedMessageTarget):
+            def peek(self, addr: int) -> Optional[int]:
+                return 0 if addr == CONFIG_REGISTER else super().peek(addr)
+
+        # A register that reads as zero used to spin forever instead of timing out.
+        with NetDimmSimulator(message_target=DeadTarget()) as dimm, mock.patch("netdimm.message.MAX_READ_TIMEOUT", 0.2):
+            netdimm = NetDimm("127.0.0.1", port=dimm.port, timeout=5)
+            start = time.time()
+            self.assertIsNone(read_config_register(netdimm))
+            self.assertLess(time.time() - start, 2.0)
+
+            # And it backed off rather than peeking as fast as it could.
+            self.assertLess(dimm.stats.total_packets_received, 20)
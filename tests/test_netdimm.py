@@ -0,0 +1,631 @@
+import json
+import mmap
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import unittest
+from typing import Any, Dict, List, Tuple, Union
+from unittest import mock
+
+from netdimm import NetDimm, NetDimmBroadcast, NetDimmManifest, CRCStatusEnum, PeekPokeTypeEnum
+from netdimm.netdimm import _prepare_blocks
+from netdimm.simulator import NetDimmSimulator
+
+
+class CopyCountingSocket:
+    # Wraps a socket and tallies how many of the bytes handed to it were freshly
+    # allocated copies rather than views over the source buffer we are sending.
+    def __init__(self, sock: socket.socket, source: object) -> None:
+        self.sock = sock
+        self.source = source
+        self.copied: int = 0
+        self.total: int = 0
+
+    def __tally(self, buffers: List[Any]) -> None:
+        for buf in buffers:
+            self.total += len(buf)
+            if not (isinstance(buf, memoryview) and buf.obj is self.source):
+                self.copied += len(buf)
+
+    def sendmsg(self, buffers: List[Any]) -> int:
+        self.__tally(buffers)
+        return self.sock.sendmsg(buffers)
+
+    def sendall(self, data: Union[bytes, memoryview]) -> None:
+        self.__tally([data])
+        self.sock.sendall(data)
+
+    def __getattr__(self, name: str) -> Any:
+        return getattr(self.sock, name)
+
+
+class FailingSocket:
+    # Wraps a socket and drops the connection once a certain number of bytes have
+    # been sent, like a network blip partway through a transfer.
+    def __init__(self, sock: socket.socket, limit: int) -> None:
+        self.sock = sock
+        self.limit = limit
+
+    def sendmsg(self, buffers: List[Any]) -> int:
+        length = sum(len(buf) for buf in buffers)
+        if length > self.limit:
+            raise ConnectionResetError("Connection reset by peer")
+        self.limit -= length
+        return self.sock.sendmsg(buffers)
+
+    def __getattr__(self, name: str) -> Any:
+        return getattr(self.sock, name)
+
+
+class TestNetDimm(unittest.TestCase):
+    def setUp(self) -> None:
+        self.dimm = NetDimmSimulator()
+        self.dimm.start()
+
+    def tearDown(self) -> None:
+        self.dimm.stop()
+
+    def spawn_netdimm(self) -> NetDimm:
+        return NetDimm("127.0.0.1", port=self.dimm.port, timeout=5)
+
+    def send_counting_copies(self, data: Union[bytes, memoryview], source: object) -> Dict[str, int]:
+        netdimm = self.spawn_netdimm()
+        with netdimm.connection():
+            counter = CopyCountingSocket(netdimm.sock, source)  # type: ignore
+            netdimm.sock = counter  # type: ignore
+            netdimm.send(data, disable_now_loading=True)
+            netdimm.sock = counter.sock
+
+        # Round trip through the info call so we know the server processed everything.
+        netdimm.info()
+        return {"copied": counter.copied, "total": counter.total}
+
+    def test_send_bytes(self) -> None:
+        data = os.urandom(0x8000 * 5 + 123)
+        netdimm = self.spawn_netdimm()
+        netdimm.send(data, disable_now_loading=True)
+        netdimm.info()
+
+        self.assertEqual(self.dimm.read(0, len(data)), data)
+        self.assertEqual(self.dimm.information, (NetDimm.crc(data), len(data)))
+
+        stats = netdimm.last_transfer
+        self.assertIsNotNone(stats)
+        if stats is not None:
+            self.assertEqual(stats.bytes_sent, len(data))
+            self.assertEqual(stats.packets_sent, 6)
+
+    def test_send_pipeline(self) -> None:
+        data = os.urandom(0x8000 * 12 + 321)
+        prepared: List[int] = []
+        ahead: List[int] = []
+
+        def counting(*args: Any, **kwargs: Any) -> Any:
+            for block in _prepare_blocks(*args, **kwargs):
+                prepared.append(block[0])
+                yield block
+
+        def callback(sent: int, total: int) -> None:
+            # How far the producer has got ahead of what's gone out on the wire.
+            ahead.append(len(prepared) - (sent // 0x8000))
+            time.sleep(0.01)
+
+        # With the smallest queue and a slow consumer, the producer has to keep waiting
+        # for room and still hand over every block in order.
+        netdimm = self.spawn_netdimm()
+        with mock.patch.object(NetDimm, "UPLOAD_PIPELINE_DEPTH", 1), mock.patch("netdimm.netdimm._prepare_blocks", counting):
+            netdimm.send(data, disable_now_loading=True, progress_callback=callback)
+        netdimm.info()
+
+        self.assertEqual(self.dimm.read(0, len(data)), data)
+        self.assertEqual(self.dimm.information, (NetDimm.crc(data), len(data)))
+        self.assertEqual(prepared, [0x8000 * i for i in range(13)])
+        self.assertLessEqual(max(ahead), 3)
+
+    def test_send_pipeline_producer_failure(self) -> None:
+        data = os.urandom(0x8000 * 8)
+        failure = OSError("Disk went away")
+
+        def failing(*args: Any, **kwargs: Any) -> Any:
+            for block in _prepare_blocks(*args, **kwargs):
+                if block[0] == 0x8000 * 2:
+                    raise failure
+                yield block
+
+        # Whatever goes wrong preparing blocks comes out of send() instead of leaving it
+        # waiting on a block that never shows up.
+        netdimm = self.spawn_netdimm()
+        errors: List[BaseException] = []
+
+        def send() -> None:
+            try:
+                netdimm.send(data, disable_now_loading=True)
+            except BaseException as e:
+                errors.append(e)
+
+        with mock.patch("netdimm.netdimm._prepare_blocks", failing):
+            thread = threading.Thread(target=send)
+            thread.start()
+            thread.join(10.0)
+        self.assertFalse(thread.is_alive())
+        self.assertEqual(len(errors), 1)
+        self.assertIs(errors[0], failure)
+
+        # What did make it out is remembered so a later send can carry on from there.
+        manifest = netdimm.last_manifest
+        self.assertTrue(manifest is not None and not manifest.complete and manifest.length == 0x8000 * 2)
+
+    def test_send_mapped_file_zero_copy(self) -> None:
+        data = os.urandom(0x8000 * 8)
+        with tempfile.TemporaryFile() as fp:
+            fp.write(data)
+            fp.flush()
+
+            with mmap.mmap(fp.fileno(), 0, access=mmap.ACCESS_READ) as mm:
+                with memoryview(mm) as view:
+                    counts = self.send_counting_copies(view, mm)
+
+        self.assertEqual(self.dimm.read(0, len(data)), data)
+        self.assertEqual(self.dimm.information, (NetDimm.crc(data), len(data)))
+
+        # Only packet headers should have been built, never any payload bytes. Upload
+        # packets carry 14 bytes of header for every 0x8000 bytes of payload.
+        ratio = float(counts["copied"]) / float(len(data))
+        self.assertLess(ratio, 0.01)
+
+        # Compare with sending plain bytes, where every payload byte is sliced out
+        # of the source and thus copied exactly once on its way to the socket.
+        bytes_counts = self.send_counting_copies(data, data)
+        bytes_ratio = float(bytes_counts["copied"]) / float(len(data))
+        self.assertGreaterEqual(bytes_ratio, 1.0)
+        self.assertLess(bytes_ratio, 1.01)
+
+    def test_send_partial_writes(self) -> None:
+        data = os.urandom(0x8000 * 2)
+
+        class TrickleSocket:
+            # Accept at most a handful of bytes per call to force resends.
+            def __init__(self, sock: socket.socket) -> None:
+                self.sock = sock
+
+            def sendmsg(self, buffers: List[Any]) -> int:
+                first = bytes(buffers[0][:7])
+                self.sock.sendall(first)
+                return len(first)
+
+            def __getattr__(self, name: str) -> Any:
+                return getattr(self.sock, name)
+
+        netdimm = self.spawn_netdimm()
+        with netdimm.connection():
+            trickle = TrickleSocket(netdimm.sock)  # type: ignore
+            netdimm.sock = trickle  # type: ignore
+            netdimm.send_chunk(0, data)
+            netdimm.sock = trickle.sock
+
+        # Round trip through the info call so we know the server processed everything.
+        netdimm.info()
+        self.assertEqual(self.dimm.read(0, len(data)), data)
+
+    def test_receive(self) -> None:
+        data = os.urandom(0x8000 * 3 + 0x1234)
+        self.dimm.load_game(data)
+
+        progress: List[Tuple[int, int]] = []
+        netdimm = self.spawn_netdimm()
+        self.assertEqual(netdimm.receive(lambda cur, tot: progress.append((cur, tot))), data)
+        self.assertEqual(progress[0], (0, len(data)))
+        self.assertEqual(progress[-1], (len(data), len(data)))
+
+        self.assertEqual(netdimm.receive_chunk(0x1000, 0x9000), data[0x1000:0xA000])
+
+    def test_receive_to_file(self) -> None:
+        data = os.urandom(0x8000 * 3 + 0x1234)
+        self.dimm.load_game(data)
+
+        with tempfile.TemporaryDirectory() as tmpdir:
+            path = os.path.join(tmpdir, "game.bin")
+            netdimm = self.spawn_netdimm()
+            self.assertTrue(netdimm.receive_to_file(path))
+            with open(path, "rb") as bfp:
+                self.assertEqual(bfp.read(), data)
+
+            # No game means no file.
+            self.dimm.crc_status = 3
+            path = os.path.join(tmpdir, "nothing.bin")
+            self.assertFalse(netdimm.receive_to_file(path))
+            self.assertFalse(os.path.exists(path))
+
+    def measure_receive_rss(self, method: str, path: str) -> int:
+        # Run the receive in a fresh interpreter so we can look at how far the peak
+        # RSS climbs above the baseline of an interpreter that has imported everything.
+        # On Linux, ru_maxrss is inherited across fork/exec from this (much larger)
+        # test process, so read the high water mark for the new process image instead.
+        script = "\n".join([
+            "import os, resource",
+            "from netdimm import NetDimm",
+            "def peak():",
+            "    if os.path.exists('/proc/self/status'):",
+            "        with open('/proc/self/status') as fp:",
+            "            return [int(line.split()[1]) * 1024 for line in fp if line.startswith('VmHWM:')][0]",
+            "    return resource.getrusage(resource.RUSAGE_SELF).ru_maxrss",
+            f"netdimm = NetDimm('127.0.0.1', port={self.dimm.port}, timeout=5)",
+            "before = peak()",
+            f"netdimm.receive_to_file({repr(path)})" if method == "file" else "data = netdimm.receive()",
+            "print(peak() - before)",
+        ])
+        env = {**os.environ, "PYTHONPATH": os.pathsep.join(p for p in sys.path if p)}
+        output = subprocess.check_output([sys.executable, "-c", script], env=env)
+        return int(output.decode("utf-8").strip())
+
+    @unittest.skipIf(sys.platform == "win32", "Peak RSS is not available on Windows")
+    def test_receive_to_file_peak_rss(self) -> None:
+        data = os.urandom(32 * 1024 * 1024)
+        self.dimm.load_game(data)
+
+        with tempfile.TemporaryDirectory() as tmpdir:
+            path = os.path.join(tmpdir, "game.bin")
+            streamed = self.measure_receive_rss("file", path)
+            self.assertEqual(os.path.getsize(path), len(data))
+            buffered = self.measure_receive_rss("memory", path)
+
+        # Holding the game in memory has to cost the game itself but not a copy of it,
+        # while streaming it to disk should stay well under that.
+        self.assertGreater(buffered, len(data))
+        self.assertLess(buffered, len(data) * 3 // 2)
+        self.assertLess(streamed, len(data) // 4)
+
+    def test_info_and_reboot(self) -> None:
+        data = os.urandom(0x8000 * 2)
+        netdimm = self.spawn_netdimm()
+
+        info = netdimm.info()
+        self.assertEqual(info.current_game_size, 0)
+        self.assertEqual(info.memory_size, 512)
+
+        netdimm.send(data, disable_now_loading=True)
+        netdimm.reboot()
+
+        info = netdimm.info()
+        self.assertEqual(info.current_game_crc, NetDimm.crc(data))
+        self.assertEqual(info.current_game_size, len(data))
+        self.assertEqual(info.game_crc_status, CRCStatusEnum.STATUS_VALID)
+        self.assertEqual(self.dimm.time_limit, 10)
+
+        # Corrupt the game and make sure the CRC check catches it.
+        netdimm.send_chunk(0, b"\0" * 16)
+        netdimm.reboot()
+        self.assertEqual(netdimm.info().game_crc_status, CRCStatusEnum.STATUS_INVALID)
+
+        # Sending with CRC checking disabled should boot straight through.
+        netdimm.send(data, disable_crc_check=True, disable_now_loading=True)
+        netdimm.reboot()
+        self.assertEqual(netdimm.info().game_crc_status, CRCStatusEnum.STATUS_DISABLED)
+
+        # Wiping should make the game invalid on next boot.
+        netdimm.wipe_current_game()
+        netdimm.send(data, disable_now_loading=True)
+        netdimm.wipe_current_game()
+        netdimm.reboot()
+        self.assertEqual(netdimm.info().game_crc_status, CRCStatusEnum.STATUS_INVALID)
+
+    def test_peek_poke(self) -> None:
+        netdimm = self.spawn_netdimm()
+        with netdimm.connection():
+            netdimm.poke(0xc000000, PeekPokeTypeEnum.TYPE_LONG, 0x12345678)
+            self.assertEqual(netdimm.peek(0xc000000, PeekPokeTypeEnum.TYPE_LONG), 0x12345678)
+            self.assertEqual(netdimm.peek(0xc000002, PeekPokeTypeEnum.TYPE_SHORT), 0x1234)
+            self.assertEqual(netdimm.peek(0xc000001, PeekPokeTypeEnum.TYPE_BYTE), 0x56)
+
+    def test_peek_poke_many(self) -> None:
+        self.dimm.latency = 0.02
+        netdimm = self.spawn_netdimm()
+        addrs = [0xc000000 + (i * 4) for i in range(200)]
+        with netdimm.connection():
+            start = time.time()
+            netdimm.poke_many([(addr, i * 3) for i, addr in enumerate(addrs)], PeekPokeTypeEnum.TYPE_LONG)
+            values = netdimm.peek_many(addrs, PeekPokeTypeEnum.TYPE_LONG)
+            elapsed = time.time() - start
+
+            self.assertEqual(values, [i * 3 for i in range(200)])
+            self.assertEqual(netdimm.peek_many([], PeekPokeTypeEnum.TYPE_LONG), [])
+            self.assertEqual(netdimm.peek_many([0xc000002], PeekPokeTypeEnum.TYPE_SHORT), [0])
+
+            # Misaligned addresses are rejected before anything goes out.
+            with self.assertRaises(Exception):
+                netdimm.poke_many([(0xc000000, 1), (0xc000001, 2)], PeekPokeTypeEnum.TYPE_LONG)
+            self.assertEqual(netdimm.peek(0xc000000, PeekPokeTypeEnum.TYPE_LONG), 0)
+
+        # One round trip per window of peeks rather than one per peek.
+        windows = (len(addrs) + NetDimm.PEEK_PIPELINE_DEPTH - 1) // NetDimm.PEEK_PIPELINE_DEPTH
+        self.assertLess(elapsed, (windows + 2) * 0.02 * 5)
+
+    def test_peek_poke_bytes(self) -> None:
+        netdimm = self.spawn_netdimm()
+        data = os.urandom(1027)
+        with netdimm.connection():
+            # Start and end in the middle of longs so both ragged ends get exercised.
+            netdimm.poke_bytes(0xc000001, data)
+            netdimm.info()
+            before = self.dimm.stats.total_packets_received
+            self.assertEqual(netdimm.peek_bytes(0xc000001, len(data)), data)
+            packets = self.dimm.stats.total_packets_received - before
+
+            # The same bytes that peeking one byte at a time would have found.
+            for offset in [0, 1, 2, 3, 500, 1026]:
+                self.assertEqual(netdimm.peek(0xc000001 + offset, PeekPokeTypeEnum.TYPE_BYTE), data[offset])
+            for addr, length in [(0xc000002, 1), (0xc000001, 2), (0xc000004, 4), (0xc000003, 0)]:
+                self.assertEqual(netdimm.peek_bytes(addr, length), data[(addr - 0xc000001):(addr - 0xc000001 + length)])
+
+        # Roughly a quarter of the requests that byte-sized peeks would need.
+        self.assertLess(packets, (len(data) // 4) + 8)
+
+    def test_info_single_round_trip(self) -> None:
+        self.dimm.latency = 0.05
+        netdimm = self.spawn_netdimm()
+        data = os.urandom(0x8000)
+        with netdimm.connection():
+            netdimm.send(data, disable_now_loading=True)
+
+            # All four queries go out together, so this costs one latency and not four.
+            start = time.time()
+            info = netdimm.info()
+            elapsed = time.time() - start
+
+        self.assertEqual((info.current_game_crc, info.current_game_size), (NetDimm.crc(data), len(data)))
+        self.assertIn(info.game_crc_status, {CRCStatusEnum.STATUS_CHECKING, CRCStatusEnum.STATUS_VALID})
+        self.assertEqual(info.control_address, 0x8C000000)
+        self.assertLess(elapsed, 0.05 * 2.5)
+
+    def test_open_close(self) -> None:
+        netdimm = self.spawn_netdimm()
+        self.assertFalse(netdimm.is_connected())
+        netdimm.open()
+        try:
+            self.assertTrue(netdimm.is_connected())
+            for _ in range(3):
+                netdimm.info()
+                netdimm.peek(0xc000000, PeekPokeTypeEnum.TYPE_LONG)
+            self.assertTrue(netdimm.is_connected())
+        finally:
+            netdimm.close()
+        self.assertFalse(netdimm.is_connected())
+
+        # Everything above shared the one connection and the one startup packet.
+        self.assertEqual(netdimm.connects, 1)
+        self.assertEqual(self.dimm.stats.connections, 1)
+        self.assertEqual(self.dimm.stats.packets_received[0x01], 1)
+
+        # Notice when the net dimm hangs up on us.
+        netdimm.open()
+        try:
+            netdimm.info()
+            self.dimm.disconnect()
+            deadline = time.time() + 5.0
+            while netdimm.is_connected() and time.time() < deadline:
+                time.sleep(0.01)
+            self.assertFalse(netdimm.is_connected())
+        finally:
+            netdimm.close()
+        self.assertEqual(netdimm.connects, 2)
+
+    def test_is_connected_keeps_timeout(self) -> None:
+        # Checking the connection leaves the socket the way open() set it up, including
+        # when the alternate timeout handling left it blocking.
+        for handling, other, expected in [
+            ("DEFAULT_TIMEOUT_HANDLING", "ALTERNATE_TIMEOUT_HANDLING", 5.0),
+            ("ALTERNATE_TIMEOUT_HANDLING", "DEFAULT_TIMEOUT_HANDLING", None),
+        ]:
+            with mock.patch.dict(os.environ, {handling: "1"}):
+                os.environ.pop(other, None)
+                netdimm = NetDimm("127.0.0.1", port=self.dimm.port, timeout=5)
+                netdimm.open()
+                try:
+                    assert netdimm.sock is not None
+                    self.assertEqual(netdimm.sock.gettimeout(), expected)
+                    self.assertTrue(netdimm.is_connected())
+                    self.assertEqual(netdimm.sock.gettimeout(), expected)
+                finally:
+                    netdimm.close()
+
+    def test_simulated_latency(self) -> None:
+        self.dimm.latency = 0.05
+        netdimm = self.spawn_netdimm()
+        with netdimm.connection():
+            start = time.time()
+            for _ in range(4):
+                netdimm.peek(0xc000000, PeekPokeTypeEnum.TYPE_LONG)
+            elapsed = time.time() - start
+        self.assertGreaterEqual(elapsed, 0.2)
+
+    def test_simulated_bandwidth(self) -> None:
+        self.dimm.bandwidth = 1024 * 1024
+        data = os.urandom(256 * 1024)
+        netdimm = self.spawn_netdimm()
+
+        start = time.time()
+        netdimm.send_chunk(0, data)
+        netdimm.info()
+        elapsed = time.time() - start
+        self.assertGreaterEqual(elapsed, 0.2)
+        self.assertEqual(self.dimm.read(0, len(data)), data)
+
+    def test_send_delta(self) -> None:
+        data = bytearray(os.urandom(0x8000 * 8 + 0x123))
+        netdimm = self.spawn_netdimm()
+        netdimm.send(bytes(data), disable_now_loading=True)
+        netdimm.reboot()
+        manifest = netdimm.last_manifest
+        self.assertIsNotNone(manifest)
+        if manifest is None:
+            return
+        self.assertEqual((manifest.crc, manifest.length, len(manifest.blocks)), (NetDimm.crc(bytes(data)), len(data), 9))
+
+        # Manifests need to survive being saved and loaded again.
+        manifest = NetDimmManifest.from_json(json.loads(json.dumps(manifest.to_json())))
+
+        # Change a couple of blocks and grow the image, only those should go out.
+        data[0x8010] ^= 0xFF
+        data[0x8000 * 5 + 7] ^= 0xFF
+        data += os.urandom(0x100)
+        netdimm.send(bytes(data), disable_now_loading=True, previous=manifest)
+        netdimm.reboot()
+
+        # Reboots have no response, so round trip before looking at memory.
+        self.assertEqual(netdimm.info().game_crc_status, CRCStatusEnum.STATUS_VALID)
+        self.assertEqual(self.dimm.read(0, len(data)), bytes(data))
+        stats = netdimm.last_transfer
+        self.assertIsNotNone(stats)
+        if stats is not None:
+            # Blocks 1 and 5 changed, and the last block is always sent.
+            self.assertEqual(stats.packets_sent, 3)
+            self.assertEqual(stats.blocks_skipped, 6)
+
+        # A manifest that doesn't match what the net dimm verified is ignored.
+        stale = netdimm.last_manifest
+        self.assertIsNotNone(stale)
+        self.dimm.write(0x10, b"\0" * 16)
+        self.dimm.crc_status = 3
+        netdimm.send(bytes(data), disable_now_loading=True, previous=stale)
+        netdimm.info()
+        self.assertEqual(self.dimm.read(0, len(data)), bytes(data))
+        stats = netdimm.last_transfer
+        if stats is not None:
+            self.assertEqual(stats.blocks_skipped, 0)
+
+    def test_send_resume(self) -> None:
+        data = os.urandom(0x8000 * 8 + 0x123)
+        netdimm = self.spawn_netdimm()
+        with netdimm.connection():
+            failing = FailingSocket(netdimm.sock, 0x8000 * 5 + 0x4000)  # type: ignore
+            netdimm.sock = failing  # type: ignore
+            with self.assertRaises(Exception):
+                netdimm.send(data, disable_now_loading=True)
+            netdimm.sock = failing.sock
+
+        # Five blocks made it out before the connection dropped.
+        manifest = netdimm.last_manifest
+        self.assertIsNotNone(manifest)
+        if manifest is None:
+            return
+        self.assertFalse(manifest.complete)
+        self.assertEqual((manifest.length, len(manifest.blocks)), (0x8000 * 5, 5))
+        manifest = NetDimmManifest.from_json(json.loads(json.dumps(manifest.to_json())))
+        self.assertFalse(manifest.complete)
+
+        # Picking back up only sends what didn't make it the first time.
+        netdimm.send(data, disable_now_loading=True, previous=manifest)
+        netdimm.reboot()
+        self.assertEqual(netdimm.info().game_crc_status, CRCStatusEnum.STATUS_VALID)
+        self.assertEqual(self.dimm.read(0, len(data)), data)
+        stats = netdimm.last_transfer
+        self.assertIsNotNone(stats)
+        if stats is not None:
+            self.assertEqual(stats.blocks_skipped, 5)
+            self.assertEqual(stats.packets_sent, 4)
+        self.assertTrue(netdimm.last_manifest is not None and netdimm.last_manifest.complete)
+
+        # If the net dimm lost its memory since the interruption, start over.
+        self.dimm.write(0, b"\0" * 0x8000)
+        self.dimm.write(0xffff0000, b"\0" * 32)
+        netdimm.send(data, disable_now_loading=True, previous=manifest)
+        netdimm.info()
+        self.assertEqual(self.dimm.read(0, len(data)), data)
+        stats = netdimm.last_transfer
+        if stats is not None:
+            self.assertEqual(stats.blocks_skipped, 0)
+
+        # If the last block we thought we sent never arrived, resend from there.
+        self.dimm.write(0xffff0000, b"\0" * 32)
+        self.dimm.write(0x8000 * 4, b"\0" * 0x8000)
+        netdimm.send(data, disable_now_loading=True, previous=manifest)
+        netdimm.info()
+        self.assertEqual(self.dimm.read(0, len(data)), data)
+        stats = netdimm.last_transfer
+        if stats is not None:
+            self.assertEqual(stats.blocks_skipped, 4)
+
+
+class TestNetDimmBroadcast(unittest.TestCase):
+    def setUp(self) -> None:
+        self.dimms = [NetDimmSimulator() for _ in range(3)]
+        for dimm in self.dimms:
+            dimm.start()
+
+    def tearDown(self) -> None:
+        for dimm in self.dimms:
+            dimm.stop()
+
+    def spawn_netdimms(self) -> List[NetDimm]:
+        return [NetDimm("127.0.0.1", port=dimm.port, timeout=5) for dimm in self.dimms]
+
+    def assertReceived(self, netdimms: List[NetDimm], data: bytes) -> None:
+        for netdimm, dimm in zip(netdimms, self.dimms):
+            # Round trip so we know the simulator processed everything.
+            netdimm.info()
+            self.assertEqual(dimm.read(0, len(data)), data)
+            self.assertEqual(dimm.information, (NetDimm.crc(data), len(data)))
+
+    def test_send(self) -> None:
+        data = os.urandom(0x8000 * 10 + 123)
+        netdimms = self.spawn_netdimms()
+        progress: Dict[int, int] = {}
+
+        def callback(netdimm: NetDimm, sent: int, total: int) -> None:
+            progress[netdimm.port] = sent
+
+        broadcast = NetDimmBroadcast(data)
+        self.assertEqual(broadcast.send(netdimms, disable_now_loading=True, progress_callback=callback), [None, None, None])
+        self.assertReceived(netdimms, data)
+
+        # Every block was prepared once, no matter how many net dimms it went to.
+        self.assertEqual(broadcast.stats, {"blocks_prepared": 11, "blocks_prepared_detached": 0, "detached": 0})
+        self.assertEqual(progress, {dimm.port: len(data) for dimm in self.dimms})
+        for netdimm in netdimms:
+            self.assertTrue(netdimm.last_manifest is not None and netdimm.last_manifest.complete)
+
+    def test_failure_is_isolated(self) -> None:
+        data = os.urandom(0x8000 * 10)
+        netdimms = self.spawn_netdimms()
+
+        # Nothing is listening here, so this one fails to connect.
+        dead = NetDimmSimulator()
+        dead.start()
+        dead.stop()
+        netdimms.insert(1, NetDimm("127.0.0.1", port=dead.port, timeout=1))
+
+        results = NetDimmBroadcast(data, window=2).send(netdimms, disable_now_loading=True)
+        self.assertIsNotNone(results[1])
+        self.assertEqual([results[0], results[2], results[3]], [None, None, None])
+        del netdimms[1]
+        self.assertReceived(netdimms, data)
+
+    def test_slow_netdimm_is_cut_loose(self) -> None:
+        data = os.urandom(0x8000 * 40)
+        netdimms = self.spawn_netdimms()
+        finished: Dict[int, float] = {}
+
+        def callback(netdimm: NetDimm, sent: int, total: int) -> None:
+            if netdimm is netdimms[2]:
+                time.sleep(0.05)
+            if sent == total:
+                finished[netdimm.port] = time.time()
+
+        start = time.time()
+        broadcast = NetDimmBroadcast(data, window=4, lag_timeout=0.2)
+        self.assertEqual(broadcast.send(netdimms, disable_now_loading=True, progress_callback=callback), [None, None, None])
+        self.assertReceived(netdimms, data)
+
+        # The slow one went on alone instead of holding the others to its pace.
+        stats = broadcast.stats
+        self.assertEqual(stats["detached"], 1)
+        self.assertEqual(stats["blocks_prepared"], 40)
+        self.assertGreater(stats["blocks_prepared_detached"], 0)
+        self.assertLess(stats["blocks_prepared_detached"], 40)
+        self.assertLess(finished[self.dimms[0].port] - start, 1.0)
+        self.assertLess(finished[self.dimms[1].port] - start, 1.0)
+        self.assertGreaterEqual(finished[self.dimms[2].port] - start, 1.5)
@@ -0,0 +1,141 @@
+import mmap
+import os
+import random
+import socket
+import tempfile
+import unittest
+from typing import Any, List
+
+from netdimm import NetDimm, OverlayImage
+from netdimm.simulator import NetDimmSimulator
+
+
+class TestOverlayImage(unittest.TestCase):
+    def setUp(self) -> None:
+        self.tmpdir = tempfile.TemporaryDirectory()
+        self.path = os.path.join(self.tmpdir.name, "game.bin")
+        self.data = os.urandom(0x8000 * 4 + 321)
+        with open(self.path, "wb") as bfp:
+            bfp.write(self.data)
+        self.fp = open(self.path, "rb")
+
+    def tearDown(self) -> None:
+        self.fp.close()
+        self.tmpdir.cleanup()
+
+    def assertSame(self, overlay: OverlayImage, expected: bytearray) -> None:
+        self.assertEqual(len(overlay), len(expected))
+        self.assertEqual(overlay[:], bytes(expected))
+        self.assertEqual(b"".join(overlay.views()), bytes(expected))
+        self.assertEqual(NetDimm.crc(overlay), NetDimm.crc(bytes(expected)))
+
+    def test_unpatched(self) -> None:
+        overlay = OverlayImage(self.fp)
+        self.assertSame(overlay, bytearray(self.data))
+        self.assertEqual(overlay[5], self.data[5])
+        self.assertEqual(overlay[-1], self.data[-1])
+        self.assertEqual(overlay[100:50], b"")
+        self.assertEqual(overlay[1:100:3], self.data[1:100:3])
+
+        # Nothing patched means everything comes straight out of the mapping.
+        for piece in overlay.views(10, 0x10000):
+            self.assertIsInstance(piece, memoryview)
+
+    def test_random_edits(self) -> None:
+        # Apply the same random edits to an overlay and a bytearray and make sure they
+        # always agree, including across clones.
+        rng = random.Random(1234)
+        overlay = OverlayImage(self.fp)
+        expected = bytearray(self.data)
+        clones: List[Any] = []
+
+        for _ in range(500):
+            operation = rng.random()
+            if operation < 0.6 and len(expected) > 0:
+                start = rng.randrange(len(expected))
+                length = min(rng.randrange(1, 64), len(expected) - start)
+                value = bytes(rng.randrange(256) for _ in range(length))
+                overlay[start:(start + length)] = value
+                expected[start:(start + length)] = value
+            elif operation < 0.7 and len(expected) > 0:
+                index = rng.randrange(len(expected))
+                overlay[index] = 0x55
+                expected[index] = 0x55
+            elif operation < 0.8:
+                value = os.urandom(rng.randrange(1, 100))
+                overlay.append(value)
+                expected += value
+            elif operation < 0.85:
+                size = rng.randrange(len(expected) + 1)
+                overlay.truncate(size)
+                del expected[size:]
+            elif operation < 0.9:
+                clones.append((overlay.clone(), bytes(expected)))
+            else:
+                overlay = overlay + b"\x01\x02\x03"
+                expected += b"\x01\x02\x03"
+
+            start = rng.randrange(len(expected) + 1)
+            end = rng.randrange(start, len(expected) + 1)
+            self.assertEqual(overlay[start:end], bytes(expected[start:end]))
+
+        self.assertSame(overlay, expected)
+        for clone, contents in clones:
+            # Edits after cloning must not leak into the clone.
+            self.assertSame(clone, bytearray(contents))
+
+        # Merging keeps the patch list small even after lots of writes.
+        self.assertLess(overlay.patched_ranges, 300)
+
+    def test_search(self) -> None:
+        overlay = OverlayImage(self.fp)
+        overlay.SEARCH_WINDOW = 0x1000
+        needle = b"\xEE\xEE\xEE\xEE"
+
+        # Straddle a search window boundary.
+        overlay[0x2FFE:0x3002] = needle
+        self.assertEqual(overlay.search(needle), bytes(overlay[:]).find(needle))
+        self.assertEqual(overlay.search(needle, start=0x2FFE), 0x2FFE)
+        self.assertIsNone(overlay.search(needle, start=0x2FFF, end=0x3002))
+
+        # Find things in the appended tail as well.
+        overlay.append(b"needle in a haystack")
+        self.assertEqual(overlay.search(b"haystack"), len(self.data) + 12)
+
+    def test_send_zero_copy(self) -> None:
+        overlay = OverlayImage(self.fp)
+        overlay[0x100:0x104] = b"\x01\x02\x03\x04"
+        overlay[0x9000:0x9100] = b"\xAA" * 0x100
+        overlay.append(b"\xBB" * 0x1000)
+        expected = overlay[:]
+
+        class PieceCountingSocket:
+            # Tally how many payload bytes came from anywhere but the mapped file.
+            def __init__(self, sock: socket.socket) -> None:
+                self.sock = sock
+                self.copied = 0
+
+            def sendmsg(self, buffers: List[Any]) -> int:
+                for buf in buffers:
+                    if not (isinstance(buf, memoryview) and isinstance(buf.obj, mmap.mmap)):
+                        self.copied += len(buf)
+                return self.sock.sendmsg(buffers)
+
+            def __getattr__(self, name: str) -> Any:
+                return getattr(self.sock, name)
+
+        with NetDimmSimulator() as dimm:
+            netdimm = NetDimm("127.0.0.1", port=dimm.port, timeout=5)
+            with netdimm.connection():
+                counter = PieceCountingSocket(netdimm.sock)  # type: ignore
+                netdimm.sock = counter  # type: ignore
+                netdimm.send(overlay, disable_now_loading=True)
+                netdimm.sock = counter.sock
+            netdimm.info()
+
+            self.assertEqual(dimm.read(0, len(expected)), expected)
+            self.assertEqual(dimm.information, (NetDimm.crc(expected), len(expected)))
+
+        # Only headers, the patched bytes and the appended tail should have been copied.
+        packets = (len(expected) + 0x7FFF) // 0x8000
+        self.assertLessEqual(counter.copied, 0x4 + 0x100 + 0x1000 + (packets + 8) * 32)
@@ -0,0 +1,107 @@
+import socket
+import time
+import unittest
+
+from netboot.prober import LivenessProber, ProbeStats
+from netdimm.simulator import NetDimmSimulator
+
+
+class TestLivenessProber(unittest.TestCase):
+    def test_histogram(self) -> None:
+        stats = ProbeStats()
+        for rtt in [0.0005, 0.0015, 0.003, 0.003, None, 2.0]:
+            stats.record(rtt)
+
+        self.assertEqual((stats.successes, stats.failures), (1, 0))
+        result = stats.to_dict()
+        self.assertEqual(result["probes"], 6)
+        self.assertEqual(result["lost"], 1)
+        self.assertEqual(result["last_rtt_ms"], 2000.0)
+        self.assertEqual(result["rtt_histogram"]["<=1ms"], 1)
+        self.assertEqual(result["rtt_histogram"]["<=2ms"], 1)
+        self.assertEqual(result["rtt_histogram"]["<=5ms"], 2)
+        self.assertEqual(result["rtt_histogram"][">1000ms"], 1)
+        self.assertEqual(sum(result["rtt_histogram"].values()), 5)
+
+        stats.record(None)
+        stats.record(None)
+        self.assertEqual((stats.successes, stats.failures), (0, 2))
+
+    def test_tcp_probe(self) -> None:
+        # Nothing listening on this port once we let go of it, so connecting is refused.
+        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        sock.bind(("127.0.0.1", 0))
+        closed = sock.getsockname()[1]
+        sock.close()
+
+        with NetDimmSimulator() as dimm:
+            prober = LivenessProber(port=dimm.port, timeout=0.2, method="tcp")
+            results = prober.probe(["127.0.0.1", "198.51.100.1"])
+            self.assertIsNotNone(results["127.0.0.1"])
+            self.assertIsNone(results["198.51.100.1"])
+
+            # Refusing the connection still means the host is there.
+            prober = LivenessProber(port=closed, timeout=0.2, method="tcp")
+            self.assertIsNotNone(prober.probe(["127.0.0.1"])["127.0.0.1"])
+
+    def test_probe_thread(self) -> None:
+        with NetDimmSimulator() as dimm:
+            prober = LivenessProber(port=dimm.port, interval=0.02, timeout=0.1, method="tcp")
+            prober.add("127.0.0.1")
+            prober.add("198.51.100.1")
+
+            deadline = time.time() + 5.0
+            while time.time() < deadline:
+                if prober.consecutive("127.0.0.1")[0] >= 3 and prober.consecutive("198.51.100.1")[1] >= 3:
+                    break
+                time.sleep(0.01)
+
+            self.assertGreaterEqual(prober.consecutive("127.0.0.1")[0], 3)
+            self.assertEqual(prober.consecutive("127.0.0.1")[1], 0)
+            self.assertGreaterEqual(prober.consecutive("198.51.100.1")[1], 3)
+
+            stats = prober.stats("127.0.0.1")
+            self.assertGreaterEqual(stats["probes"], 3)
+            self.assertEqual(sum(stats["rtt_histogram"].values()), stats["probes"] - stats["lost"])
+
+            prober.reset("127.0.0.1")
+            prober.remove("198.51.100.1")
+            self.assertEqual(prober.consecutive("198.51.100.1"), (0, 0))
+
+    def test_pause(self) -> None:
+        with NetDimmSimulator() as dimm:
+            prober = LivenessProber(port=dimm.port, interval=0.02, timeout=0.1, method="tcp")
+            prober.add("127.0.0.1")
+            while prober.consecutive("127.0.0.1")[0] < 3:
+                time.sleep(0.01)
+
+            # Somebody else is talking to the net dimm, so the prober stays away from it.
+            prober.pause("127.0.0.1")
+            time.sleep(0.05)
+            connections = dimm.stats.connections
+            consecutive = prober.consecutive("127.0.0.1")
+            time.sleep(0.2)
+            self.assertEqual(prober.paused, ["127.0.0.1"])
+            self.assertEqual(dimm.stats.connections, connections)
+            self.assertEqual(prober.consecutive("127.0.0.1"), consecutive)
+
+            prober.resume("127.0.0.1")
+            time.sleep(0.2)
+            self.assertEqual(prober.paused, [])
+            self.assertGreater(dimm.stats.connections, connections)
+
+            # A pause that nobody renews runs out on its own.
+            prober.pause_limit = 0.1
+            prober.pause("127.0.0.1")
+            self.assertEqual(prober.paused, ["127.0.0.1"])
+            time.sleep(0.2)
+            connections = dimm.stats.connections
+            self.assertEqual(prober.paused, [])
+            time.sleep(0.2)
+            self.assertGreater(dimm.stats.connections, connections)
+            prober.remove("127.0.0.1")
+
+        # Pinging doesn't get in the net dimm's way, so there's no reason to stop.
+        prober = LivenessProber(method="icmp")
+        prober.pause("127.0.0.1")
+        self.assertEqual(prober.paused, [])
@@ -0,0 +1,105 @@
+import time
+import unittest
+from functools import partial
+from typing import List
+from unittest.mock import patch
+
+from netboot.scheduler import Scheduler
+
+
+class TestScheduler(unittest.TestCase):
+    def test_spread(self) -> None:
+        scheduler = Scheduler()
+        start = time.monotonic()
+        tasks = [scheduler.every(100.0, lambda: None, name=f"task {i}") for i in range(50)]
+
+        # Everything starts within its first interval, nowhere near each other. The first
+        # one is due right away, so it may have already run and moved on to its next.
+        offsets = sorted((task.deadline - start) % 100.0 for task in tasks)
+        self.assertGreater(min(b - a for a, b in zip(offsets, offsets[1:])), 0.5)
+        self.assertEqual(scheduler.stats["tasks"], 50)
+
+    def test_runs_and_cancel(self) -> None:
+        scheduler = Scheduler()
+        runs: List[float] = []
+        task = scheduler.every(0.02, lambda: runs.append(time.monotonic()), name="counter")
+        time.sleep(0.3)
+        task.cancel()
+        count = len(runs)
+
+        self.assertGreaterEqual(count, 8)
+        self.assertLessEqual(count, 16)
+        self.assertEqual(task.runs, count)
+        self.assertEqual(scheduler.tasks, [])
+
+        # Cancelled means it doesn't run again.
+        time.sleep(0.1)
+        self.assertEqual(len(runs), count)
+
+    def test_overruns_and_errors(self) -> None:
+        scheduler = Scheduler()
+        slow = scheduler.every(0.02, lambda: time.sleep(0.05), name="slow")
+
+        def broken() -> None:
+            raise Exception("Broken!")
+
+        with patch("netboot.scheduler.log"):
+            failing = scheduler.every(0.02, broken, name="broken")
+            time.sleep(0.4)
+        slow.cancel()
+        failing.cancel()
+
+        # Running over means skipping the runs we didn't have time for, not queueing them.
+        self.assertGreater(slow.runs, 0)
+        self.assertGreater(slow.overruns, 0)
+        self.assertGreaterEqual(slow.stats["max_duration_ms"], 50.0)
+
+        # A task that throws keeps getting run.
+        self.assertGreater(failing.runs, 1)
+        self.assertEqual(failing.errors, failing.runs)
+
+    def test_slow_tasks_dont_block(self) -> None:
+        # Like a handful of cabinets waiting on net dimms that aren't answering.
+        scheduler = Scheduler(workers=8, watchdog=0.2)
+        with patch("netboot.scheduler.log") as log:
+            slow = [scheduler.every(0.05, lambda: time.sleep(0.5), name=f"slow {i}") for i in range(5)]
+            fast = [scheduler.every(0.05, lambda: None, name=f"fast {i}") for i in range(40)]
+            time.sleep(0.45)
+            for task in slow + fast:
+                task.cancel()
+
+        # Everybody else kept going while the slow ones were stuck.
+        for task in fast:
+            self.assertGreaterEqual(task.runs, 5)
+        for task in slow:
+            self.assertEqual(task.runs, 0)
+
+        # The watchdog noticed the slow ones, once each.
+        time.sleep(0.2)
+        self.assertEqual([task.stalls for task in slow], [1] * 5)
+        self.assertEqual(log.call_count, 5)
+        self.assertEqual([task.runs for task in slow], [1] * 5)
+
+    def test_groups_run_one_at_a_time(self) -> None:
+        # Like every task for a host whose net dimm has stopped answering.
+        scheduler = Scheduler(workers=2)
+        running: List[str] = []
+        overlaps: List[List[str]] = []
+
+        def hang(name: str) -> None:
+            running.append(name)
+            if len(running) > 1:
+                overlaps.append(list(running))
+            time.sleep(0.2)
+            running.remove(name)
+
+        stuck = [scheduler.every(0.02, partial(hang, f"stuck {i}"), name=f"stuck {i}", group="stuck") for i in range(4)]
+        fast = scheduler.every(0.02, lambda: None, name="fast")
+        time.sleep(0.5)
+        for task in stuck + [fast]:
+            task.cancel()
+
+        # Only one of the stuck tasks was ever running, so the other worker was free.
+        self.assertEqual(overlaps, [])
+        self.assertGreaterEqual(fast.runs, 15)
+        self.assertGreater(sum(task.deferrals for task in stuck), 0)
@@ -0,0 +1,164 @@
+import os
+import sys
+import tempfile
+import time
+import unittest
+from typing import List
+from unittest.mock import patch
+
+from netboot.cabinet import Cabinet, CabinetManager, CabinetRegionEnum, CabinetStateEnum
+from netboot.hostutils import FanOut, Host
+from netboot.prober import LivenessProber
+from netboot.scheduler import Scheduler
+from netboot.transfers import TransferPolicyEnum, TransferScheduler
+from netdimm.simulator import NetDimmSimulator
+
+
+class TestTransferScheduler(unittest.TestCase):
+    def test_shortest_first(self) -> None:
+        transfers = TransferScheduler(max_concurrent=2)
+        self.assertEqual(transfers.request("10.0.0.1", 500), 0)
+        self.assertEqual(transfers.request("10.0.0.2", 400), 0)
+        self.assertEqual(transfers.request("10.0.0.3", 300), 1)
+        self.assertEqual(transfers.request("10.0.0.4", 100), 1)
+        self.assertEqual(transfers.position("10.0.0.3"), 2)
+        self.assertIsNone(transfers.position("10.0.0.5"))
+
+        # Pinned cabinets jump the line no matter how big their game is.
+        self.assertEqual(transfers.request("10.0.0.5", 900, pinned=True), 1)
+        self.assertEqual(transfers.stats["waiting"], ["10.0.0.5", "10.0.0.4", "10.0.0.3"])
+
+        transfers.release("10.0.0.1")
+        self.assertEqual(transfers.position("10.0.0.5"), 0)
+        self.assertEqual(transfers.position("10.0.0.4"), 1)
+
+        # Giving up a place in line moves everybody behind up.
+        transfers.release("10.0.0.4")
+        self.assertEqual(transfers.position("10.0.0.3"), 1)
+        self.assertEqual(transfers.stats["max_active"], 2)
+
+    def test_fifo(self) -> None:
+        transfers = TransferScheduler(max_concurrent=1, policy=TransferPolicyEnum.POLICY_FIFO)
+        self.assertEqual(transfers.request("10.0.0.1", 500), 0)
+        self.assertEqual(transfers.request("10.0.0.2", 400), 1)
+        self.assertEqual(transfers.request("10.0.0.3", 300), 2)
+
+    def test_bandwidth_split(self) -> None:
+        transfers = TransferScheduler(max_concurrent=4, bandwidth=1000.0, link_bandwidth=400.0)
+        transfers.request("10.0.0.1", 1)
+        rate = transfers.rate("10.0.0.1")
+        self.assertEqual(rate.value, 400.0)  # type: ignore
+
+        # More sends means a smaller share each, taking effect for sends already going.
+        for i in range(2, 5):
+            transfers.request(f"10.0.0.{i}", 1)
+        self.assertEqual(rate.value, 250.0)  # type: ignore
+        self.assertEqual(set(transfers.stats["rates"].values()), {250.0})
+
+        # Changing one limit leaves the others alone, and zero takes a limit away.
+        transfers.configure(max_concurrent=8)
+        self.assertEqual(rate.value, 250.0)  # type: ignore
+        transfers.configure(link_bandwidth=0)
+        self.assertEqual(rate.value, 250.0)  # type: ignore
+        transfers.configure(bandwidth=0)
+        self.assertEqual(rate.value, 0.0)  # type: ignore
+        self.assertEqual((transfers.max_concurrent, transfers.bandwidth, transfers.link_bandwidth), (8, None, None))
+
+    def test_unlimited_by_default(self) -> None:
+        transfers = TransferScheduler()
+        for i in range(20):
+            self.assertEqual(transfers.request(f"10.0.0.{i + 1}", 1000), 0)
+        self.assertEqual(set(transfers.stats["rates"].values()), {0.0})
+
+
+class TestTransferFleet(unittest.TestCase):
+    @unittest.skipUnless(sys.platform.startswith("linux"), "Needs every address in 127.0.0.0/8 to be local")
+    def test_time_to_all_booted(self) -> None:
+        # A venue's worth of cabinets all coming up at once, on their own addresses so
+        # they can all listen on the standard net dimm port.
+        count = 6
+        ips = [f"127.0.0.{i + 2}" for i in range(count)]
+        bandwidth = 1024.0 * 1024
+
+        with tempfile.TemporaryDirectory() as tmpdir:
+            roms: List[str] = []
+            for i in range(count):
+                rom = os.path.join(tmpdir, f"game{i}.bin")
+                with open(rom, "wb") as bfp:
+                    bfp.write(os.urandom(256 * 1024 + i * 64 * 1024))
+                roms.append(rom)
+            total = sum(os.path.getsize(rom) for rom in roms)
+
+            for ip in ips:
+                # Start with fresh net dimms, not ones we remember sending to before.
+                manifest = os.path.join(tempfile.gettempdir(), f"{ip}.manifest")
+                if os.path.exists(manifest):
+                    os.remove(manifest)
+
+            sims = [NetDimmSimulator(host=ip, port=10703) for ip in ips]
+            for sim in sims:
+                sim.start()
+            try:
+                # Everything the cabinets share is our own, so nothing is left running
+                # on the defaults once we're done.
+                transfers = TransferScheduler(max_concurrent=2, bandwidth=bandwidth)
+                scheduler = Scheduler()
+                prober = LivenessProber(method="tcp")
+                fanout = FanOut()
+                with patch.object(Host, "DEBOUNCE_SECONDS", 1), patch.object(CabinetManager, "TICK_SECONDS", 0.1):
+                    cabinets = [
+                        Cabinet(
+                            ip=ip,
+                            region=CabinetRegionEnum.REGION_USA,
+                            description=f"cabinet {ip}",
+                            filename=rom,
+                            patches={rom: []},
+                            settings={},
+                            srams={},
+                            outlet=None,
+                            quiet=True,
+                            transfers=transfers,
+                            fanout=fanout,
+                            prober=prober,
+                            scheduler=scheduler,
+                        )
+                        for ip, rom in zip(ips, roms)
+                    ]
+
+                    start = time.time()
+                    manager = CabinetManager(cabinets, scheduler=scheduler)
+                    queued: List[int] = []
+                    while time.time() - start < 60.0:
+                        states = [cab.state for cab in cabinets]
+                        queued.extend(progress for state, progress in states if state == CabinetStateEnum.STATE_WAIT_FOR_SEND_SLOT)
+                        if all(state == CabinetStateEnum.STATE_WAIT_FOR_CABINET_POWER_OFF for state, _ in states):
+                            break
+                        time.sleep(0.05)
+                    elapsed = time.time() - start
+
+                    for ip in ips:
+                        manager.remove_cabinet(ip)
+                    self.assertEqual(scheduler.tasks, [])
+                    self.assertEqual(prober.hosts, [])
+            finally:
+                for sim in sims:
+                    sim.stop()
+                for ip in ips:
+                    manifest = os.path.join(tempfile.gettempdir(), f"{ip}.manifest")
+                    if os.path.exists(manifest):
+                        os.remove(manifest)
+
+            # Everybody booted the game they were supposed to, no more than two at a time,
+            # with the rest showing their place in line while they waited.
+            for sim, rom in zip(sims, roms):
+                with open(rom, "rb") as bfp:
+                    data = bfp.read()
+                self.assertEqual(sim.read(0, len(data)), data)
+            self.assertEqual(transfers.stats["started"], count)
+            self.assertLessEqual(transfers.stats["max_active"], 2)
+            self.assertGreater(len(queued), 0)
+            self.assertTrue(all(1 <= position <= count - 2 for position in queued))
+
+            # The whole venue can't have gone any faster than the bandwidth budget allows.
+            self.assertGreaterEqual(elapsed, total / bandwidth)
+            self.assertLess(elapsed, 60.0)